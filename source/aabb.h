@@ -0,0 +1,70 @@
+#ifndef AABB_H
+#define AABB_H
+
+// axis-aligned bounding box, stored as one interval per axis
+class aabb {
+    public:
+        interval x, y, z;
+
+        aabb() {}   // empty, since intervals are empty by default
+
+        aabb(const interval& x, const interval& y, const interval& z) : x(x), y(y), z(z) {}
+
+        aabb(const point3& a, const point3& b) {
+            // a and b are opposite corners, in any order
+            x = (a[0] <= b[0]) ? interval(a[0], b[0]) : interval(b[0], a[0]);
+            y = (a[1] <= b[1]) ? interval(a[1], b[1]) : interval(b[1], a[1]);
+            z = (a[2] <= b[2]) ? interval(a[2], b[2]) : interval(b[2], a[2]);
+        }
+
+        aabb(const aabb& box0, const aabb& box1) : x(box0.x, box1.x), y(box0.y, box1.y), z(box0.z, box1.z) {}
+
+        const interval& axis_interval(int n) const {
+            if (n == 1) return y;
+            if (n == 2) return z;
+            return x;
+        }
+
+        bool hit(const ray& r, interval ray_t) const {
+            const vec3& d = r.direction();
+            return hit(r.origin(), vec3(1 / d[0], 1 / d[1], 1 / d[2]), ray_t);
+        }
+
+        // slab test with a precomputed reciprocal direction, for traversal loops that
+        // test one ray against many boxes
+        bool hit(const point3& orig, const vec3& inv_dir, interval ray_t) const {
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& ax = axis_interval(axis);
+
+                auto t0 = (ax.min - orig[axis]) * inv_dir[axis];
+                auto t1 = (ax.max - orig[axis]) * inv_dir[axis];
+                if (t0 > t1) std::swap(t0, t1);
+
+                if (t0 > ray_t.min) ray_t.min = t0;
+                if (t1 < ray_t.max) ray_t.max = t1;
+                if (ray_t.max <= ray_t.min) return false;
+            }
+            return true;
+        }
+
+        int longest_axis() const {
+            if (x.size() > y.size()) return x.size() > z.size() ? 0 : 2;
+            return y.size() > z.size() ? 1 : 2;
+        }
+
+        double surface_area() const {
+            if (x.size() < 0 || y.size() < 0 || z.size() < 0) return 0;
+            return 2 * (x.size() * y.size() + y.size() * z.size() + z.size() * x.size());
+        }
+
+        point3 centroid() const {
+            return point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max), 0.5 * (z.min + z.max));
+        }
+
+        static const aabb empty, universe;
+};
+
+const aabb aabb::empty = aabb(interval::empty, interval::empty, interval::empty);
+const aabb aabb::universe = aabb(interval::universe, interval::universe, interval::universe);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef ACCUMULATION_BUFFER_H
+#define ACCUMULATION_BUFFER_H
+
+#include "framebuffer.h"
+#include "sampler.h"
+
+#include <cstdint>
+#include <vector>
+
+// running sums for one pixel: all that is needed to take more samples of it later, or to
+// add in another render's samples of the same pixel
+struct pixel_sums {
+    double sum[3] = {0, 0, 0};              // linear color, summed over samples
+    double luminance_sq = 0;                // squared sample luminance, summed (the adaptive sampler's variance)
+    uint32_t count = 0;                     // samples taken
+    uint32_t reserved = 0;
+};
+
+static_assert(sizeof(pixel_sums) == 40, "pixel_sums is stored as is in checkpoint files");
+
+// the samples of a render so far, as sums rather than means so that renders can be resumed
+// and partial renders merged. sample k of a pixel always uses the same random stream for a
+// seed, so a render resumed from its own sums gives exactly the image of one uninterrupted run
+class accumulation_buffer {
+    public:
+        int width = 0;
+        int height = 0;
+        uint64_t seed = 0;                  // seed of the render that started the buffer
+        uint64_t fingerprint = 0;           // scene and view the samples are of (see render_fingerprint)
+        sampler_type sampling = sampler_type::independent;     // what drew the samples' numbers
+        std::vector<pixel_sums> pixels;     // row-major, top row first
+
+        accumulation_buffer() {}
+        accumulation_buffer(int width, int height, uint64_t seed)
+          : width(width), height(height), seed(seed), pixels(size_t(width) * height) {}
+
+        pixel_sums& at(int i, int j) { return pixels[size_t(j) * width + i]; }
+        const pixel_sums& at(int i, int j) const { return pixels[size_t(j) * width + i]; }
+
+        // mean color of each pixel, black where nothing has been sampled yet
+        framebuffer resolve() const {
+            framebuffer image(width, height);
+            for (size_t k = 0; k < pixels.size(); k++) {
+                const auto& p = pixels[k];
+                if (p.count > 0) image.pixels[k] = (1.0 / p.count) * color(p.sum[0], p.sum[1], p.sum[2]);
+            }
+            return image;
+        }
+
+        uint64_t total_samples() const {
+            uint64_t total = 0;
+            for (const auto& p : pixels) total += p.count;
+            return total;
+        }
+
+        // adds the samples of other, a render of the same image, into this one.
+        // returns false (and changes nothing) if other is of a different image or scene, or was
+        // sampled with another sampler
+        bool merge(const accumulation_buffer& other) {
+            if (other.width != width || other.height != height || other.fingerprint != fingerprint || other.sampling != sampling) {
+                return false;
+            }
+            for (size_t k = 0; k < pixels.size(); k++) {
+                auto& p = pixels[k];
+                const auto& q = other.pixels[k];
+                for (int c = 0; c < 3; c++) p.sum[c] += q.sum[c];
+                p.luminance_sq += q.luminance_sq;
+                p.count += q.count;
+            }
+            return true;
+        }
+};
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "camera.h"
+#include "scene_file.h"
+#include "sphere_set.h"
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Keyframed rigid motion for a frame sequence. An animation file is text like a scene file:
+//
+//     frames 120
+//     key camera 0
+//     key camera 119 rotate_y 360               # a turntable: orbit once around lookat
+//     key sphere 3 0
+//     key sphere 3 60 translate 0 2 0           # the fourth sphere rises 2 units by frame 60
+//     key mesh 0 0 about 0 0 0
+//     key mesh 0 119 rotate_y 90 about 0 0 0
+//
+// A key is a target (the camera, the k-th sphere or the k-th mesh of the scene, counting from
+// 0 in the order they appear), a frame, and a pose relative to the scene as loaded: turn by
+// rotate_y degrees about the vertical axis through the pivot, then move by translate. Unset
+// fields are 0. The pivot is the target's own center (the camera's lookat) unless 'about'
+// gives one. Poses are interpolated linearly between a target's keys and held before the
+// first and after the last.
+
+// one target's pose at one frame
+struct rigid_pose {
+    vec3 translate = vec3(0, 0, 0);
+    double rotate_y = 0;                    // degrees
+
+    vec3 rotate(const vec3& d) const {
+        auto theta = degrees_to_radians(rotate_y);
+        auto c = std::cos(theta), s = std::sin(theta);
+        return vec3(c * d.x() + s * d.z(), d.y(), -s * d.x() + c * d.z());
+    }
+
+    point3 apply(const point3& p, const point3& pivot) const { return pivot + rotate(p - pivot) + translate; }
+};
+
+class animation {
+    public:
+        enum class target_kind { camera, sphere, mesh };
+
+        struct keyframe {
+            int frame;
+            rigid_pose pose;
+        };
+
+        struct track {
+            target_kind kind;
+            int index = 0;                  // sphere or mesh number
+            bool has_pivot = false;
+            point3 pivot;
+            std::vector<keyframe> keys;     // sorted by frame
+
+            rigid_pose pose_at(int frame) const {
+                auto next = std::lower_bound(keys.begin(), keys.end(), frame,
+                                             [](const keyframe& key, int f) { return key.frame < f; });
+                if (next == keys.begin()) return keys.front().pose;
+                if (next == keys.end()) return keys.back().pose;
+
+                auto prev = next - 1;
+                double f = double(frame - prev->frame) / (next->frame - prev->frame);
+                rigid_pose pose;
+                pose.translate = (1 - f) * prev->pose.translate + f * next->pose.translate;
+                pose.rotate_y = (1 - f) * prev->pose.rotate_y + f * next->pose.rotate_y;
+                return pose;
+            }
+        };
+
+        int frames = 1;
+        std::vector<track> tracks;
+
+        // the track for a target, created on first use
+        track& track_for(target_kind kind, int index) {
+            for (auto& t : tracks) {
+                if (t.kind == kind && t.index == index) return t;
+            }
+            track& added = tracks.emplace_back();
+            added.kind = kind;
+            added.index = index;
+            return added;
+        }
+};
+
+// reads an animation file. errors are reported to std::cerr as name:line and make it return false
+inline bool read_animation(std::istream& in, const std::string& name, animation& anim) {
+    std::string line, keyword, target, field;
+    int line_number = 0;
+
+    auto fail = [&](const std::string& message) {
+        std::cerr << name << ':' << line_number << ": " << message << '\n';
+        return false;
+    };
+
+    while (std::getline(in, line)) {
+        line_number++;
+        auto comment = line.find('#');
+        if (comment != std::string::npos) line.resize(comment);
+
+        scene_fields fields(line);
+        if (!fields.read(keyword)) continue;
+
+        if (keyword == "frames") {
+            if (!fields.read(anim.frames) || anim.frames <= 0) return fail("expected 'frames N' with N > 0");
+        } else if (keyword == "key") {
+            if (!fields.read(target)) return fail("expected 'key camera|sphere K|mesh K FRAME ...'");
+
+            animation::target_kind kind;
+            int index = 0;
+            if (target == "camera") kind = animation::target_kind::camera;
+            else if (target == "sphere") kind = animation::target_kind::sphere;
+            else if (target == "mesh") kind = animation::target_kind::mesh;
+            else return fail("unknown key target '" + target + "'");
+            if (kind != animation::target_kind::camera && (!fields.read(index) || index < 0)) return fail("expected a " + target + " number");
+
+            animation::keyframe key;
+            if (!fields.read(key.frame) || key.frame < 0) return fail("expected a frame number");
+
+            auto& track = anim.track_for(kind, index);
+            while (fields.read(field)) {
+                bool ok;
+                if (field == "translate") ok = fields.read(key.pose.translate);
+                else if (field == "rotate_y") ok = fields.read(key.pose.rotate_y);
+                else if (field == "about") ok = track.has_pivot = fields.read(track.pivot);
+                else return fail("unknown key field '" + field + "'");
+                if (!ok) return fail("bad value for '" + field + "'");
+            }
+
+            auto at = std::lower_bound(track.keys.begin(), track.keys.end(), key.frame,
+                                       [](const animation::keyframe& k, int f) { return k.frame < f; });
+            if (at != track.keys.end() && at->frame == key.frame) return fail("two keys for the same frame");
+            track.keys.insert(at, key);
+        } else {
+            return fail("unknown keyword '" + keyword + "'");
+        }
+    }
+    return true;
+}
+
+// the output path of one frame: the last run of '#' in pattern becomes the frame number,
+// zero-padded to its length ("frame_####.ppm"), or without one "_0001" goes before the extension
+inline std::string frame_path(const std::string& pattern, int frame) {
+    auto last = pattern.find_last_of('#');
+    std::string number = std::to_string(frame);
+    if (last == std::string::npos) {
+        if (number.size() < 4) number.insert(0, 4 - number.size(), '0');
+        auto dot = pattern.find_last_of('.');
+        auto slash = pattern.find_last_of('/');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = pattern.size();
+        return pattern.substr(0, dot) + "_" + number + pattern.substr(dot);
+    }
+
+    auto first = pattern.find_last_not_of('#', last);
+    first = first == std::string::npos ? 0 : first + 1;
+    size_t width = last + 1 - first;
+    if (number.size() < width) number.insert(0, width - number.size(), '0');
+    return pattern.substr(0, first) + number + pattern.substr(last + 1);
+}
+
+// poses a scene for each frame of an animation. it keeps the rest state (as loaded) of
+// everything animated and applies each frame's poses to that, so nothing drifts, then refits
+// the hierarchies that moved instead of rebuilding them
+class animated_scene {
+    public:
+        // checks the animation's targets against the scene and records their rest state.
+        // spheres must be in spheres (a mapped set is copied into memory)
+        bool bind(const animation& anim, const camera& cam, sphere_set& spheres,
+                  const std::vector<shared_ptr<triangle_mesh>>& meshes, const std::string& name) {
+            this->anim = &anim;
+            rest_camera = {cam.lookfrom, cam.lookat, cam.vup};
+            set = &spheres;
+            mesh_list = &meshes;
+
+            for (const auto& track : anim.tracks) {
+                if (track.kind == animation::target_kind::sphere) {
+                    spheres.make_movable();
+                    if (track.index >= spheres.sphere_count()) return fail(name, "there is no sphere " + std::to_string(track.index));
+                    rest_centers.push_back(spheres.center(track.index));
+                } else if (track.kind == animation::target_kind::mesh) {
+                    if (track.index >= int(meshes.size())) return fail(name, "there is no mesh " + std::to_string(track.index));
+                    rest_vertices.push_back(meshes[track.index]->vertices);
+                }
+            }
+            return true;
+        }
+
+        // poses the camera and objects for frame and refits what moved
+        void pose(int frame, camera& cam) {
+            size_t sphere_track = 0, mesh_track = 0;
+            bool spheres_moved = false;
+
+            for (const auto& track : anim->tracks) {
+                auto pose = track.pose_at(frame);
+                switch (track.kind) {
+                    case animation::target_kind::camera: {
+                        point3 pivot = track.has_pivot ? track.pivot : rest_camera.lookat;
+                        cam.lookfrom = pose.apply(rest_camera.lookfrom, pivot);
+                        cam.lookat = pose.apply(rest_camera.lookat, pivot);
+                        cam.vup = pose.rotate(rest_camera.vup);
+                        break;
+                    }
+                    case animation::target_kind::sphere: {
+                        const point3& rest = rest_centers[sphere_track++];
+                        set->move(track.index, pose.apply(rest, track.has_pivot ? track.pivot : rest));
+                        spheres_moved = true;
+                        break;
+                    }
+                    case animation::target_kind::mesh: {
+                        const auto& rest = rest_vertices[mesh_track++];
+                        auto& mesh = *(*mesh_list)[track.index];
+                        point3 pivot = track.has_pivot ? track.pivot : centroid(rest);
+                        for (size_t k = 0; k < rest.size(); k++) mesh.vertices[k] = pose.apply(rest[k], pivot);
+                        mesh.refit();
+                        break;
+                    }
+                }
+            }
+
+            if (spheres_moved) set->refit();
+        }
+
+    private:
+        struct camera_rest {
+            point3 lookfrom, lookat;
+            vec3 vup;
+        };
+
+        const animation* anim = nullptr;
+        camera_rest rest_camera;
+        sphere_set* set = nullptr;
+        const std::vector<shared_ptr<triangle_mesh>>* mesh_list = nullptr;
+        std::vector<point3> rest_centers;               // per sphere track, in track order
+        std::vector<std::vector<point3>> rest_vertices; // per mesh track, in track order
+
+        static bool fail(const std::string& name, const std::string& message) {
+            std::cerr << name << ": " << message << '\n';
+            return false;
+        }
+
+        static point3 centroid(const std::vector<point3>& points) {
+            aabb box;
+            for (const auto& p : points) box = aabb(box, aabb(p, p));
+            return box.centroid();
+        }
+};
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "utility.h"
+
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// bump allocation for scene objects. make<T>(args...) constructs a T in the arena's current
+// block and returns a shared_ptr that shares one control block with everything else in the
+// arena (the aliasing constructor), so a million objects take no million heap allocations or
+// control blocks, lie next to each other in the order they were made, and are freed together,
+// a block at a time, once the last pointer into the arena goes. the pointers plug into
+// hittable_list and bvh_node like any other; the arena itself may go out of scope first
+class object_arena {
+    public:
+        explicit object_arena(size_t block_bytes = 1 << 20)
+            : storage(make_shared<blocks>()), block_bytes(block_bytes) {}
+
+        template <typename T, typename... Args>
+        shared_ptr<T> make(Args&&... args) {
+            T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            if constexpr (!std::is_trivially_destructible_v<T>) storage->remember(object);
+            return shared_ptr<T>(storage, object);
+        }
+
+        // bytes of the blocks, used or not
+        size_t memory_usage() const { return storage->bytes; }
+
+    private:
+        // the memory and what has to be destroyed in it, owned jointly by every object's pointer
+        struct blocks {
+            // a run of objects of one type made one after another, destroyed with one call each
+            struct run {
+                char* first;
+                size_t count;
+                size_t stride;
+                void (*destroy)(void*);
+            };
+
+            std::vector<std::unique_ptr<char[]>> memory;
+            std::vector<run> runs;
+            size_t bytes = 0;
+
+            template <typename T>
+            void remember(T* object) {
+                auto p = reinterpret_cast<char*>(object);
+                auto destroy = [](void* q) { static_cast<T*>(q)->~T(); };
+                if (!runs.empty()) {
+                    auto& last = runs.back();
+                    if (last.destroy == +destroy && last.first + last.count * sizeof(T) == p) {
+                        last.count++;
+                        return;
+                    }
+                }
+                runs.push_back(run{p, 1, sizeof(T), +destroy});
+            }
+
+            ~blocks() {
+                for (auto r = runs.rbegin(); r != runs.rend(); ++r) {
+                    for (size_t k = r->count; k-- > 0;) r->destroy(r->first + k * r->stride);
+                }
+            }
+        };
+
+        shared_ptr<blocks> storage;
+        size_t block_bytes;
+        char* next = nullptr;                   // free space left in the current block
+        size_t left = 0;
+
+        void* allocate(size_t size, size_t align) {
+            void* p = next;
+            if (!next || !std::align(align, size, p, left)) {
+                // objects too big for a block get one of their own
+                size_t bytes = std::max(block_bytes, size + align);
+                storage->memory.push_back(std::unique_ptr<char[]>(new char[bytes]));
+                storage->bytes += bytes;
+                p = storage->memory.back().get();
+                left = bytes;
+                std::align(align, size, p, left);
+            }
+            next = static_cast<char*>(p) + size;
+            left -= size;
+            return p;
+        }
+};
+
+#endif
@@ -0,0 +1,623 @@
+#include "utility.h"
+
+#include "arena.h"
+#include "bvh.h"
+#include "camera.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "image_writer.h"
+#include "material.h"
+#include "sampler.h"
+#include "scenes.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "static_scene.h"
+#include "triangle_mesh.h"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Benchmarks for the hot kernels and for whole frames of standard scenes.
+// Results go to stdout as one JSON object, so runs can be diffed across commits;
+// progress goes to stderr.
+
+using bench_clock = std::chrono::steady_clock;
+
+// kilobytes on Linux; the high-water mark of the whole process so far, which for a scene
+// preset is its own child process (see run_in_child)
+static long peak_rss_kb() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// keeps results alive so the optimizer can't drop the work being timed
+static volatile double sink;
+
+// forwards to another world, counting every ray query. it keeps the inner world's type, so
+// the forwarded call is as direct as the world's own
+template <typename world_type>
+class counting_hittable final : public hittable {
+    public:
+        mutable std::atomic<uint64_t> queries{0};
+
+        counting_hittable(const world_type& inner) : inner(inner) {}
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            queries.fetch_add(1, std::memory_order_relaxed);
+            return inner.hit(r, ray_t, rec);
+        }
+
+        void hit_packet(ray_packet& packet) const override {
+            queries.fetch_add(packet.size, std::memory_order_relaxed);
+            inner.hit_packet(packet);
+        }
+
+        aabb bounding_box() const override { return inner.bounding_box(); }
+
+    private:
+        const world_type& inner;
+};
+
+// a closed latitude/longitude sphere of about 2 * rings * segments triangles
+static void uv_sphere_mesh(triangle_mesh& mesh, const point3& center, double radius, int rings, int segments) {
+    auto first = uint32_t(mesh.vertices.size());
+    mesh.vertices.push_back(center + vec3(0, radius, 0));
+    for (int i = 1; i < rings; i++) {
+        auto theta = pi * i / rings;
+        for (int j = 0; j < segments; j++) {
+            auto phi = 2 * pi * j / segments;
+            mesh.vertices.push_back(center + radius * vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi)));
+        }
+    }
+    mesh.vertices.push_back(center - vec3(0, radius, 0));
+    auto bottom = uint32_t(mesh.vertices.size() - 1);
+
+    auto ring_vertex = [&](int i, int j) { return first + 1 + uint32_t((i - 1) * segments + j % segments); };
+    auto add = [&](uint32_t a, uint32_t b, uint32_t c) { mesh.indices.insert(mesh.indices.end(), {a, b, c}); };
+    for (int j = 0; j < segments; j++) {
+        add(first, ring_vertex(1, j + 1), ring_vertex(1, j));
+        add(ring_vertex(rings - 1, j), ring_vertex(rings - 1, j + 1), bottom);
+        for (int i = 1; i < rings - 1; i++) {
+            add(ring_vertex(i, j), ring_vertex(i, j + 1), ring_vertex(i + 1, j + 1));
+            add(ring_vertex(i, j), ring_vertex(i + 1, j + 1), ring_vertex(i + 1, j));
+        }
+    }
+}
+
+struct micro_result {
+    std::string name;
+    long iterations;
+    double ns_per_op;
+};
+
+struct scene_result {
+    std::string name;
+    size_t spheres;
+    int width, height, spp, max_depth;
+    double build_ms, render_ms, teardown_ms;
+    uint64_t rays;
+    size_t accel_bytes;
+    long peak_rss_kb;
+    framebuffer image;                      // dropped once saved or compared
+
+    // against a --reference frame: per-channel RMSE and mean difference of the linear values
+    bool compared = false;
+    double rmse = 0, mean_error = 0;
+};
+
+// one point of a sampler's error curve
+struct convergence_result {
+    std::string sampler;
+    int spp;
+    double render_ms;
+    double rmse;                            // against the reference, linear values
+};
+
+static void compare_images(const framebuffer& image, const framebuffer& reference, scene_result& result) {
+    double squared = 0, difference = 0;
+    for (size_t k = 0; k < image.pixels.size(); k++) {
+        for (int axis = 0; axis < 3; axis++) {
+            double d = double(image.pixels[k][axis]) - double(reference.pixels[k][axis]);
+            squared += d * d;
+            difference += d;
+        }
+    }
+    auto n = 3.0 * image.pixels.size();
+    result.compared = true;
+    result.rmse = std::sqrt(squared / n);
+    result.mean_error = difference / n;
+}
+
+// runs fn(k) for k in [0, iterations) and returns the mean time per call
+static double ns_per_op(long iterations, const std::function<double(long)>& fn) {
+    double acc = 0;
+    auto start = bench_clock::now();
+    for (long k = 0; k < iterations; k++) acc += fn(k);
+    std::chrono::duration<double, std::nano> elapsed = bench_clock::now() - start;
+    sink = acc;
+    return elapsed.count() / iterations;
+}
+
+static std::vector<micro_result> run_micro(long iterations, uint64_t seed) {
+    std::vector<micro_result> results;
+    rng gen(seed);
+
+    // rays from a box around the scene towards random points near the origin, about half of which hit
+    const int ray_count = 4096;
+    std::vector<ray> rays;
+    for (int k = 0; k < ray_count; k++) {
+        auto origin = point3(random_double(gen, -6, 6), random_double(gen, 0.5, 3), random_double(gen, 8, 12));
+        auto target = point3(random_double(gen, -6, 6), random_double(gen, 0, 1), random_double(gen, -6, 6));
+        rays.push_back(ray(origin, target - origin));
+    }
+
+    material_table materials;
+    hittable_list objects;
+    static_scene<sphere> values;
+    sphere_set flat_set, bvh_set;
+    cover_scene(materials, seed, 11, sphere_mix(), [&](const point3& center, double radius, material_id mat) {
+        objects.add(make_shared<sphere>(center, radius, mat));
+        values.add(sphere(center, radius, mat));
+        flat_set.add(center, radius, mat);
+        bvh_set.add(center, radius, mat);
+    });
+    bvh_set.build();
+    bvh_node bvh(objects);
+
+    // worlds are passed as their own types, so a static_scene's calls can be resolved at compile time
+    auto hit_bench = [&](const std::string& name, const auto& world) {
+        results.push_back({name, iterations, ns_per_op(iterations, [&](long k) {
+            hit_record rec;
+            return world.hit(rays[k % ray_count], interval(0, infinity), rec) ? rec.t : 0.0;
+        })});
+    };
+
+    sphere single(point3(0, 0.5, 0), 3.0, 0);
+    hit_bench("sphere_hit", single);
+    hit_bench("hittable_list_hit_demo", objects);
+    hit_bench("static_scene_hit_demo", values);
+    hit_bench("sphere_set_flat_hit_demo", flat_set);
+    hit_bench("bvh_node_hit_demo", bvh);
+    hit_bench("sphere_set_bvh_hit_demo", bvh_set);
+
+    // camera rays through the middle 64x64 pixels of a 320x180 view of the cover shot, one at
+    // a time and as the 8x8 packets of --packets; both are ns per ray
+    const int block = 8, blocks = 64;
+    std::vector<ray> camera_rays;
+    {
+        auto lookfrom = point3(13, 2, 3);
+        auto w = unit_vector(lookfrom - point3(0, 0, 0));
+        auto u = unit_vector(cross(vec3(0, 1, 0), w));
+        auto v = cross(w, u);
+        auto half_height = std::tan(degrees_to_radians(20) / 2) * (lookfrom - point3(0, 0, 0)).length();
+        auto pixel = 2 * half_height / 180;
+        for (int b = 0; b < blocks; b++) {
+            for (int k = 0; k < block * block; k++) {
+                auto i = 128 + (b % block) * block + k % block, j = 58 + (b / block) * block + k / block;
+                auto target = (i + 0.5 - 160) * pixel * u - (j + 0.5 - 90) * pixel * v;
+                camera_rays.push_back(ray(lookfrom, target - lookfrom));
+            }
+        }
+    }
+    results.push_back({"camera_rays_sphere_set_bvh_demo", iterations, ns_per_op(iterations, [&](long k) {
+        hit_record rec;
+        return bvh_set.hit(camera_rays[k % camera_rays.size()], interval(0, infinity), rec) ? rec.t : 0.0;
+    })});
+    auto packet = std::make_unique<ray_packet>();
+    long packet_calls = std::max(1L, iterations / (block * block));
+    results.push_back({"camera_packets_sphere_set_bvh_demo", packet_calls * block * block, ns_per_op(packet_calls, [&](long k) {
+        auto first = (k % blocks) * block * block;
+        packet->size = block * block;
+        packet->hits = 0;
+        for (int lane = 0; lane < packet->size; lane++) {
+            packet->rays[lane] = camera_rays[first + lane];
+            packet->t_max[lane] = infinity;
+        }
+        bvh_set.hit_packet(*packet);
+        return packet->hits ? packet->recs[lowest_lane(packet->hits)].t : 0.0;
+    }) / (block * block)});
+
+    // the same sphere as 80k triangles; compare with sphere_hit for the cost of tessellation
+    triangle_mesh mesh;
+    uv_sphere_mesh(mesh, point3(0, 0.5, 0), 3.0, 200, 200);
+    mesh.build();
+    hit_bench("triangle_mesh_hit_80k", mesh);
+
+    // one hit record on the upper half of a unit sphere, hit from above at a slant
+    auto r_in = ray(point3(0.3, 2, 0.2), vec3(-0.1, -1, 0.05));
+    hit_record rec;
+    single = sphere(point3(0, 0, 0), 1.0, 0);
+    single.hit(r_in, interval(0, infinity), rec);
+
+    sampler draws(gen);
+    auto scatter_bench = [&](const std::string& name, const material& mat) {
+        material_table table;
+        rec.mat = table.add(mat);
+        results.push_back({name, iterations, ns_per_op(iterations, [&](long) {
+            color attenuation;
+            ray scattered;
+            table.scatter(rec.mat, r_in, rec, attenuation, scattered, draws);
+            return scattered.direction().x();
+        })});
+    };
+
+    scatter_bench("scatter_lambertian", lambertian(color(0.5, 0.5, 0.5)));
+    scatter_bench("scatter_metal", metal(color(0.7, 0.6, 0.5), 0.3));
+    scatter_bench("scatter_dielectric", dielectric(1.5));
+
+    results.push_back({"random_unit_vector", iterations, ns_per_op(iterations, [&](long) {
+        return random_unit_vector(gen).x();
+    })});
+
+    // one pair of numbers, walking through the bounces' dimensions as a path would
+    for (auto type : {sampler_type::independent, sampler_type::stratified, sampler_type::sobol, sampler_type::blue_noise}) {
+        auto numbers = sampler::for_sample(type, seed, 1000, 40, 3, 7, 64);
+        results.push_back({std::string("sampler_2d_") + sampler_name(type), iterations, ns_per_op(iterations, [&](long k) {
+            double u, v;
+            numbers.seek(int(k % 32), sampler::scatter);
+            numbers.next_2d(u, v);
+            return u + v;
+        })});
+    }
+
+    return results;
+}
+
+// how a preset's spheres are stored: the SIMD sphere_set; one sphere object each under a
+// bvh_node, allocated one at a time on the heap or side by side in an object_arena; or, with
+// no hierarchy, a hittable_list of those objects or their values in a static_scene; or as
+// instances of one shared, tessellated unit sphere under a bvh_node
+enum class sphere_storage { set, heap_objects, arena_objects, list_objects, static_objects, instances };
+
+struct scene_preset {
+    std::string name;
+    int grid_extent;
+    sphere_mix mix;
+    int max_depth;
+    bool russian_roulette;
+    sphere_storage storage = sphere_storage::set;
+};
+
+// seed lays out the scene, render_seed drives the samples
+static scene_result run_scene(const scene_preset& preset, int width, int spp, int threads, uint64_t seed, uint64_t render_seed,
+                              sampler_type sampling = sampler_type::independent, bool packets = false, bool wavefront = false) {
+    scene_result result;
+    result.name = preset.name;
+
+    auto build_start = bench_clock::now();
+    material_table materials;
+    sphere_set spheres;
+    hittable_list objects;
+    static_scene<sphere> values;
+    std::vector<sphere> arena_spheres;      // made in the arena once the BVH has put them in leaf order
+    auto arena = std::make_unique<object_arena>();
+    auto unit_sphere = make_shared<triangle_mesh>();
+    if (preset.storage == sphere_storage::instances) {
+        uv_sphere_mesh(*unit_sphere, point3(0, 0, 0), 1.0, 8, 16);
+        unit_sphere->build();
+    }
+    size_t count = 0;
+    cover_scene(materials, seed, preset.grid_extent, preset.mix, [&](const point3& center, double radius, material_id mat) {
+        switch (preset.storage) {
+            case sphere_storage::set:           spheres.add(center, radius, mat); break;
+            case sphere_storage::heap_objects:
+            case sphere_storage::list_objects:  objects.add(make_shared<sphere>(center, radius, mat)); break;
+            case sphere_storage::arena_objects: arena_spheres.emplace_back(center, radius, mat); break;
+            case sphere_storage::static_objects: values.add(sphere(center, radius, mat)); break;
+            case sphere_storage::instances:
+                objects.add(arena->make<instance>(unit_sphere, affine::translate(center) * affine::scale(radius), mat));
+                break;
+        }
+        count++;
+    });
+    std::unique_ptr<bvh_node> bvh;
+    switch (preset.storage) {
+        case sphere_storage::set:
+            spheres.build();
+            break;
+        case sphere_storage::heap_objects:
+        case sphere_storage::instances:
+            bvh = std::make_unique<bvh_node>(objects);
+            break;
+        case sphere_storage::arena_objects: {
+            std::vector<aabb> boxes;
+            for (const auto& s : arena_spheres) boxes.push_back(s.bounding_box());
+            bvh = std::make_unique<bvh_node>(std::move(boxes), [&](int k) { return arena->make<sphere>(arena_spheres[k]); });
+            arena_spheres = std::vector<sphere>();
+            break;
+        }
+        case sphere_storage::list_objects:
+        case sphere_storage::static_objects:
+            break;
+    }
+    std::chrono::duration<double, std::milli> build_time = bench_clock::now() - build_start;
+
+    camera cam;
+    cover_camera(cam);
+    cam.image_width       = width;
+    cam.samples_per_pixel = spp;
+    cam.max_depth         = preset.max_depth;
+    cam.russian_roulette  = preset.russian_roulette;
+    cam.num_threads       = threads;
+    cam.seed              = render_seed;
+    cam.sampling          = sampling;
+    cam.packets           = packets;
+    cam.wavefront         = wavefront;
+
+    // each storage renders through its own type, as a caller holding it would
+    uint64_t rays = 0;
+    auto render = [&](const auto& accel) {
+        counting_hittable world(accel);
+        auto image = cam.render(world, materials);
+        rays = world.queries.load();
+        return image;
+    };
+    auto render_start = bench_clock::now();
+    framebuffer image;
+    switch (preset.storage) {
+        case sphere_storage::set:            image = render(spheres); break;
+        case sphere_storage::heap_objects:
+        case sphere_storage::arena_objects:
+        case sphere_storage::instances:      image = render(*bvh); break;
+        case sphere_storage::list_objects:   image = render(objects); break;
+        case sphere_storage::static_objects: image = render(values); break;
+    }
+    std::chrono::duration<double, std::milli> render_time = bench_clock::now() - render_start;
+
+    result.spheres = count;
+    result.width = image.width;
+    result.height = image.height;
+    result.spp = spp;
+    result.max_depth = preset.max_depth;
+    result.build_ms = build_time.count();
+    result.render_ms = render_time.count();
+    result.rays = rays;
+    result.accel_bytes = bvh ? bvh->memory_usage() : spheres.memory_usage();
+    result.peak_rss_kb = peak_rss_kb();
+    result.image = std::move(image);
+
+    // freeing the scene: the pointer tables, then whatever owns the spheres
+    auto teardown_start = bench_clock::now();
+    bvh.reset();
+    objects = hittable_list();
+    values = static_scene<sphere>();
+    arena.reset();
+    unit_sphere.reset();
+    spheres = sphere_set();
+    std::chrono::duration<double, std::milli> teardown_time = bench_clock::now() - teardown_start;
+    result.teardown_ms = teardown_time.count();
+    return result;
+}
+
+// error against a high-sample frame of the demo scene as the sample count doubles, for each
+// sampler. the reference is traced with 16x the largest count, independent samples and another
+// seed, so it shares no numbers with what it is compared to. it is saved to and read from the
+// image directories as convergence_reference.pfm, since it costs more than the rest together
+static std::vector<convergence_result> run_convergence(const scene_preset& preset, int width, int max_spp, int threads, uint64_t seed,
+                                                       const std::string& save_images, const std::string& reference_dir) {
+    framebuffer reference;
+    bool loaded = false;
+    if (!reference_dir.empty()) {
+        std::ifstream in(reference_dir + "/convergence_reference.pfm", std::ios::binary);
+        loaded = read_pfm(in, reference);
+    }
+    if (!loaded) {
+        std::clog << "Convergence reference, " << 16 * max_spp << " spp\n";
+        reference = run_scene(preset, width, 16 * max_spp, threads, seed, seed + 1).image;
+        if (!save_images.empty()) {
+            std::ofstream out(save_images + "/convergence_reference.pfm", std::ios::binary);
+            write_image(out, reference, image_format::pfm);
+            if (!out) std::cerr << "Failed to write " << save_images << "/convergence_reference.pfm.\n";
+        }
+    }
+
+    std::vector<convergence_result> results;
+    for (auto type : {sampler_type::independent, sampler_type::stratified, sampler_type::sobol, sampler_type::blue_noise}) {
+        std::clog << "Convergence " << sampler_name(type) << "\n";
+        for (int spp = 1; spp <= max_spp; spp *= 2) {
+            auto result = run_scene(preset, width, spp, threads, seed, seed, type);
+            if (result.image.width != reference.width || result.image.height != reference.height) {
+                std::cerr << "The convergence reference is " << reference.width << "x" << reference.height
+                          << ", not " << result.image.width << "x" << result.image.height << ".\n";
+                return results;
+            }
+            compare_images(result.image, reference, result);
+            results.push_back({sampler_name(type), spp, result.render_ms, result.rmse});
+        }
+    }
+    return results;
+}
+
+// runs measure in a child process and returns what it printed, so the memory a scene takes,
+// and with it the peak RSS, starts from this process and not from the scenes run before.
+// false if the child didn't finish
+static bool run_in_child(const std::function<std::string()>& measure, std::string& output) {
+    int fds[2];
+    if (pipe(fds) != 0) return false;
+    std::clog.flush();
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        std::string text = measure();
+        std::clog.flush();
+        bool sent = true;
+        for (size_t done = 0; sent && done < text.size();) {
+            ssize_t n = write(fds[1], text.data() + done, text.size() - done);
+            sent = n > 0;
+            if (sent) done += size_t(n);
+        }
+        _exit(sent ? 0 : 1);        // the scene is freed by exiting, not by destructors
+    }
+
+    close(fds[1]);
+    output.clear();
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR)) {
+        if (n > 0) output.append(buffer, size_t(n));
+    }
+    close(fds[0]);
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char* argv[]) {
+    int width = 320;
+    int spp = 8;
+    int threads = 1;                        // one thread by default, so numbers compare across machines' core counts
+    long iterations = 2000000;
+    uint64_t seed = 0;
+    std::string filter;                     // only run benchmarks whose name contains this
+    std::string save_images;                // directory to write each scene's frame to, as <name>.pfm
+    std::string reference;                  // directory of frames to compare against, as <name>.pfm
+    bool micro = true, scenes = true;
+    bool packets = false;                   // camera rays in 8x8 packets (camera::packets)
+    bool wavefront = false;                 // breadth-first tiles (camera::wavefront)
+    int convergence_spp = 0;                // > 0: only the sampler convergence study, up to this many samples
+
+    for (int k = 1; k < argc; k++) {
+        if (std::strcmp(argv[k], "--width") == 0 && k + 1 < argc) {
+            width = std::atoi(argv[++k]);
+        } else if (std::strcmp(argv[k], "--spp") == 0 && k + 1 < argc) {
+            spp = std::atoi(argv[++k]);
+        } else if (std::strcmp(argv[k], "--threads") == 0 && k + 1 < argc) {
+            threads = std::atoi(argv[++k]);
+        } else if (std::strcmp(argv[k], "--iterations") == 0 && k + 1 < argc) {
+            iterations = std::atol(argv[++k]);
+        } else if (std::strcmp(argv[k], "--seed") == 0 && k + 1 < argc) {
+            seed = std::strtoull(argv[++k], nullptr, 10);
+        } else if (std::strcmp(argv[k], "--filter") == 0 && k + 1 < argc) {
+            filter = argv[++k];
+        } else if (std::strcmp(argv[k], "--save-images") == 0 && k + 1 < argc) {
+            save_images = argv[++k];
+        } else if (std::strcmp(argv[k], "--reference") == 0 && k + 1 < argc) {
+            reference = argv[++k];
+        } else if (std::strcmp(argv[k], "--convergence") == 0 && k + 1 < argc) {
+            convergence_spp = std::atoi(argv[++k]);
+        } else if (std::strcmp(argv[k], "--packets") == 0) {
+            packets = true;
+        } else if (std::strcmp(argv[k], "--wavefront") == 0) {
+            wavefront = true;
+        } else if (std::strcmp(argv[k], "--micro-only") == 0) {
+            scenes = false;
+        } else if (std::strcmp(argv[k], "--scenes-only") == 0) {
+            micro = false;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--width N] [--spp N] [--threads N] [--iterations N] [--seed N]"
+                      << " [--filter NAME] [--save-images DIR] [--reference DIR] [--packets] [--wavefront] [--micro-only | --scenes-only | --convergence MAX_SPP]\n";
+            return 1;
+        }
+    }
+
+    auto selected = [&](const std::string& name) { return filter.empty() || name.find(filter) != std::string::npos; };
+    if (convergence_spp > 0) micro = scenes = false;
+
+    std::vector<micro_result> micro_results;
+    if (micro) {
+        for (auto& result : run_micro(iterations, seed)) {
+            if (selected(result.name)) micro_results.push_back(result);
+        }
+    }
+
+    const scene_preset presets[] = {
+        {"demo",          11,                        sphere_mix(),   50, true},
+        {"glass_heavy",   11,                        {0.1, 0.2},     50, true},
+        {"deep_bounce",   11,                        {0.0, 1.0},     50, false},
+        {"demo_list",     11,                        sphere_mix(),   50, true, sphere_storage::list_objects},
+        {"demo_static",   11,                        sphere_mix(),   50, true, sphere_storage::static_objects},
+        {"spheres_10k",   grid_extent_for(1e4),      sphere_mix(),   50, true},
+        {"spheres_100k",  grid_extent_for(1e5),      sphere_mix(),   50, true},
+        {"spheres_1m",    grid_extent_for(1e6),      sphere_mix(),   50, true},
+        {"shallow_1m",    grid_extent_for(1e6),      sphere_mix(),   2,  true},
+        {"objects_1m_heap",  grid_extent_for(1e6),   sphere_mix(),   50, true, sphere_storage::heap_objects},
+        {"objects_1m_arena", grid_extent_for(1e6),   sphere_mix(),   50, true, sphere_storage::arena_objects},
+        {"instances_1m",  grid_extent_for(1e6),      sphere_mix(),   50, true, sphere_storage::instances},
+    };
+
+    // each preset runs in a process of its own and sends back its entry of the JSON
+    std::vector<std::string> scene_entries;
+    if (scenes) {
+        for (const auto& preset : presets) {
+            if (!selected(preset.name)) continue;
+            std::clog << "Scene " << preset.name << "\n";
+            std::string entry;
+            bool finished = run_in_child([&] {
+                auto result = run_scene(preset, width, spp, threads, seed, seed, sampler_type::independent, packets, wavefront);
+                if (!save_images.empty()) {
+                    std::ofstream out(save_images + "/" + preset.name + ".pfm", std::ios::binary);
+                    write_image(out, result.image, image_format::pfm);
+                    if (!out) std::cerr << "Failed to write " << save_images << "/" << preset.name << ".pfm.\n";
+                }
+                if (!reference.empty()) {
+                    std::ifstream in(reference + "/" + preset.name + ".pfm", std::ios::binary);
+                    framebuffer expected;
+                    if (read_pfm(in, expected) && expected.width == result.width && expected.height == result.height) {
+                        compare_images(result.image, expected, result);
+                    } else {
+                        std::cerr << "No matching reference image for " << preset.name << " in " << reference << ".\n";
+                    }
+                }
+
+                std::ostringstream json;
+                json << "{\"name\": \"" << result.name << "\", \"spheres\": " << result.spheres
+                     << ", \"width\": " << result.width << ", \"height\": " << result.height << ", \"spp\": " << result.spp
+                     << ", \"max_depth\": " << result.max_depth << ", \"threads\": " << threads << ", \"packets\": " << (packets ? "true" : "false")
+                     << ", \"wavefront\": " << (wavefront ? "true" : "false")
+                     << ", \"build_ms\": " << result.build_ms << ", \"render_ms\": " << result.render_ms << ", \"teardown_ms\": " << result.teardown_ms
+                     << ", \"rays\": " << result.rays << ", \"rays_per_sec\": " << result.rays / (result.render_ms / 1000)
+                     << ", \"ns_per_ray\": " << result.render_ms * 1e6 / result.rays
+                     << ", \"accel_bytes\": " << result.accel_bytes << ", \"peak_rss_kb\": " << result.peak_rss_kb;
+                if (result.compared) json << ", \"rmse_vs_reference\": " << result.rmse << ", \"mean_error_vs_reference\": " << result.mean_error;
+                json << "}";
+                return json.str();
+            }, entry);
+            if (finished) scene_entries.push_back(entry);
+            else std::cerr << "Scene " << preset.name << " didn't finish.\n";
+        }
+    }
+
+    std::vector<convergence_result> convergence_results;
+    if (convergence_spp > 0) {
+        convergence_results = run_convergence(presets[0], width, convergence_spp, threads, seed, save_images, reference);
+    }
+
+    std::ostringstream json;
+    json << "{\n  \"precision\": \"" << (sizeof(real) == sizeof(float) ? "float" : "double") << "\",";
+    json << "\n  \"micro\": [";
+    for (size_t k = 0; k < micro_results.size(); k++) {
+        const auto& m = micro_results[k];
+        json << (k ? "," : "") << "\n    {\"name\": \"" << m.name << "\", \"iterations\": " << m.iterations
+             << ", \"ns_per_op\": " << m.ns_per_op << "}";
+    }
+    json << "\n  ],\n  \"scenes\": [";
+    for (size_t k = 0; k < scene_entries.size(); k++) json << (k ? "," : "") << "\n    " << scene_entries[k];
+    json << "\n  ],\n  \"convergence\": [";
+    for (size_t k = 0; k < convergence_results.size(); k++) {
+        const auto& c = convergence_results[k];
+        json << (k ? "," : "") << "\n    {\"sampler\": \"" << c.sampler << "\", \"spp\": " << c.spp
+             << ", \"render_ms\": " << c.render_ms << ", \"rmse_vs_reference\": " << c.rmse << "}";
+    }
+    json << "\n  ]\n}\n";
+
+    std::cout << json.str();
+}
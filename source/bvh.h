@@ -0,0 +1,469 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+// a packet's rays as arrays, for tests that run across the packet a SIMD register at a time,
+// and the frustum around them: per axis, the range of the origins and of the inverse directions
+struct packet_rays {
+    static constexpr int max_size = ray_packet::max_size;
+
+    alignas(32) real origin[3][max_size];
+    alignas(32) real direction[3][max_size];
+    alignas(32) real inv_direction[3][max_size];
+    alignas(32) real length_sq[max_size];   // of each direction, as ray-by-ray code computes it
+    interval origin_range[3], inv_range[3];
+    bool frustum_axis[3];                   // the axis bounds the frustum: no ray is parallel to it
+
+    explicit packet_rays(const ray_packet& packet) {
+        for (int axis = 0; axis < 3; axis++) {
+            frustum_axis[axis] = true;
+            for (int k = 0; k < max_size; k++) {
+                // lanes past the packet's end are never tested; they just fill their register
+                const ray& r = packet.rays[k < packet.size ? k : 0];
+                origin[axis][k] = r.origin()[axis];
+                direction[axis][k] = r.direction()[axis];
+                inv_direction[axis][k] = 1 / r.direction()[axis];
+                if (axis == 0) length_sq[k] = r.direction().length_squared();
+                if (k >= packet.size) continue;
+                origin_range[axis] = interval(origin_range[axis], interval(origin[axis][k], origin[axis][k]));
+                inv_range[axis] = interval(inv_range[axis], interval(inv_direction[axis][k], inv_direction[axis][k]));
+                frustum_axis[axis] = frustum_axis[axis] && std::isfinite(inv_direction[axis][k]);
+            }
+        }
+    }
+
+    // true if no ray of the packet can hit box between t_min and infinity. each ray's slab
+    // distances lie within the interval products below (rounding is monotonic, so this holds
+    // for the computed values too), which makes the test conservative
+    bool frustum_misses(const aabb& box, real t_min) const {
+        real lower = t_min, upper = infinity;
+        for (int axis = 0; axis < 3; axis++) {
+            if (!frustum_axis[axis]) continue;
+            const interval& slab = box.axis_interval(axis);
+            interval t0 = product(slab.min - origin_range[axis].max, slab.min - origin_range[axis].min, inv_range[axis]);
+            interval t1 = product(slab.max - origin_range[axis].max, slab.max - origin_range[axis].min, inv_range[axis]);
+            lower = std::fmax(lower, std::fmin(t0.min, t1.min));
+            upper = std::fmin(upper, std::fmax(t0.max, t1.max));
+        }
+        return lower >= upper;
+    }
+
+    private:
+        static interval product(real a0, real a1, const interval& b) {
+            real p0 = a0 * b.min, p1 = a0 * b.max, p2 = a1 * b.min, p3 = a1 * b.max;
+            return interval(std::fmin(std::fmin(p0, p1), std::fmin(p2, p3)), std::fmax(std::fmax(p0, p1), std::fmax(p2, p3)));
+        }
+};
+
+// flat bounding volume hierarchy over a set of primitive boxes. it only knows about
+// boxes and primitive indices, so any container of primitives can sit on top of it:
+// the container reorders its primitives by prim_order and tests leaves itself
+class bvh_tree {
+    public:
+        struct node {
+            aabb bbox;
+            int first;      // leaf: first slot in prim_order, interior: index of the right child
+            int count;      // primitives in a leaf, 0 for interior nodes (left child is the next node)
+            int axis;       // split axis of an interior node, used to visit the near child first
+        };
+
+        std::vector<node> nodes;
+        std::vector<int> prim_order;            // leaf slots -> original primitive indices
+
+        // traverses nodes stored elsewhere (e.g. a mapped scene file) instead of building.
+        // the caller keeps them alive for as long as the tree is used
+        void attach(const node* data, size_t count) {
+            nodes.clear();
+            prim_order.clear();
+            external = data;
+            external_count = count;
+        }
+
+        // checks nodes read from outside (a scene file) before traversing them: links point
+        // forward and in range, leaves lie within prim_count and start on a multiple of
+        // leaf_batch (leaf tests load whole batches from there), and no path outgrows the
+        // traversal stack
+        static bool valid(const node* data, size_t count, size_t prim_count, int leaf_batch = 1) {
+            std::vector<int> depth(count, 0);
+            for (size_t k = 0; k < count; k++) {
+                const node& n = data[k];
+                if (n.count > 0) {
+                    if (n.first < 0 || n.first % leaf_batch != 0 || size_t(n.first) + size_t(n.count) > prim_count) return false;
+                    continue;
+                }
+                if (n.count < 0 || k + 1 >= count || n.first <= int(k + 1) || size_t(n.first) >= count) return false;
+                if (n.axis < 0 || n.axis > 2 || depth[k] + 1 >= max_depth) return false;
+                depth[k + 1] = std::max(depth[k + 1], depth[k] + 1);
+                depth[n.first] = std::max(depth[n.first], depth[k] + 1);
+            }
+            return true;
+        }
+
+        const node* node_data() const { return external ? external : nodes.data(); }
+        size_t node_count() const { return external ? external_count : nodes.size(); }
+
+        // binned surface area heuristic build. leaf_batch is how many primitives a leaf
+        // tests for the price of one (SIMD width), so leaves are costed in whole batches
+        void build(const std::vector<aabb>& boxes, int max_leaf_size, int leaf_batch = 1) {
+            nodes.clear();
+            external = nullptr;
+            external_count = 0;
+            prim_order.resize(boxes.size());
+            std::iota(prim_order.begin(), prim_order.end(), 0);
+            if (boxes.empty()) return;
+
+            centroids.resize(boxes.size());
+            for (size_t k = 0; k < boxes.size(); k++) centroids[k] = boxes[k].centroid();
+
+            nodes.reserve(2 * boxes.size());
+            batch = leaf_batch;
+            build_node(boxes, 0, int(boxes.size()), max_leaf_size, 0);
+
+            centroids.clear();
+            centroids.shrink_to_fit();
+        }
+
+        // recomputes every box after the primitives moved, keeping the tree's shape: one pass
+        // over the nodes instead of a build. leaf_box(first, count) bounds a leaf's primitives.
+        // children always come after their parent, so a backwards pass sees them first.
+        // traversal stays correct however far things move, but gets slower as the boxes
+        // outgrow the layout they were split for; rebuild after large changes
+        template <typename leaf_box_fn>
+        void refit(leaf_box_fn&& leaf_box) {
+            for (size_t k = nodes.size(); k-- > 0;) {
+                node& n = nodes[k];
+                n.bbox = n.count > 0 ? leaf_box(n.first, n.count) : aabb(nodes[k + 1].bbox, nodes[n.first].bbox);
+            }
+        }
+
+        aabb bounding_box() const {
+            return node_count() == 0 ? aabb::empty : node_data()[0].bbox;
+        }
+
+        // bytes owned by the tree; attached nodes belong to the caller
+        size_t memory_usage() const {
+            return nodes.capacity() * sizeof(node) + prim_order.capacity() * sizeof(int);
+        }
+
+        // walks the tree front to back. hit_leaf(first, count, ray_t) tests the primitives in
+        // prim_order slots [first, first + count), shrinking ray_t.max on a hit, and returns
+        // whether anything was hit
+        template <typename leaf_fn>
+        bool traverse(const ray& r, interval ray_t, leaf_fn&& hit_leaf) const {
+            if (node_count() == 0) return false;
+            const node* tree = node_data();
+
+            const point3& orig = r.origin();
+            const vec3& dir = r.direction();
+            vec3 inv_dir(1 / dir[0], 1 / dir[1], 1 / dir[2]);
+
+            bool hit_anything = false;
+            int stack[max_depth];
+            int stack_size = 0;
+            int current = 0;
+
+            while (true) {
+                const node& n = tree[current];
+                STAT_ADD(bvh_nodes_visited, 1);
+
+                if (n.bbox.hit(orig, inv_dir, ray_t)) {
+                    if (n.count > 0) {
+                        if (hit_leaf(n.first, n.count, ray_t)) hit_anything = true;
+                    } else {
+                        // visit the child on the ray's side of the split first
+                        int near_child = current + 1;
+                        int far_child = n.first;
+                        if (dir[n.axis] < 0) std::swap(near_child, far_child);
+
+                        stack[stack_size++] = far_child;
+                        current = near_child;
+                        continue;
+                    }
+                }
+
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            }
+
+            return hit_anything;
+        }
+
+        // walks the tree with a whole packet. a subtree the packet's frustum misses is skipped
+        // with one test. otherwise, if the first ray still in play hits its box, the packet goes
+        // in whole; if not, the rays are tested a register at a time and only those that hit go
+        // on. leaves test every ray, so a leaf gets exactly the rays traverse would bring to it
+        // (a ray that hits a box hits all the boxes around it) and the packet finds the same
+        // hits as its rays alone. a packet that isn't coherent skips the frustum and the first
+        // ray and has every ray tested at every node. hit_leaf(first, count, lanes) tests a
+        // leaf's primitives against the rays whose bits are set in lanes, lowering their
+        // packet.t_max as traverse's hit_leaf lowers ray_t.max
+        template <typename leaf_fn>
+        void traverse_packet(const ray_packet& packet, const packet_rays& rays, leaf_fn&& hit_leaf) const {
+            if (node_count() == 0 || packet.size == 0) return;
+            const node* tree = node_data();
+
+            struct entry {
+                int node;
+                uint64_t lanes;
+            };
+            entry stack[max_depth];
+            int stack_size = 0;
+            entry current = {0, packet.size == 64 ? ~uint64_t(0) : (uint64_t(1) << packet.size) - 1};
+
+            while (true) {
+                const node& n = tree[current.node];
+                STAT_ADD(bvh_nodes_visited, 1);
+
+                uint64_t lanes = 0;
+                if (!packet.coherent) {
+                    lanes = box_lanes(n.bbox, packet, rays, current.lanes);
+                } else if (!rays.frustum_misses(n.bbox, packet.t_min)) {
+                    int k = lowest_lane(current.lanes);
+                    const point3 orig(rays.origin[0][k], rays.origin[1][k], rays.origin[2][k]);
+                    const vec3 inv_dir(rays.inv_direction[0][k], rays.inv_direction[1][k], rays.inv_direction[2][k]);
+                    bool first_hits = n.bbox.hit(orig, inv_dir, interval(packet.t_min, packet.t_max[k]));
+                    lanes = first_hits && n.count == 0 ? current.lanes : box_lanes(n.bbox, packet, rays, current.lanes);
+                }
+                if (lanes) {
+                    if (n.count > 0) {
+                        hit_leaf(n.first, n.count, lanes);
+                    } else {
+                        // the first ray in play picks the order for all
+                        int near_child = current.node + 1;
+                        int far_child = n.first;
+                        if (rays.direction[n.axis][lowest_lane(lanes)] < 0) std::swap(near_child, far_child);
+
+                        stack[stack_size++] = {far_child, lanes};
+                        current = {near_child, lanes};
+                        continue;
+                    }
+                }
+
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            }
+        }
+
+    private:
+        static constexpr int bin_count = 16;
+        static constexpr int sah_depth = 64;    // past this depth, splits fall back to the median
+        static constexpr int max_depth = 128;   // sah_depth plus log2 of any primitive count we can index
+
+        const node* external = nullptr;
+        size_t external_count = 0;
+
+        std::vector<point3> centroids;          // only alive during build
+        int batch = 1;
+
+        int batches(int count) const { return (count + batch - 1) / batch; }
+
+        // the lanes of those in play whose ray hits box, by the same slab test as aabb::hit
+        static uint64_t box_lanes(const aabb& box, const ray_packet& packet, const packet_rays& rays, uint64_t lanes) {
+            uint64_t hit = 0;
+#if defined(__AVX2__)
+            constexpr uint64_t register_lanes = (uint64_t(1) << simd::width) - 1;
+            for (int first = 0; first < packet.size; first += simd::width) {
+                if (((lanes >> first) & register_lanes) == 0) continue;
+
+                simd::reg t_near = simd::set1(packet.t_min);
+                simd::reg t_far = simd::load(&packet.t_max[first]);
+                for (int axis = 0; axis < 3; axis++) {
+                    const interval& slab = box.axis_interval(axis);
+                    simd::reg o = simd::load(&rays.origin[axis][first]);
+                    simd::reg inv = simd::load(&rays.inv_direction[axis][first]);
+                    simd::reg t0 = simd::mul(simd::sub(simd::set1(slab.min), o), inv);
+                    simd::reg t1 = simd::mul(simd::sub(simd::set1(slab.max), o), inv);
+
+                    // as aabb::hit: swap when t0 > t1, and a NaN bound leaves the range as it is
+                    simd::reg swap = simd::greater(t0, t1);
+                    simd::reg near = simd::select(t0, t1, swap), far = simd::select(t1, t0, swap);
+                    t_near = simd::select(t_near, near, simd::greater(near, t_near));
+                    t_far = simd::select(t_far, far, simd::less(far, t_far));
+                }
+                hit |= uint64_t(simd::mask_bits(simd::greater(t_far, t_near))) << first;
+            }
+            hit &= lanes;
+#else
+            for (uint64_t rest = lanes; rest; rest &= rest - 1) {
+                int k = lowest_lane(rest);
+                const point3 orig(rays.origin[0][k], rays.origin[1][k], rays.origin[2][k]);
+                const vec3 inv_dir(rays.inv_direction[0][k], rays.inv_direction[1][k], rays.inv_direction[2][k]);
+                if (box.hit(orig, inv_dir, interval(packet.t_min, packet.t_max[k]))) hit |= uint64_t(1) << k;
+            }
+#endif
+            return hit;
+        }
+
+        int build_node(const std::vector<aabb>& boxes, int begin, int end, int max_leaf_size, int depth) {
+            int index = int(nodes.size());
+            nodes.push_back(node{aabb(), begin, end - begin, 0});
+
+            aabb bbox, centroid_bounds;
+            for (int k = begin; k < end; k++) {
+                int prim = prim_order[k];
+                bbox = aabb(bbox, boxes[prim]);
+                centroid_bounds = aabb(centroid_bounds, aabb(centroids[prim], centroids[prim]));
+            }
+            nodes[index].bbox = bbox;
+
+            int count = end - begin;
+            if (count == 1) return index;
+
+            int axis = centroid_bounds.longest_axis();
+            const interval& span = centroid_bounds.axis_interval(axis);
+            if (span.size() <= 0) {
+                // every centroid coincides, nothing to split on
+                return index;
+            }
+
+            struct bin {
+                aabb bbox;
+                int count = 0;
+            };
+            bin bins[bin_count];
+
+            auto bin_of = [&](int prim) {
+                int b = int(bin_count * (centroids[prim][axis] - span.min) / span.size());
+                return std::min(b, bin_count - 1);
+            };
+
+            for (int k = begin; k < end; k++) {
+                int prim = prim_order[k];
+                bin& b = bins[bin_of(prim)];
+                b.bbox = aabb(b.bbox, boxes[prim]);
+                b.count++;
+            }
+
+            // sweep from the right to get the cost of everything above each split plane
+            double right_cost[bin_count];
+            aabb right_box;
+            int right_count = 0;
+            for (int b = bin_count - 1; b > 0; b--) {
+                right_box = aabb(right_box, bins[b].bbox);
+                right_count += bins[b].count;
+                right_cost[b] = batches(right_count) * right_box.surface_area();
+            }
+
+            int best_split = -1;
+            double best_cost = infinity;
+            aabb left_box;
+            int left_count = 0;
+            for (int b = 1; b < bin_count; b++) {
+                left_box = aabb(left_box, bins[b - 1].bbox);
+                left_count += bins[b - 1].count;
+                if (left_count == 0 || left_count == count) continue;
+
+                auto cost = batches(left_count) * left_box.surface_area() + right_cost[b];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_split = b;
+                }
+            }
+
+            // costs are relative to one primitive test, with a node traversal costing about as much
+            auto area = bbox.surface_area();
+            auto split_cost = area > 0 ? 1 + best_cost / area : 1.0;
+            if (count <= max_leaf_size && batches(count) <= split_cost) return index;
+
+            int mid;
+            if (best_split > 0 && depth < sah_depth) {
+                auto it = std::partition(prim_order.begin() + begin, prim_order.begin() + end,
+                                         [&](int prim) { return bin_of(prim) < best_split; });
+                mid = int(it - prim_order.begin());
+            } else {
+                mid = begin + count / 2;
+                std::nth_element(prim_order.begin() + begin, prim_order.begin() + mid, prim_order.begin() + end,
+                                 [&](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+            }
+
+            nodes[index].count = 0;
+            nodes[index].axis = axis;
+            build_node(boxes, begin, mid, max_leaf_size, depth + 1);
+            int right = build_node(boxes, mid, end, max_leaf_size, depth + 1);
+            nodes[index].first = right;
+
+            return index;
+        }
+};
+
+// hittable that owns a copy of a list's objects, reordered so each BVH leaf is a contiguous run
+class bvh_node : public hittable {
+    public:
+        bvh_node(const hittable_list& list, int max_leaf_size = 4) {
+            std::vector<aabb> boxes;
+            boxes.reserve(list.objects.size());
+            for (const auto& object : list.objects) boxes.push_back(object->bounding_box());
+
+            tree.build(boxes, max_leaf_size);
+
+            objects.reserve(list.objects.size());
+            for (int prim : tree.prim_order) objects.push_back(list.objects[prim]);
+        }
+
+        // builds over the objects' boxes first and only then asks make(k) for object k, in leaf
+        // order, so objects that make allocates side by side (in an object_arena) are laid out
+        // leaf by leaf the way traversal reads them. the boxes are freed before the first one
+        template <typename factory>
+        bvh_node(std::vector<aabb> boxes, factory&& make, int max_leaf_size = 4) {
+            tree.build(boxes, max_leaf_size);
+            boxes = std::vector<aabb>();
+
+            objects.reserve(tree.prim_order.size());
+            for (int prim : tree.prim_order) objects.push_back(make(prim));
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            return tree.traverse(r, ray_t, [&](int first, int count, interval& t) {
+                hit_record temp_rec;
+                bool hit_anything = false;
+                for (int k = first; k < first + count; k++) {
+                    if (objects[k]->hit(r, t, temp_rec)) {
+                        hit_anything = true;
+                        t.max = temp_rec.t;
+                        rec = temp_rec;
+                    }
+                }
+                return hit_anything;
+            });
+        }
+
+        // the packet goes down the tree together; leaves test their objects ray by ray
+        void hit_packet(ray_packet& packet) const override {
+            packet_rays rays(packet);
+            hit_record temp_rec;
+            tree.traverse_packet(packet, rays, [&](int first, int count, uint64_t lanes) {
+                for (; lanes; lanes &= lanes - 1) {
+                    int lane = lowest_lane(lanes);
+                    for (int k = first; k < first + count; k++) {
+                        if (objects[k]->hit(packet.rays[lane], interval(packet.t_min, packet.t_max[lane]), temp_rec)) {
+                            packet.t_max[lane] = temp_rec.t;
+                            packet.recs[lane] = temp_rec;
+                            packet.hits |= uint64_t(1) << lane;
+                        }
+                    }
+                }
+            });
+        }
+
+        aabb bounding_box() const override { return tree.bounding_box(); }
+
+        size_t node_count() const { return tree.node_count(); }
+
+        // bytes held by the hierarchy and its object table, not counting the objects themselves
+        size_t memory_usage() const {
+            return tree.memory_usage() + objects.capacity() * sizeof(shared_ptr<hittable>);
+        }
+
+    private:
+        std::vector<shared_ptr<hittable>> objects;
+        bvh_tree tree;
+};
+
+#endif
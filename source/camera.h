@@ -1,16 +1,34 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include "accumulation_buffer.h"
+#include "denoiser.h"
+#include "framebuffer.h"
 #include "hittable.h"
+#include "image_writer.h"
+#include "light.h"
 #include "material.h"
+#include "tile_scheduler.h"
+#include "wavefront.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 class camera {
     public:
         // Image properties
         double aspect_ratio = 1.0;
         int image_width = 100;
-        int samples_per_pixel = 10;
-        int max_depth = 10;                     // max recursion depth for bouncing rays
+        int samples_per_pixel = 10;             // the sample budget per pixel when sampling adaptively
+        int max_depth = 10;                     // max number of bounces per path
+        bool russian_roulette = true;           // randomly end low-throughput paths (unbiased)
+        int roulette_min_bounces = 3;           // bounces every path gets before roulette starts
         
         double vfov = 90;                       // vertical FOV in degrees
         point3 lookfrom = point3(0, 0, 0);      // point cam is looking from
@@ -20,45 +38,303 @@ class camera {
         double defocus_angle = 0;               // variation angle of rays thru each pixel
         double focus_dist = 10;                 // distance from lookform to plane of perfect focus
 
-        void render(const hittable& world, std::ostream& out = std::cout) {
+        double sky_brightness = 1;              // scales the sky gradient rays escape to; 0 for a dark scene
+
+        // emissive spheres to sample directly at every diffuse hit (next-event estimation with
+        // multiple importance sampling). without them lights are only found by bounces, which
+        // takes many more samples when they are small
+        const light_list* lights = nullptr;
+
+        int num_threads = 0;                    // render threads, 0 = one per hardware thread
+        int tile_size = 16;                     // tiles are tile_size x tile_size pixels
+        uint64_t seed = 0;                      // same seed, same image, whatever the thread count
+        sampler_type sampling = sampler_type::independent;  // where pixel, lens and bounce numbers come from
+
+        // adaptive sampling: a pixel stops early once the standard error of its mean, measured in
+        // display (gamma) units, drops to adaptive_threshold. 0 always takes samples_per_pixel
+        double adaptive_threshold = 0;
+        int adaptive_min_samples = 16;          // samples taken before a pixel may stop
+
+        // wavefront mode traces each tile's samples breadth-first (see wavefront_tracer) and gives
+        // the same image as the default depth-first loop, adaptive stops included
+        bool wavefront = false;
+        int wavefront_batch = 1 << 16;          // paths in flight per tile pass
+
+        // packet mode traces the camera rays of each 8x8 pixel block together (see ray_packet)
+        // and their bounces one by one. same image as the default loop; wavefront takes precedence
+        bool packets = false;
+
+        int feature_samples = 16;               // camera rays per pixel for render_features
+
+        // checkpoints: every checkpoint_interval seconds (0 = only at the end) the sums so far
+        // are handed to on_checkpoint, on the progress thread and with tile commits held off,
+        // so it sees whole tiles only. it should copy them out (checkpoint_file::save) and return
+        std::function<void(const accumulation_buffer&)> on_checkpoint;
+        double checkpoint_interval = 60;
+
+        // when set, the render stops handing out tiles once *interrupt is true, finishes the
+        // tiles in flight, checkpoints and returns what it has
+        const std::atomic<bool>* interrupt = nullptr;
+
+        // called on the progress thread with each new whole-percent figure, as the progress
+        // line is drawn
+        std::function<void(int)> on_progress;
+
+        // the world is anything with hittable's hit(): any hittable, or a concrete type such as
+        // static_scene, whose hit calls the render loops then make directly and can inline
+
+        // renders to an ASCII (P3) PPM, for callers that just want a stream
+        template <typename world_type>
+        void render(const world_type& world, const material_table& materials, std::ostream& out) {
+            write_image(out, render(world, materials), image_format::ppm_ascii);
+        }
+
+        // renders into a framebuffer of linear colors, written out by the caller
+        template <typename world_type>
+        framebuffer render(const world_type& world, const material_table& materials) {
+            accumulation_buffer accum;
+            return render(world, materials, accum);
+        }
+
+        // renders into accum and returns its resolved image. if accum already holds samples of
+        // this image, each pixel continues from its own count up to samples_per_pixel (the total,
+        // not the number to add) with the buffer's seed, so a resumed render picks up exactly
+        // where the checkpoint left off. anything else in accum is discarded
+        template <typename world_type>
+        framebuffer render(const world_type& world, const material_table& materials, accumulation_buffer& accum) {
             initialize();
 
-            out << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-
-            for (int j = 0; j < image_height; j++) {
-                // \r is carriage return, which goes back to the beginning of current line
-                // this ensures that the message is overwritten, not on a newline each time
-                // std::flush forces the output buffer to be written to terminal immediately
-                std::clog << "\rProgress: " << int(100.0 * j / image_height) << "%   " << std::flush;
-                int bar_width = 50; // Width of the progress bar
-                float progress = float(j) / image_height;
-                int pos = int(bar_width * progress);
-
-                std::clog << "\r[";
-                for (int i = 0; i < bar_width; ++i) {
-                    if (i < pos) std::clog << "=";
-                    else if (i == pos) std::clog << ">";
-                    else std::clog << " ";
+            if (accum.width != image_width || accum.height != image_height) {
+                auto fingerprint = accum.fingerprint;
+                accum = accumulation_buffer(image_width, image_height, seed);
+                accum.fingerprint = fingerprint;
+                accum.sampling = sampling;
+            }
+            seed = accum.seed;                  // resumed samples continue the buffer's random streams
+
+            std::vector<tile> tiles = image_tiles();
+
+            int workers = num_threads > 0 ? num_threads : int(std::max(1u, std::thread::hardware_concurrency()));
+            workers = std::min(workers, int(tiles.size()));
+            tile_scheduler scheduler(tiles, workers);
+
+            // guards progress and the commits of finished tiles into accum, so a checkpoint
+            // taken under it never sees half a tile
+            std::mutex progress_lock;
+            std::condition_variable progress_changed;
+            size_t tiles_done = 0;
+            auto interrupted = [&] { return interrupt && interrupt->load(); };
+
+            last_stats = render_stats();
+            auto trace_start = std::chrono::steady_clock::now();
+
+            std::vector<std::thread> threads;
+            for (int w = 0; w < workers; w++) {
+                threads.emplace_back([&, w] {
+                    render_stats::local() = render_stats();
+
+                    wavefront_tracer tracer;
+                    tracer.max_depth = max_depth;
+                    tracer.russian_roulette = russian_roulette;
+                    tracer.roulette_min_bounces = roulette_min_bounces;
+                    tracer.lights = lights;
+
+                    tile t;
+                    std::vector<pixel_sums> sums;
+                    while (!interrupted() && scheduler.next(w, t)) {
+                        // the tile is traced from a copy of its sums, committed when done
+                        int tile_width = t.x1 - t.x0;
+                        sums.resize(size_t(tile_width) * (t.y1 - t.y0));
+                        for (int j = t.y0; j < t.y1; j++) {
+                            std::copy_n(&accum.at(t.x0, j), tile_width, &sums[size_t(j - t.y0) * tile_width]);
+                        }
+
+                        if (wavefront) render_tile_wavefront(world, materials, sums, t, tracer);
+                        else if (packets) render_tile_packets(world, materials, sums, t);
+                        else render_tile(world, materials, sums, t);
+
+                        std::lock_guard<std::mutex> guard(progress_lock);
+                        for (int j = t.y0; j < t.y1; j++) {
+                            std::copy_n(&sums[size_t(j - t.y0) * tile_width], tile_width, &accum.at(t.x0, j));
+                        }
+                        tiles_done++;
+                        progress_changed.notify_one();
+                    }
+
+                    std::lock_guard<std::mutex> guard(progress_lock);
+                    last_stats.merge(render_stats::local());
+                });
+            }
+
+            {
+                // the calling thread only reports progress and takes checkpoints, drawing outside
+                // the lock. the line is only redrawn when the whole-percent figure changes
+                std::unique_lock<std::mutex> guard(progress_lock);
+                int shown = -1;
+                auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(checkpoint_interval));
+                auto next_checkpoint = std::chrono::steady_clock::now() + interval;
+                while (tiles_done < tiles.size() && !interrupted()) {
+                    // taken before the lock is let go to draw, so tiles finished meanwhile count as a
+                    // change and the wait below can't miss the last one
+                    size_t done = tiles_done;
+                    int percent = int(100 * done / tiles.size());
+                    if (percent != shown) {
+                        guard.unlock();
+                        print_progress(percent);
+                        if (on_progress) on_progress(percent);
+                        guard.lock();
+                        shown = percent;
+                    }
+
+                    // with an interrupt flag to watch, wake up now and then to look at it
+                    auto changed = [&] { return tiles_done != done; };
+                    bool checkpoints = on_checkpoint && checkpoint_interval > 0;
+                    if (checkpoints || interrupt) {
+                        auto wake = checkpoints ? next_checkpoint : std::chrono::steady_clock::time_point::max();
+                        if (interrupt) wake = std::min(wake, std::chrono::steady_clock::now() + std::chrono::milliseconds(100));
+                        progress_changed.wait_until(guard, wake, changed);
+                    } else {
+                        progress_changed.wait(guard, changed);
+                    }
+
+                    if (on_checkpoint && checkpoint_interval > 0 && std::chrono::steady_clock::now() >= next_checkpoint) {
+                        on_checkpoint(accum);
+                        next_checkpoint = std::chrono::steady_clock::now() + interval;
+                    }
                 }
-                std::clog << "] " << int(progress * 100.0) << "%   " << std::flush;
+            }
+            for (auto& thread : threads) thread.join();
+            if (on_checkpoint) on_checkpoint(accum);
 
-                for (int i = 0; i < image_width; i++) {
-                    color pixel_color(0, 0, 0);
-                    for (int sample = 0; sample < samples_per_pixel; sample++) {
-                        ray r = get_ray(i, j);
-                        pixel_color += ray_color(r, max_depth, world);
+            std::chrono::duration<double, std::milli> trace_time = std::chrono::steady_clock::now() - trace_start;
+            last_stats.trace_ms = trace_time.count();
+
+            pixel_samples.resize(accum.pixels.size());
+            for (size_t k = 0; k < accum.pixels.size(); k++) pixel_samples[k] = int(accum.pixels[k].count);
+
+            if (interrupted()) {
+                std::clog << "\rInterrupted after " << tiles_done << " of " << tiles.size() << " tiles\n";
+            } else {
+                std::clog << "\rRendered " << image_width << 'x' << image_height << " in " << trace_time.count() / 1000 << " s\n";
+            }
+
+            if (adaptive_threshold > 0) {
+                double total = 0;
+                for (int n : pixel_samples) total += n;
+                std::clog << "Adaptive sampling: " << total / pixel_samples.size() << " samples per pixel on average (max "
+                          << samples_per_pixel << ")\n";
+            }
+
+            return accum.resolve();
+        }
+
+        // the first-hit albedo, normal and depth of every pixel, for the denoiser. the rays use
+        // random streams of their own, so the render's samples are the same with or without them
+        template <typename world_type>
+        feature_buffer render_features(const world_type& world, const material_table& materials) {
+            initialize();
+            feature_buffer features(image_width, image_height);
+
+            std::vector<tile> tiles = image_tiles();
+            int workers = num_threads > 0 ? num_threads : int(std::max(1u, std::thread::hardware_concurrency()));
+            workers = std::min(workers, int(tiles.size()));
+            tile_scheduler scheduler(tiles, workers);
+
+            std::vector<std::thread> threads;
+            for (int w = 0; w < workers; w++) {
+                threads.emplace_back([&, w] {
+                    tile t;
+                    while (scheduler.next(w, t)) {
+                        for (int j = t.y0; j < t.y1; j++) {
+                            for (int i = t.x0; i < t.x1; i++) {
+                                auto pixel = uint64_t(j) * image_width + i;
+                                color albedo(0, 0, 0);
+                                vec3 normal(0, 0, 0);
+                                double depth = 0;
+                                int hits = 0;
+
+                                for (int s = 0; s < feature_samples; s++) {
+                                    sampler gen(rng::for_sample(seed, pixel, feature_stream + s));
+                                    ray r = get_ray(i, j, gen);
+                                    hit_record rec;
+                                    if (world.hit(r, interval(0, infinity), rec)) {
+                                        albedo += materials.base_color(rec.mat);
+                                        normal += rec.normal;
+                                        depth += rec.t * r.direction().length();
+                                        hits++;
+                                    } else {
+                                        albedo += color(1, 1, 1);
+                                    }
+                                }
+
+                                features.albedo[pixel] = albedo / feature_samples;
+                                features.normal[pixel] = normal / feature_samples;
+                                features.depth[pixel] = hits > 0 ? depth / hits : 0;
+                            }
+                        }
                     }
-                    write_color(out, pixel_samples_scale * pixel_color);
+                });
+            }
+            for (auto& thread : threads) thread.join();
+            return features;
+        }
+
+        // for callers that hand out tiles themselves (distributed workers): begin_tiles() sets up
+        // the view, then trace_tile() may be called from any number of threads. sums covers the
+        // tile row by row and is sampled up to samples_per_pixel, as render() would
+        void begin_tiles() { initialize(); }
+
+        template <typename world_type>
+        void trace_tile(const world_type& world, const material_table& materials, std::vector<pixel_sums>& sums, const tile& t) const {
+            if (wavefront) {
+                wavefront_tracer tracer;
+                tracer.max_depth = max_depth;
+                tracer.russian_roulette = russian_roulette;
+                tracer.roulette_min_bounces = roulette_min_bounces;
+                tracer.lights = lights;
+                render_tile_wavefront(world, materials, sums, t, tracer);
+            } else if (packets) {
+                render_tile_packets(world, materials, sums, t);
+            } else {
+                render_tile(world, materials, sums, t);
+            }
+        }
+
+        // image height in pixels for the current width and aspect ratio
+        int height() const { return std::max(1, static_cast<int>(std::round(image_width / aspect_ratio))); }
+
+        // the image cut into tile_size squares, in row order
+        std::vector<tile> image_tiles() const {
+            std::vector<tile> tiles;
+            int rows = height();
+            for (int y = 0; y < rows; y += tile_size) {
+                for (int x = 0; x < image_width; x += tile_size) {
+                    tiles.push_back({x, y, std::min(x + tile_size, image_width), std::min(y + tile_size, rows)});
                 }
             }
+            return tiles;
+        }
 
-            std::clog << "\rDone.                                                               \n";
+        // counters and trace time of the last render (counters stay zero without RAY_TRACER_STATS)
+        const render_stats& stats() const { return last_stats; }
 
+        // samples spent on each pixel in the last render, blue (few) to red (samples_per_pixel)
+        framebuffer sample_heatmap() const {
+            framebuffer heatmap(image_width, image_height);
+            for (size_t k = 0; k < pixel_samples.size(); k++) {
+                auto f = double(pixel_samples[k]) / samples_per_pixel;
+                auto c = color(f, 4 * f * (1 - f), 1 - f);
+                heatmap.pixels[k] = c * c;      // squared, so gamma correction shows the ramp as is
+            }
+            return heatmap;
         }
     
     private:
+        static constexpr uint64_t feature_stream = 1ull << 40;     // sample indices of the feature rays, past any real sample
+
         int image_height;
-        double pixel_samples_scale;
+        std::vector<int> pixel_samples;         // samples taken per pixel in the last render
+        render_stats last_stats;
         point3 center;
         point3 pixel00_loc;
         vec3 pixel_delta_u;
@@ -69,10 +345,7 @@ class camera {
 
         void initialize() {
             // Calculate image properties
-            image_height = int(image_width / aspect_ratio);
-            image_height = std::max(1, static_cast<int>(std::round(image_width / aspect_ratio)));
-
-            pixel_samples_scale = 1.0 / samples_per_pixel;
+            image_height = height();
 
             center = lookfrom;
 
@@ -105,46 +378,334 @@ class camera {
             defocus_disk_v = v * defocus_radius;
         }
 
-        ray get_ray(int i, int j) const {
+        // takes each pixel of the tile from its count in sums up to samples_per_pixel
+        template <typename world_type>
+        void render_tile(const world_type& world, const material_table& materials, std::vector<pixel_sums>& sums, const tile& t) const {
+            int tile_width = t.x1 - t.x0;
+            for (int j = t.y0; j < t.y1; j++) {
+                for (int i = t.x0; i < t.x1; i++) {
+                    auto& sum = sums[size_t(j - t.y0) * tile_width + (i - t.x0)];
+                    color pixel_color(0, 0, 0);
+                    double luminance_sq = 0;
+                    auto pixel = uint64_t(j) * image_width + i;
+
+                    // running mean and variance of the sample luminance (Welford), carried on
+                    // from the sums when resuming
+                    int n = int(sum.count);
+                    double mean = 0, m2 = 0;
+                    if (n > 0) {
+                        mean = luminance(color(sum.sum[0], sum.sum[1], sum.sum[2])) / n;
+                        m2 = std::fmax(0.0, sum.luminance_sq - n * mean * mean);
+                        if (adaptive_threshold > 0 && n >= adaptive_min_samples && converged(mean, m2, n)) continue;
+                    }
+
+                    while (n < samples_per_pixel) {
+                        auto gen = sampler::for_sample(sampling, seed, pixel, i, j, n, samples_per_pixel);
+                        ray r = get_ray(i, j, gen);
+                        color sample_color = ray_color(r, max_depth, world, materials, gen);
+                        pixel_color += sample_color;
+                        n++;
+
+                        auto lum = luminance(sample_color);
+                        luminance_sq += lum * lum;
+                        if (adaptive_threshold > 0) {
+                            auto delta = lum - mean;
+                            mean += delta / n;
+                            m2 += delta * (lum - mean);
+                            if (n >= adaptive_min_samples && converged(mean, m2, n)) break;
+                        }
+                    }
+
+                    for (int c = 0; c < 3; c++) sum.sum[c] += pixel_color[c];
+                    sum.luminance_sq += luminance_sq;
+                    sum.count = uint32_t(n);
+                }
+            }
+        }
+
+        // the packet version: the tile in 8x8 blocks, whose pixels each take their next sample
+        // in rounds, the round's camera rays traced as one packet. a pixel's samples, its
+        // numbers and its adaptive stop come out as in render_tile
+        template <typename world_type>
+        void render_tile_packets(const world_type& world, const material_table& materials, std::vector<pixel_sums>& sums,
+                                 const tile& t) const {
+            constexpr int block = 8;
+            static_assert(block * block <= ray_packet::max_size, "a block must fit in a packet");
+
+            struct pixel_state {
+                int i, j, n;
+                pixel_sums* sum;
+                color pixel_color;
+                double luminance_sq, mean, m2;
+                bool stopped;                   // by adaptive sampling
+            };
+            std::vector<pixel_state> pending;
+            std::vector<sampler> gens;
+            std::vector<int> owners;            // pending pixel of each packet ray
+            ray_packet packet;
+
+            int tile_width = t.x1 - t.x0;
+            for (int by = t.y0; by < t.y1; by += block) {
+                for (int bx = t.x0; bx < t.x1; bx += block) {
+                    pending.clear();
+                    for (int j = by; j < std::min(by + block, t.y1); j++) {
+                        for (int i = bx; i < std::min(bx + block, t.x1); i++) {
+                            auto& sum = sums[size_t(j - t.y0) * tile_width + (i - t.x0)];
+                            pixel_state p = {i, j, int(sum.count), &sum, color(0, 0, 0), 0, 0, 0, false};
+                            if (p.n > 0) {
+                                p.mean = luminance(color(sum.sum[0], sum.sum[1], sum.sum[2])) / p.n;
+                                p.m2 = std::fmax(0.0, sum.luminance_sq - p.n * p.mean * p.mean);
+                                if (adaptive_threshold > 0 && p.n >= adaptive_min_samples && converged(p.mean, p.m2, p.n)) continue;
+                            }
+                            if (p.n < samples_per_pixel) pending.push_back(p);
+                        }
+                    }
+
+                    // one round: every pixel still sampling takes one more sample
+                    while (!pending.empty()) {
+                        gens.clear();
+                        owners.clear();
+                        packet.size = 0;
+                        packet.hits = 0;
+                        for (int k = 0; k < int(pending.size()); k++) {
+                            const auto& p = pending[k];
+                            auto pixel = uint64_t(p.j) * image_width + p.i;
+                            gens.push_back(sampler::for_sample(sampling, seed, pixel, p.i, p.j, p.n, samples_per_pixel));
+                            packet.rays[packet.size] = get_ray(p.i, p.j, gens.back());
+                            packet.t_max[packet.size] = infinity;
+                            packet.size++;
+                            owners.push_back(k);
+                        }
+                        if (max_depth > 0) world.hit_packet(packet);
+
+                        for (int r = 0; r < packet.size; r++) {
+                            auto& p = pending[owners[r]];
+                            bool hit = (packet.hits >> r) & 1;
+                            color sample_color = path_color(packet.rays[r], hit, packet.recs[r], max_depth, world, materials, gens[r]);
+                            p.pixel_color += sample_color;
+                            p.n++;
+
+                            auto lum = luminance(sample_color);
+                            p.luminance_sq += lum * lum;
+                            if (adaptive_threshold > 0) {
+                                auto delta = lum - p.mean;
+                                p.mean += delta / p.n;
+                                p.m2 += delta * (lum - p.mean);
+                                p.stopped = p.n >= adaptive_min_samples && converged(p.mean, p.m2, p.n);
+                            }
+                        }
+
+                        // pixels that are done are written out and dropped
+                        size_t kept = 0;
+                        for (auto& p : pending) {
+                            if (!p.stopped && p.n < samples_per_pixel) {
+                                pending[kept++] = p;
+                                continue;
+                            }
+                            for (int c = 0; c < 3; c++) p.sum->sum[c] += p.pixel_color[c];
+                            p.sum->luminance_sq += p.luminance_sq;
+                            p.sum->count = uint32_t(p.n);
+                        }
+                        pending.resize(kept);
+                    }
+                }
+            }
+        }
+
+        // the wavefront version: all pending samples of the tile, breadth-first in batches. when
+        // sampling adaptively a batch takes only a few samples per pixel, and a pixel's samples
+        // are added in order up to where render_tile would have stopped; any past that are dropped
+        template <typename world_type>
+        void render_tile_wavefront(const world_type& world, const material_table& materials, std::vector<pixel_sums>& sums,
+                                   const tile& t, wavefront_tracer& tracer) const {
+            constexpr int adaptive_step = 4;        // samples per pixel per batch past adaptive_min_samples
+            int tile_width = t.x1 - t.x0;
+            int tile_pixels = tile_width * (t.y1 - t.y0);
+            int chunk = std::max(1, wavefront_batch / tile_pixels);
+
+            struct pixel_state {
+                int n;
+                color pixel_color;
+                double luminance_sq, mean, m2;
+                bool stopped;                       // by adaptive sampling or the sample budget
+            };
+            std::vector<pixel_state> pixels(tile_pixels);
+            int first_sample = samples_per_pixel;
+            for (int p = 0; p < tile_pixels; p++) {
+                const auto& sum = sums[p];
+                auto& state = pixels[p];
+                state = {int(sum.count), color(0, 0, 0), 0, 0, 0, int(sum.count) >= samples_per_pixel};
+                if (state.n > 0) {
+                    state.mean = luminance(color(sum.sum[0], sum.sum[1], sum.sum[2])) / state.n;
+                    state.m2 = std::fmax(0.0, sum.luminance_sq - state.n * state.mean * state.mean);
+                    if (adaptive_threshold > 0 && state.n >= adaptive_min_samples && converged(state.mean, state.m2, state.n)) state.stopped = true;
+                }
+                if (!state.stopped) first_sample = std::min(first_sample, state.n);
+            }
+
+            std::vector<path_state> paths;
+            std::vector<int> owners;                // tile pixel of each path
+            std::vector<color> radiance;
+
+            // each pass covers samples [s0, s1) of every pixel in the tile that still needs them
+            for (int s0 = first_sample, s1; s0 < samples_per_pixel; s0 = s1) {
+                s1 = std::min(samples_per_pixel, s0 + chunk);
+                if (adaptive_threshold > 0) s1 = std::min(s1, std::max(s0 + adaptive_step, adaptive_min_samples));
+
+                paths.clear();
+                owners.clear();
+                for (int p = 0; p < tile_pixels; p++) {
+                    if (pixels[p].stopped) continue;
+                    int i = t.x0 + p % tile_width, j = t.y0 + p / tile_width;
+                    auto pixel = uint64_t(j) * image_width + i;
+                    for (int sample = std::max(s0, pixels[p].n); sample < s1; sample++) {
+                        auto gen = sampler::for_sample(sampling, seed, pixel, i, j, sample, samples_per_pixel);
+                        ray r = get_ray(i, j, gen);
+                        paths.push_back(path_state{r, color(1, 1, 1), gen});
+                        owners.push_back(p);
+                    }
+                }
+                if (paths.empty()) break;
+
+                tracer.trace(paths, radiance, world, materials, [this](const ray& r) { return background(r); });
+
+                // summed in sample order, as the depth-first loop does
+                for (size_t k = 0; k < paths.size(); k++) {
+                    auto& state = pixels[owners[k]];
+                    if (state.stopped) continue;
+                    state.pixel_color += radiance[k];
+                    state.n++;
+
+                    auto lum = luminance(radiance[k]);
+                    state.luminance_sq += lum * lum;
+                    if (adaptive_threshold > 0) {
+                        auto delta = lum - state.mean;
+                        state.mean += delta / state.n;
+                        state.m2 += delta * (lum - state.mean);
+                        if (state.n >= adaptive_min_samples && converged(state.mean, state.m2, state.n)) state.stopped = true;
+                    }
+                    if (state.n >= samples_per_pixel) state.stopped = true;
+                }
+            }
+
+            for (int p = 0; p < tile_pixels; p++) {
+                auto& sum = sums[p];
+                const auto& state = pixels[p];
+                for (int c = 0; c < 3; c++) sum.sum[c] += state.pixel_color[c];
+                sum.luminance_sq += state.luminance_sq;
+                sum.count = uint32_t(state.n);
+            }
+        }
+
+        bool converged(double mean, double m2, int n) const {
+            // error of the mean, carried through the sqrt gamma curve: d(sqrt x) = dx / (2 sqrt x)
+            auto std_error = std::sqrt(m2 / (n - 1) / n);
+            auto display_error = std_error / (2 * std::sqrt(std::fmax(mean, 1e-4)));
+            return display_error <= adaptive_threshold;
+        }
+
+        static void print_progress(int percent) {
+            // \r returns to the start of the line so each update overwrites the last
+            std::clog << "\rRendering: " << percent << "%   " << std::flush;
+        }
+
+        ray get_ray(int i, int j, sampler& gen) const {
             // makes camera ray from defocus disk and directed at randomly sampled point around pixel loc i,j
-            auto offset = sample_square();
+            auto offset = sample_square(gen);
             auto pixel_sample = pixel00_loc
                                 + ((i + offset.x()) * pixel_delta_u)
                                 + ((j + offset.y()) * pixel_delta_v);
             
-            auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+            auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample(gen);
             auto ray_direction = pixel_sample - ray_origin;
 
             return ray(ray_origin, ray_direction);
         }
 
-        vec3 sample_square() const {
+        vec3 sample_square(sampler& gen) const {
             // returns vector to random point within [-.5, -.5]-[+.5, +.5] square
-            return vec3(random_double(-0.5, 0.5), random_double(-0.5, 0.5), 0);
+            // y takes the first number, as it did when these were two separate draws
+            double u, v;
+            gen.next_2d(v, u);
+            return vec3(u - 0.5, v - 0.5, 0);
         }
 
-        point3 defocus_disk_sample() const {
-            auto p = random_in_unit_disk();
+        point3 defocus_disk_sample(sampler& gen) const {
+            auto p = random_in_unit_disk(gen);
             return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
         }
 
-        color ray_color(const ray& r, int depth, const hittable& world) const {
-            if (depth <= 0) return color(0, 0, 0);
-
+        template <typename world_type>
+        color ray_color(const ray& r, int depth, const world_type& world, const material_table& materials, sampler& gen) const {
             hit_record rec;
+            bool hit = depth > 0 && world.hit(r, interval(0, infinity), rec);
+            return path_color(r, hit, rec, depth, world, materials, gen);
+        }
+
+        // the path of camera ray r, whose first hit the caller has found (rec, if hit)
+        template <typename world_type>
+        color path_color(const ray& r, bool hit, hit_record rec, int depth, const world_type& world, const material_table& materials,
+                         sampler& gen) const {
+            // iterative path: throughput is the product of every attenuation so far, so each
+            // light the path reaches adds throughput * its light to the radiance
+            color radiance(0, 0, 0);
+            color throughput(1, 1, 1);
+            ray current = r;
+            real bsdf_pdf = 0;                  // pdf the last bounce chose current with, 0 if lights can't be sampled there
+            bool sample_lights = lights && !lights->empty();
+
+            for (int bounce = 0; bounce < depth; bounce++) {
+                if (bounce == 0) STAT_ADD(primary_rays, 1);
+                else STAT_ADD(secondary_rays, 1);
+
+                if (bounce > 0) hit = world.hit(current, interval(0, infinity), rec);
+                if (!hit) {
+                    STAT_PATH(bounce + 1);
+                    return radiance + throughput * background(current);
+                }
+
+                if (materials.emits(rec.mat)) radiance += throughput * emitted_light(lights, materials, current, rec, bsdf_pdf);
+
+                // next-event estimation draws its numbers before the scatter does, each at its
+                // own stage of the bounce's dimensions
+                gen.seek(bounce, sampler::light_choice);
+                auto diffuse = sample_lights ? std::get_if<lambertian>(&materials[rec.mat]) : nullptr;
+                ray shadow;
+                real shadow_t;
+                color light;
+                if (diffuse && sample_direct_light(*lights, *diffuse, rec, gen, shadow, shadow_t, light)) {
+                    STAT_ADD(shadow_rays, 1);
+                    hit_record blocker;
+                    if (!world.hit(shadow, interval(0, shadow_t), blocker)) radiance += throughput * light;
+                }
 
-            if (world.hit(r, interval(0.001, infinity), rec)) {
                 ray scattered;
                 color attenuation;
-                if (rec.mat->scatter(r, rec, attenuation, scattered)) {
-                    return attenuation * ray_color(scattered, depth - 1, world);
+                gen.seek(bounce, sampler::scatter);
+                if (!materials.scatter(rec.mat, current, rec, attenuation, scattered, gen)) {
+                    STAT_PATH(bounce + 1);
+                    return radiance;
+                }
+                throughput = throughput * attenuation;
+                bsdf_pdf = diffuse ? diffuse->scatter_pdf(rec, unit_vector(scattered.direction())) : 0;
+
+                gen.seek(bounce, sampler::roulette);
+                if (russian_roulette && bounce + 1 >= roulette_min_bounces && !survives_roulette(throughput, gen)) {
+                    STAT_PATH(bounce + 1);
+                    return radiance;
                 }
-                return color(0, 0, 0);
+
+                current = scattered;
             }
 
+            STAT_PATH(depth);
+            return radiance;
+        }
+
+        color background(const ray& r) const {
             vec3 unit_direction = unit_vector(r.direction());
             auto a = 0.5 * (unit_direction.y() + 1.0);
-            return ((1.0 - a) * color(1.0, 1.0, 1.0)) + (a * color(0.5, 0.7, 1.0));
+            return sky_brightness * (((1.0 - a) * color(1.0, 1.0, 1.0)) + (a * color(0.5, 0.7, 1.0)));
         }
 };
 
@@ -0,0 +1,214 @@
+#ifndef CHECKPOINT_FILE_H
+#define CHECKPOINT_FILE_H
+
+#include "accumulation_buffer.h"
+#include "camera.h"
+#include "mapped_file.h"
+#include "material.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// A checkpoint file holds an accumulation_buffer: a header, then two slots of pixel_sums.
+// Saves go to the slot not in use and the header is switched to it only once that slot is
+// synced, so a render killed mid-save still leaves the previous checkpoint intact. The file
+// is mapped read-write, so a save is one copy into the page cache and an msync; nothing is
+// serialized. Files are native-endian.
+
+struct checkpoint_file_header {
+    static constexpr char magic_bytes[8] = {'R', 'T', 'A', 'C', 'C', 'U', 'M', 0};
+    static constexpr uint32_t current_version = 2;     // 2: records the sampler
+
+    char magic[8];
+    uint32_t version;
+    uint32_t pixel_size;                // sizeof(pixel_sums) when written
+    int32_t width;
+    int32_t height;
+    uint64_t seed;
+    uint64_t fingerprint;
+    uint64_t generation;                // saves so far; 0 = neither slot holds a checkpoint yet
+    uint32_t active_slot;               // the slot of the latest save
+    uint32_t sampling;                  // sampler_type of the samples
+    uint64_t padding;                   // keeps the slots 64-byte aligned
+
+    static size_t slot_bytes(int width, int height) { return size_t(width) * height * sizeof(pixel_sums); }
+    static size_t slot_offset(int width, int height, int slot) { return sizeof(checkpoint_file_header) + slot * slot_bytes(width, height); }
+    static size_t file_bytes(int width, int height) { return slot_offset(width, height, 2); }
+};
+
+static_assert(sizeof(checkpoint_file_header) == 64, "checkpoint header layout");
+
+// a cheap identity for what a render's samples are of: the camera's view and image size,
+// the path depth, the sky, the materials and the world's bounds. resuming or merging refuses
+// sums with another fingerprint. it catches a wrong scene file or changed settings, not every
+// edit to a scene; sample counts, seeds, Russian roulette and light sampling don't change it.
+// the sampler is checked on its own (accumulation_buffer::sampling), since workers adopt the
+// coordinator's and must still match its fingerprint
+inline uint64_t render_fingerprint(const camera& cam, const material_table& materials, const hittable& world) {
+    uint64_t hash = 0xcbf29ce484222325ull;      // FNV-1a
+    auto mix = [&](const void* data, size_t size) {
+        auto bytes = static_cast<const unsigned char*>(data);
+        for (size_t k = 0; k < size; k++) hash = (hash ^ bytes[k]) * 0x100000001b3ull;
+    };
+    auto mix_double = [&](double x) { mix(&x, sizeof(x)); };
+    auto mix_vec = [&](const vec3& v) { for (int axis = 0; axis < 3; axis++) mix_double(v[axis]); };
+
+    mix_double(cam.aspect_ratio);
+    mix(&cam.image_width, sizeof(cam.image_width));
+    mix(&cam.max_depth, sizeof(cam.max_depth));
+    mix_double(cam.vfov);
+    mix_vec(cam.lookfrom);
+    mix_vec(cam.lookat);
+    mix_vec(cam.vup);
+    mix_double(cam.defocus_angle);
+    mix_double(cam.focus_dist);
+    mix_double(cam.sky_brightness);
+
+    for (size_t id = 0; id < materials.size(); id++) {
+        auto rec = to_record(materials[material_id(id)]);
+        mix(&rec, sizeof(rec));
+    }
+
+    // rounded to float, so float and double builds agree on the same scene
+    auto box = world.bounding_box();
+    for (int axis = 0; axis < 3; axis++) {
+        float bounds[2] = {float(box.axis_interval(axis).min), float(box.axis_interval(axis).max)};
+        mix(bounds, sizeof(bounds));
+    }
+    return hash;
+}
+
+// reads the latest checkpoint in path into accum, which is left empty if nothing was saved
+// to the file yet. errors go to std::cerr
+inline bool load_checkpoint(const std::string& path, accumulation_buffer& accum) {
+    auto fail = [&](const std::string& message) {
+        std::cerr << path << ": " << message << '\n';
+        return false;
+    };
+
+    mapped_file file;
+    if (!file.open(path)) return fail("can't map file");
+    if (file.size() < sizeof(checkpoint_file_header)) return fail("too short for a checkpoint header");
+
+    checkpoint_file_header header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, checkpoint_file_header::magic_bytes, sizeof(header.magic)) != 0) return fail("not a checkpoint file");
+    if (header.version != checkpoint_file_header::current_version) return fail("unsupported checkpoint version " + std::to_string(header.version));
+    if (header.pixel_size != sizeof(pixel_sums)) return fail("written by a build with a different pixel layout");
+    if (header.width <= 0 || header.height <= 0 || header.active_slot > 1) return fail("corrupt header");
+    if (file.size() < checkpoint_file_header::file_bytes(header.width, header.height)) return fail("truncated");
+
+    // a file opened for a render that was stopped before its first save holds nothing yet
+    if (header.generation == 0) {
+        accum = accumulation_buffer();
+        return true;
+    }
+
+    accum = accumulation_buffer(header.width, header.height, header.seed);
+    accum.fingerprint = header.fingerprint;
+    accum.sampling = sampler_type(header.sampling);
+    std::memcpy(accum.pixels.data(), file.data() + checkpoint_file_header::slot_offset(header.width, header.height, int(header.active_slot)),
+                checkpoint_file_header::slot_bytes(header.width, header.height));
+    return true;
+}
+
+// a checkpoint file open for saving one render's sums
+class checkpoint_file {
+    public:
+        checkpoint_file() {}
+        checkpoint_file(const checkpoint_file&) = delete;
+        checkpoint_file& operator=(const checkpoint_file&) = delete;
+
+        ~checkpoint_file() { close(); }
+
+        // opens path for checkpoints of an image the size of accum's, creating it if need be.
+        // a file that is already a checkpoint of that size keeps its contents until the first
+        // save, so reopening the checkpoint being resumed from never loses it
+        bool open(const std::string& path, const accumulation_buffer& accum) {
+            close();
+
+            int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+            if (fd < 0) return false;
+
+            size_t bytes = checkpoint_file_header::file_bytes(accum.width, accum.height);
+            checkpoint_file_header existing;
+            struct stat info;
+            bool keep = fstat(fd, &info) == 0 && size_t(info.st_size) == bytes
+                        && pread(fd, &existing, sizeof(existing), 0) == ssize_t(sizeof(existing))
+                        && std::memcmp(existing.magic, checkpoint_file_header::magic_bytes, sizeof(existing.magic)) == 0
+                        && existing.version == checkpoint_file_header::current_version
+                        && existing.pixel_size == sizeof(pixel_sums) && existing.active_slot <= 1
+                        && existing.width == accum.width && existing.height == accum.height;
+
+            if (!keep && (ftruncate(fd, 0) != 0 || ftruncate(fd, off_t(bytes)) != 0)) {
+                ::close(fd);
+                return false;
+            }
+
+            void* addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (addr == MAP_FAILED) return false;
+
+            base = static_cast<unsigned char*>(addr);
+            length = bytes;
+
+            if (!keep) {
+                checkpoint_file_header header = {};
+                std::memcpy(header.magic, checkpoint_file_header::magic_bytes, sizeof(header.magic));
+                header.version = checkpoint_file_header::current_version;
+                header.pixel_size = sizeof(pixel_sums);
+                header.width = accum.width;
+                header.height = accum.height;
+                std::memcpy(base, &header, sizeof(header));
+                sync(0, sizeof(header));
+            }
+            return true;
+        }
+
+        void close() {
+            if (base) munmap(base, length);
+            base = nullptr;
+            length = 0;
+        }
+
+        // writes accum as the new latest checkpoint. accum must be of the size the file was
+        // opened for and must not change during the call
+        bool save(const accumulation_buffer& accum) {
+            if (!base) return false;
+            auto& header = *reinterpret_cast<checkpoint_file_header*>(base);
+            if (accum.width != header.width || accum.height != header.height) return false;
+
+            int slot = header.generation == 0 ? 0 : 1 - int(header.active_slot);
+            size_t offset = checkpoint_file_header::slot_offset(accum.width, accum.height, slot);
+            size_t bytes = checkpoint_file_header::slot_bytes(accum.width, accum.height);
+            std::memcpy(base + offset, accum.pixels.data(), bytes);
+            if (!sync(offset, bytes)) return false;
+
+            // the header only moves to the new slot once that slot is on disk
+            header.seed = accum.seed;
+            header.fingerprint = accum.fingerprint;
+            header.sampling = uint32_t(accum.sampling);
+            header.active_slot = uint32_t(slot);
+            header.generation++;
+            return sync(0, sizeof(header));
+        }
+
+    private:
+        unsigned char* base = nullptr;
+        size_t length = 0;
+
+        // msync wants a page-aligned start
+        bool sync(size_t offset, size_t bytes) {
+            size_t page = size_t(sysconf(_SC_PAGESIZE));
+            size_t start = offset / page * page;
+            return msync(base + start, offset + bytes - start, MS_SYNC) == 0;
+        }
+};
+
+#endif
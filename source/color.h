@@ -12,7 +12,12 @@ inline double linear_to_gamma(double linear_component) {
     return 0;
 }
 
-void write_color(std::ostream& out, const color& pixel_color) {
+// Rec. 709 luma weights, for per-pixel noise estimates
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+inline void color_to_bytes(const color& pixel_color, unsigned char bytes[3]) {
     // values are 0-1
     auto r = pixel_color.x();
     auto g = pixel_color.y();
@@ -25,11 +30,17 @@ void write_color(std::ostream& out, const color& pixel_color) {
 
     // values are 0-255
     static const interval intensity(0.000, 0.999);
-    int rbyte = int(256 * intensity.clamp(r));
-    int gbyte = int(256 * intensity.clamp(g));
-    int bbyte = int(256 * intensity.clamp(b));
+    bytes[0] = (unsigned char)(256 * intensity.clamp(r));
+    bytes[1] = (unsigned char)(256 * intensity.clamp(g));
+    bytes[2] = (unsigned char)(256 * intensity.clamp(b));
+}
+
+// one ASCII (P3) pixel
+void write_color(std::ostream& out, const color& pixel_color) {
+    unsigned char bytes[3];
+    color_to_bytes(pixel_color, bytes);
 
-    out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
+    out << int(bytes[0]) << ' ' << int(bytes[1]) << ' ' << int(bytes[2]) << '\n';
 }
 
 #endif
@@ -0,0 +1,208 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "accumulation_buffer.h"
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// what the first surface under each pixel is, averaged over a few camera rays: its color
+// without lighting, its normal and its distance. these take a handful of rays to converge
+// where the lit image takes hundreds, so they mark the edges a denoiser must keep
+struct feature_buffer {
+    int width = 0;
+    int height = 0;
+    std::vector<color> albedo;              // base color of the surface; 1 for glass and the sky
+    std::vector<vec3> normal;               // facing the camera, shorter at silhouettes; 0 for the sky
+    std::vector<double> depth;              // mean distance over the rays that hit, 0 for none
+
+    feature_buffer() {}
+    feature_buffer(int width, int height)
+      : width(width), height(height), albedo(size_t(width) * height), normal(size_t(width) * height), depth(size_t(width) * height) {}
+
+    // the buffers as viewable images: normals mapped from [-1, 1], depth bright near and dark far.
+    // values are squared so the writers' gamma curve shows them as stored
+    framebuffer albedo_image() const {
+        framebuffer image(width, height);
+        image.pixels = albedo;
+        return image;
+    }
+
+    framebuffer normal_image() const {
+        framebuffer image(width, height);
+        for (size_t k = 0; k < normal.size(); k++) {
+            auto c = 0.5 * (normal[k] + vec3(1, 1, 1));
+            image.pixels[k] = c * c;
+        }
+        return image;
+    }
+
+    framebuffer depth_image() const {
+        framebuffer image(width, height);
+        double far = 0;
+        for (auto z : depth) far = std::max(far, z);
+        for (size_t k = 0; k < depth.size(); k++) {
+            double v = depth[k] > 0 ? 1 - depth[k] / (far * 1.05) : 0;
+            image.pixels[k] = color(v * v, v * v, v * v);
+        }
+        return image;
+    }
+};
+
+// edge-avoiding a-trous wavelet filter (Dammertz et al. 2010), with the variance-guided
+// luminance weights of SVGF (Schied et al. 2017). each pass blurs with a 5x5 B-spline kernel
+// whose taps are 2^pass pixels apart, so five passes reach 65 pixels across for 125 taps.
+// a tap counts less the more its normal, depth or lighting differs from the center's; the
+// lighting tolerance is the pixel's own noise level, read from the accumulation buffer's
+// squared luminance, so converged regions are left alone. the filter runs on lighting with the
+// albedo divided out and multiplies it back in at the end, so texture stays sharp
+class denoiser {
+    public:
+        int passes = 5;
+        double color_sigma = 3;             // lighting differences tolerated, in standard errors of the pixel's mean
+        int normal_power = 128;             // weight is dot(normals)^normal_power
+        double depth_sigma = 1;             // depth differences tolerated, in steps of the local depth gradient
+        int num_threads = 0;                // 0 = one per hardware thread
+
+        framebuffer denoise(const accumulation_buffer& accum, const feature_buffer& features) const {
+            int width = accum.width, height = accum.height;
+            size_t n = accum.pixels.size();
+            auto index = [&](int i, int j) { return size_t(j) * width + i; };
+
+            // demodulate: lighting = color / albedo, its variance scaled to match
+            std::vector<color> light(n, color(0, 0, 0));
+            std::vector<double> variance(n, 0);
+            for (size_t k = 0; k < n; k++) {
+                const auto& p = accum.pixels[k];
+                if (p.count == 0) continue;
+                color mean = (1.0 / p.count) * color(p.sum[0], p.sum[1], p.sum[2]);
+                color albedo = safe_albedo(features.albedo[k]);
+                light[k] = color(mean.x() / albedo.x(), mean.y() / albedo.y(), mean.z() / albedo.z());
+
+                double lum = luminance(mean);
+                double sample_variance = std::max(0.0, p.luminance_sq / p.count - lum * lum);
+                double albedo_lum = luminance(albedo);
+                variance[k] = sample_variance / p.count / (albedo_lum * albedo_lum);
+            }
+
+            // normals are compared by direction; averaging shortened them at silhouettes
+            std::vector<vec3> normal(n, vec3(0, 0, 0));
+            for (size_t k = 0; k < n; k++) {
+                auto length = features.normal[k].length();
+                if (length > 1e-6) normal[k] = features.normal[k] / length;
+            }
+
+            // how fast depth changes around each pixel, so slanted surfaces aren't cut into strips
+            std::vector<double> gradient(n, 0);
+            for (int j = 0; j < height; j++) {
+                for (int i = 0; i < width; i++) {
+                    auto z = [&](int x, int y) { return features.depth[index(std::clamp(x, 0, width - 1), std::clamp(y, 0, height - 1))]; };
+                    gradient[index(i, j)] = std::max(std::fabs(z(i + 1, j) - z(i - 1, j)), std::fabs(z(i, j + 1) - z(i, j - 1))) / 2;
+                }
+            }
+
+            std::vector<color> next_light(n);
+            std::vector<double> next_variance(n), blurred(n);
+            for (int pass = 0; pass < passes; pass++) {
+                int step = 1 << pass;
+
+                // the center's variance is blurred a little, since one pixel's estimate is noisy itself
+                for_rows(height, [&](int j) {
+                    for (int i = 0; i < width; i++) {
+                        double sum = 0, weights = 0;
+                        for (int dy = -1; dy <= 1; dy++) {
+                            for (int dx = -1; dx <= 1; dx++) {
+                                int x = i + dx, y = j + dy;
+                                if (x < 0 || x >= width || y < 0 || y >= height) continue;
+                                double w = (dx ? 1 : 2) * (dy ? 1 : 2);
+                                sum += w * variance[index(x, y)];
+                                weights += w;
+                            }
+                        }
+                        blurred[index(i, j)] = sum / weights;
+                    }
+                });
+
+                for_rows(height, [&](int j) {
+                    for (int i = 0; i < width; i++) {
+                        size_t p = index(i, j);
+                        double lum_p = luminance(light[p]);
+                        double lum_scale = color_sigma * std::sqrt(blurred[p]) + 1e-6;
+                        const vec3& normal_p = normal[p];
+                        double depth_p = features.depth[p];
+
+                        color sum = light[p] * kernel[2] * kernel[2];
+                        double var_sum = variance[p] * (kernel[2] * kernel[2]) * (kernel[2] * kernel[2]);
+                        double weights = kernel[2] * kernel[2];
+
+                        for (int dy = -2; dy <= 2; dy++) {
+                            for (int dx = -2; dx <= 2; dx++) {
+                                int x = i + dx * step, y = j + dy * step;
+                                if ((dx == 0 && dy == 0) || x < 0 || x >= width || y < 0 || y >= height) continue;
+                                size_t q = index(x, y);
+
+                                double normal_weight = power(dot(normal_p, normal[q]), normal_power);
+                                if (normal_weight <= 0) continue;
+                                double reach = depth_sigma * gradient[p] * step * std::sqrt(double(dx * dx + dy * dy)) + 1e-3 * depth_p;
+                                double depth_diff = std::fabs(depth_p - features.depth[q]);
+                                double lum_diff = std::fabs(lum_p - luminance(light[q]));
+
+                                double w = kernel[dx + 2] * kernel[dy + 2] * normal_weight
+                                           * std::exp(-depth_diff / (reach + 1e-9) - lum_diff / lum_scale);
+                                sum += w * light[q];
+                                var_sum += w * w * variance[q];
+                                weights += w;
+                            }
+                        }
+
+                        next_light[p] = sum / weights;
+                        next_variance[p] = var_sum / (weights * weights);
+                    }
+                });
+
+                std::swap(light, next_light);
+                std::swap(variance, next_variance);
+            }
+
+            framebuffer image(width, height);
+            for (size_t k = 0; k < n; k++) image.pixels[k] = light[k] * safe_albedo(features.albedo[k]);
+            return image;
+        }
+
+    private:
+        static constexpr double kernel[5] = {1.0 / 16, 1.0 / 4, 3.0 / 8, 1.0 / 4, 1.0 / 16};
+
+        // x^n for cosines, 0 for negative x; by squaring, much cheaper than std::pow
+        static double power(double x, int n) {
+            if (x <= 0) return 0;
+            double result = 1;
+            for (; n > 0; n >>= 1) {
+                if (n & 1) result *= x;
+                x *= x;
+            }
+            return result;
+        }
+
+        // black albedo would divide the lighting by zero; such pixels are filtered as they are
+        static color safe_albedo(const color& albedo) {
+            return color(albedo.x() > 0.01 ? albedo.x() : 1, albedo.y() > 0.01 ? albedo.y() : 1, albedo.z() > 0.01 ? albedo.z() : 1);
+        }
+
+        // runs row(j) for every row, split into contiguous bands across threads
+        template <typename row_fn>
+        void for_rows(int height, row_fn&& row) const {
+            int threads = num_threads > 0 ? num_threads : int(std::max(1u, std::thread::hardware_concurrency()));
+            threads = std::min(threads, height);
+            std::vector<std::thread> workers;
+            for (int t = 0; t < threads; t++) {
+                workers.emplace_back([&, t] {
+                    for (int j = height * t / threads; j < height * (t + 1) / threads; j++) row(j);
+                });
+            }
+            for (auto& worker : workers) worker.join();
+        }
+};
+
+#endif
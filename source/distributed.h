@@ -0,0 +1,354 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "accumulation_buffer.h"
+#include "camera.h"
+#include "hittable.h"
+#include "material.h"
+#include "tile_scheduler.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Rendering one frame with several processes on one host. The coordinator loads the scene,
+// listens on a UNIX-domain socket and owns the frame's accumulation_buffer; workers load the
+// same scene and connect, one connection per render thread. Each connection is sent one tile
+// at a time together with the tile's sums so far, and sends the sums back once it has traced
+// the tile up to the frame's sample count. A connection that drops has its tile put back at
+// the front of the queue, so losing a worker only costs the tiles it had in flight. Which
+// process traces a tile never changes its samples, so the frame is the same as a local render.
+//
+// Messages are raw native-endian structs, since both ends are builds of this program on
+// one machine:
+//
+//     worker -> coordinator   worker_hello
+//     coordinator -> worker   worker_job (accepted = 0 means the scene or view differ)
+//     coordinator -> worker   tile_message + its pixel_sums, an empty tile when the frame is done
+//     worker -> coordinator   tile_message + the updated pixel_sums
+
+struct worker_hello {
+    static constexpr uint32_t magic_value = 0x33575452;     // "RTW3"
+
+    uint32_t magic;
+    uint32_t pixel_size;                // sizeof(pixel_sums)
+    uint64_t fingerprint;               // render_fingerprint of the worker's scene and view
+    int32_t width, height;
+};
+
+// the sampling settings of the frame, which the worker adopts
+struct worker_job {
+    uint32_t accepted;
+    int32_t samples_per_pixel;
+    uint64_t seed;
+    double adaptive_threshold;
+    int32_t adaptive_min_samples;
+    int32_t russian_roulette;
+    int32_t sampling;                   // sampler_type
+    int32_t light_sampling;             // next-event estimation toward the scene's lights
+};
+
+struct tile_message {
+    int32_t x0, y0, x1, y1;
+
+    size_t pixel_count() const { return size_t(x1 - x0) * (y1 - y0); }
+};
+
+static_assert(std::is_trivially_copyable<worker_hello>::value && std::is_trivially_copyable<worker_job>::value
+              && std::is_trivially_copyable<tile_message>::value, "messages are sent as raw bytes");
+
+// whole-buffer socket I/O. sends never raise SIGPIPE, so a peer that went away is an error
+// return rather than the end of the process
+inline bool send_all(int fd, const void* data, size_t size) {
+    auto p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        p += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+inline bool recv_all(int fd, void* data, size_t size) {
+    auto p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n <= 0) return false;
+        p += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+inline bool unix_address(const std::string& path, sockaddr_un& address) {
+    address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << path << ": socket path too long\n";
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// a socket listening on path, replacing any socket file left there; -1 if it can't be set up
+inline int unix_listener(const std::string& path) {
+    sockaddr_un address;
+    if (!unix_address(path, address)) return -1;
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        std::cerr << path << ": can't listen: " << std::strerror(errno) << '\n';
+        if (listener >= 0) close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+// serves the frame described by cam to workers on socket_path until every tile of accum is
+// traced. accum is resumed from if it already holds samples of this image (e.g. from a
+// checkpoint), and cam's checkpoint settings and interrupt flag work as in camera::render.
+// returns false if the socket can't be set up or the render was interrupted
+inline bool run_coordinator(const std::string& socket_path, camera& cam, accumulation_buffer& accum) {
+    if (accum.width != cam.image_width || accum.height != cam.height()) {
+        auto fingerprint = accum.fingerprint;
+        accum = accumulation_buffer(cam.image_width, cam.height(), cam.seed);
+        accum.fingerprint = fingerprint;
+        accum.sampling = cam.sampling;
+    }
+
+    int listener = unix_listener(socket_path);
+    if (listener < 0) return false;
+
+    struct connection {
+        int fd;
+        bool joined = false;            // hello received and job sent
+        int tile = -1;                  // index of the tile in flight, -1 when idle
+    };
+
+    std::vector<tile> tiles = cam.image_tiles();
+    std::deque<int> pending;
+    for (int k = 0; k < int(tiles.size()); k++) pending.push_back(k);
+    std::vector<connection> connections;
+    std::vector<pixel_sums> sums;
+    size_t tiles_done = 0, reissued = 0, joined_total = 0;
+
+    auto drop = [&](connection& conn) {
+        if (conn.tile >= 0) {
+            pending.push_front(conn.tile);
+            reissued++;
+        }
+        close(conn.fd);
+        conn.fd = -1;
+    };
+
+    // sends the next pending tile, with its current sums, to an idle connection
+    auto assign = [&](connection& conn) {
+        if (pending.empty()) return;
+        const tile& t = tiles[pending.front()];
+        tile_message message = {t.x0, t.y0, t.x1, t.y1};
+        int width = t.x1 - t.x0;
+        sums.resize(message.pixel_count());
+        for (int j = t.y0; j < t.y1; j++) std::copy_n(&accum.at(t.x0, j), width, &sums[size_t(j - t.y0) * width]);
+
+        conn.tile = pending.front();
+        pending.pop_front();
+        if (!send_all(conn.fd, &message, sizeof(message)) || !send_all(conn.fd, sums.data(), sums.size() * sizeof(pixel_sums))) drop(conn);
+    };
+
+    auto receive = [&](connection& conn) {
+        if (!conn.joined) {
+            worker_hello hello;
+            if (!recv_all(conn.fd, &hello, sizeof(hello))) return drop(conn);
+
+            worker_job job = {};
+            job.accepted = hello.magic == worker_hello::magic_value && hello.pixel_size == sizeof(pixel_sums)
+                           && hello.fingerprint == accum.fingerprint && hello.width == accum.width && hello.height == accum.height;
+            job.samples_per_pixel = cam.samples_per_pixel;
+            job.seed = accum.seed;
+            job.adaptive_threshold = cam.adaptive_threshold;
+            job.adaptive_min_samples = cam.adaptive_min_samples;
+            job.russian_roulette = cam.russian_roulette;
+            job.sampling = int32_t(cam.sampling);
+            job.light_sampling = cam.lights != nullptr;
+            if (!send_all(conn.fd, &job, sizeof(job)) || !job.accepted) return drop(conn);
+
+            conn.joined = true;
+            joined_total++;
+            return;
+        }
+
+        tile_message message;
+        if (conn.tile < 0 || !recv_all(conn.fd, &message, sizeof(message))) return drop(conn);
+        const tile& t = tiles[conn.tile];
+        if (message.x0 != t.x0 || message.y0 != t.y0 || message.x1 != t.x1 || message.y1 != t.y1) return drop(conn);
+
+        sums.resize(message.pixel_count());
+        if (!recv_all(conn.fd, sums.data(), sums.size() * sizeof(pixel_sums))) return drop(conn);
+
+        int width = t.x1 - t.x0;
+        for (int j = t.y0; j < t.y1; j++) std::copy_n(&sums[size_t(j - t.y0) * width], width, &accum.at(t.x0, j));
+        conn.tile = -1;
+        tiles_done++;
+    };
+
+    auto interrupted = [&] { return cam.interrupt && cam.interrupt->load(); };
+    bool checkpointing = cam.on_checkpoint && cam.checkpoint_interval > 0;
+    auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(cam.checkpoint_interval));
+    auto next_checkpoint = std::chrono::steady_clock::now() + interval;
+    auto start = std::chrono::steady_clock::now();
+    int shown = -1;
+
+    std::vector<pollfd> polled;
+    while (tiles_done < tiles.size() && !interrupted()) {
+        int percent = int(100 * tiles_done / tiles.size());
+        if (percent != shown) {
+            std::clog << "\rRendering: " << percent << "%   " << std::flush;
+            shown = percent;
+        }
+
+        polled.assign(1, pollfd{listener, POLLIN, 0});
+        for (const auto& conn : connections) polled.push_back(pollfd{conn.fd, POLLIN, 0});
+        if (poll(polled.data(), polled.size(), 100) < 0 && errno != EINTR) break;
+
+        for (size_t k = 0; k < connections.size(); k++) {
+            if (polled[k + 1].revents) receive(connections[k]);
+        }
+        if (polled[0].revents & POLLIN) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0) connections.push_back(connection{fd});
+        }
+
+        connections.erase(std::remove_if(connections.begin(), connections.end(), [](const connection& conn) { return conn.fd < 0; }),
+                          connections.end());
+        for (auto& conn : connections) {
+            if (conn.joined && conn.tile < 0) assign(conn);
+        }
+
+        if (checkpointing && std::chrono::steady_clock::now() >= next_checkpoint) {
+            cam.on_checkpoint(accum);
+            next_checkpoint = std::chrono::steady_clock::now() + interval;
+        }
+    }
+    if (cam.on_checkpoint) cam.on_checkpoint(accum);
+
+    // an empty tile tells the workers the frame is done
+    tile_message done = {0, 0, 0, 0};
+    for (auto& conn : connections) {
+        if (conn.joined) send_all(conn.fd, &done, sizeof(done));
+        close(conn.fd);
+    }
+    close(listener);
+    unlink(socket_path.c_str());
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (interrupted()) {
+        std::clog << "\rInterrupted after " << tiles_done << " of " << tiles.size() << " tiles\n";
+        return false;
+    }
+    std::clog << "\rRendered " << accum.width << 'x' << accum.height << " in " << elapsed.count() << " s: " << tiles.size()
+              << " tiles, " << joined_total << " worker connections, " << reissued << " tiles re-issued\n";
+    return true;
+}
+
+// traces tiles for the coordinator on socket_path with num_threads connections until it
+// reports the frame done. fingerprint is render_fingerprint of the worker's scene and view,
+// which must match the coordinator's. lights are the scene's, sampled if the coordinator
+// samples its own. waits up to a few seconds for the coordinator to appear
+inline bool run_worker(const std::string& socket_path, camera& cam, const hittable& world, const material_table& materials,
+                       const light_list& lights, uint64_t fingerprint, int num_threads) {
+    sockaddr_un address;
+    if (!unix_address(socket_path, address)) return false;
+
+    auto connect_once = [&]() {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0) return fd;
+        if (fd >= 0) close(fd);
+        return -1;
+    };
+
+    // the first connection gets the job, which the rest must agree with
+    int threads = num_threads > 0 ? num_threads : int(std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<int> fds;
+    worker_job job = {};
+    for (int k = 0; k < threads; k++) {
+        int fd = connect_once();
+        for (int attempt = 0; fd < 0 && k == 0 && attempt < 50; attempt++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            fd = connect_once();
+        }
+        if (fd < 0) break;
+
+        worker_hello hello = {worker_hello::magic_value, sizeof(pixel_sums), fingerprint, cam.image_width, cam.height()};
+        worker_job reply;
+        if (!send_all(fd, &hello, sizeof(hello)) || !recv_all(fd, &reply, sizeof(reply)) || !reply.accepted) {
+            close(fd);
+            if (k == 0) {
+                std::cerr << socket_path << ": the coordinator refused this worker; it must load the same scene with the same view\n";
+                return false;
+            }
+            break;
+        }
+        if (k == 0) job = reply;
+        fds.push_back(fd);
+    }
+    if (fds.empty()) {
+        std::cerr << socket_path << ": can't connect to a coordinator\n";
+        return false;
+    }
+
+    cam.samples_per_pixel = job.samples_per_pixel;
+    cam.seed = job.seed;
+    cam.adaptive_threshold = job.adaptive_threshold;
+    cam.adaptive_min_samples = job.adaptive_min_samples;
+    cam.russian_roulette = job.russian_roulette != 0;
+    cam.sampling = sampler_type(job.sampling);
+    cam.lights = job.light_sampling && !lights.empty() ? &lights : nullptr;
+    cam.begin_tiles();
+
+    std::atomic<size_t> tiles_traced(0);
+    std::atomic<bool> finished(false);          // some connection was told the frame is done
+    std::vector<std::thread> workers;
+    for (int fd : fds) {
+        workers.emplace_back([&, fd] {
+            std::vector<pixel_sums> sums;
+            tile_message message;
+            while (recv_all(fd, &message, sizeof(message))) {
+                if (message.pixel_count() == 0) {
+                    finished = true;
+                    break;
+                }
+                sums.resize(message.pixel_count());
+                if (!recv_all(fd, sums.data(), sums.size() * sizeof(pixel_sums))) break;
+
+                cam.trace_tile(world, materials, sums, tile{message.x0, message.y0, message.x1, message.y1});
+
+                if (!send_all(fd, &message, sizeof(message)) || !send_all(fd, sums.data(), sums.size() * sizeof(pixel_sums))) break;
+                tiles_traced++;
+            }
+            close(fd);
+        });
+    }
+    for (auto& thread : workers) thread.join();
+
+    std::clog << "Worker: traced " << tiles_traced.load() << " tiles on " << fds.size() << " connections\n";
+    if (!finished) std::cerr << socket_path << ": the coordinator went away before the frame was done\n";
+    return finished;
+}
+
+#endif
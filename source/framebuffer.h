@@ -0,0 +1,19 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <vector>
+
+class framebuffer {
+    public:
+        int width = 0;
+        int height = 0;
+        std::vector<color> pixels;              // row-major, top row first
+
+        framebuffer() {}
+        framebuffer(int width, int height) : width(width), height(height), pixels(size_t(width) * height) {}
+
+        color& at(int i, int j) { return pixels[size_t(j) * width + i]; }
+        const color& at(int i, int j) const { return pixels[size_t(j) * width + i]; }
+};
+
+#endif
@@ -1,14 +1,21 @@
 #ifndef HITTABLE_H
 #define HITTABLE_H
 
-class material;
+#include "aabb.h"
+
+#include <cstdint>
+#include <type_traits>
+
+// index into the scene's material_table
+using material_id = uint32_t;
 
 class hit_record {
     public:
         point3 p;
         vec3 normal;
-        shared_ptr<material> mat;
-        double t;
+        material_id mat;
+        real t;
+        real p_error;                           // bound on the rounding error in each coordinate of p
         bool front_face;
 
         void set_face_normal(const ray& r, const vec3& outward_normal) {
@@ -16,8 +23,38 @@ class hit_record {
             front_face = dot(r.direction(), outward_normal) < 0;
             normal = front_face ? outward_normal : -outward_normal;
         }
+
+        // a ray leaving the surface in direction dir. its origin is pushed off the surface, on
+        // dir's side, by more than p's error, so it can't re-hit the surface it starts on and
+        // rays can be traced from t = 0 instead of past a fixed scene-scale epsilon
+        ray spawn_ray(const vec3& dir) const {
+            auto distance = p_error * (std::fabs(normal.x()) + std::fabs(normal.y()) + std::fabs(normal.z()));
+            vec3 offset = distance * normal;
+            return ray(dot(dir, normal) > 0 ? p + offset : p - offset, dir);
+        }
+};
+
+// hit records are copied on every candidate hit, so they must stay plain data
+static_assert(std::is_trivially_copyable<hit_record>::value, "hit_record must be trivially copyable");
+
+// rays traced together (camera::packets sends the primary rays of an 8x8 pixel block). each
+// ray looks for its nearest hit in (t_min, t_max[k]); where it finds one, t_max[k] drops to it,
+// recs[k] is filled and bit k of hits is set, so several objects can be traced in turn
+struct ray_packet {
+    static constexpr int max_size = 64;
+
+    int size = 0;
+    real t_min = 0;
+    uint64_t hits = 0;
+    bool coherent = true;               // false for scattered rays: skip the shortcuts that assume similar rays
+    ray rays[max_size];
+    real t_max[max_size] = {};
+    hit_record recs[max_size];
 };
 
+// the first ray whose bit is set in a packet's lane mask
+inline int lowest_lane(uint64_t lanes) { return __builtin_ctzll(lanes); }
+
 class hittable {
     public:
         // use compiler-generated destructor
@@ -29,6 +66,22 @@ class hittable {
         // “When calling this function on a pointer or reference to a base class, 
         // use the derived class’s version of the function — if it exists.”
         virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
+
+        // traces each ray of the packet on its own; containers that can skip work for the
+        // whole packet at once override it
+        virtual void hit_packet(ray_packet& packet) const {
+            hit_record rec;
+            for (int k = 0; k < packet.size; k++) {
+                if (hit(packet.rays[k], interval(packet.t_min, packet.t_max[k]), rec)) {
+                    packet.t_max[k] = rec.t;
+                    packet.recs[k] = rec;
+                    packet.hits |= uint64_t(1) << k;
+                }
+            }
+        }
+
+        // box enclosing everything the object can be hit on, used to build acceleration structures
+        virtual aabb bounding_box() const = 0;
 };
 
 #endif
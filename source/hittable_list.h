@@ -12,10 +12,14 @@ class hittable_list : public hittable {
         hittable_list() {}
         hittable_list(shared_ptr<hittable> object) { add(object); }
 
-        void clear() { objects.clear(); }
+        void clear() {
+            objects.clear();
+            bbox = aabb();
+        }
 
         void add(shared_ptr<hittable> object) {
             objects.push_back(object);
+            bbox = aabb(bbox, object->bounding_box());
         }
 
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
@@ -33,6 +37,16 @@ class hittable_list : public hittable {
 
             return hit_anything;
         }
+
+        // each object takes the whole packet, so any that can trace it together does
+        void hit_packet(ray_packet& packet) const override {
+            for (const auto& object : objects) object->hit_packet(packet);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+    private:
+        aabb bbox;
 };
 
 #endif
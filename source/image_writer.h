@@ -0,0 +1,159 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "framebuffer.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+enum class image_format {
+    ppm_ascii,      // P3, the original text output
+    ppm_binary,     // P6, gamma-corrected bytes
+    pfm             // PF, raw linear floats (HDR)
+};
+
+// picks a format from a name given on the command line, returns false if unknown
+inline bool parse_image_format(const std::string& name, image_format& format) {
+    if (name == "p3") format = image_format::ppm_ascii;
+    else if (name == "p6") format = image_format::ppm_binary;
+    else if (name == "pfm") format = image_format::pfm;
+    else return false;
+    return true;
+}
+
+inline void write_image(std::ostream& out, const framebuffer& image, image_format format) {
+    switch (format) {
+        case image_format::ppm_ascii: {
+            out << "P3\n" << image.width << ' ' << image.height << "\n255\n";
+            for (const auto& pixel_color : image.pixels) {
+                write_color(out, pixel_color);
+            }
+            break;
+        }
+        case image_format::ppm_binary: {
+            out << "P6\n" << image.width << ' ' << image.height << "\n255\n";
+            std::vector<unsigned char> bytes(image.pixels.size() * 3);
+            for (size_t k = 0; k < image.pixels.size(); k++) {
+                color_to_bytes(image.pixels[k], &bytes[3 * k]);
+            }
+            out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+            break;
+        }
+        case image_format::pfm: {
+            // a negative scale marks little-endian data; rows run bottom to top
+            const uint16_t probe = 1;
+            bool little_endian = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+            out << "PF\n" << image.width << ' ' << image.height << '\n' << (little_endian ? "-1.0" : "1.0") << '\n';
+
+            std::vector<float> row(size_t(image.width) * 3);
+            for (int j = image.height - 1; j >= 0; j--) {
+                for (int i = 0; i < image.width; i++) {
+                    const color& c = image.at(i, j);
+                    row[3 * i + 0] = float(c.x());
+                    row[3 * i + 1] = float(c.y());
+                    row[3 * i + 2] = float(c.z());
+                }
+                out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+            }
+            break;
+        }
+    }
+}
+
+// reads back a PFM written by write_image (three channels, either byte order).
+// returns false if the stream isn't one
+inline bool read_pfm(std::istream& in, framebuffer& image) {
+    std::string magic;
+    int width, height;
+    double scale;
+    if (!(in >> magic >> width >> height >> scale) || magic != "PF" || width <= 0 || height <= 0) return false;
+    in.get();                                   // the single whitespace after the header
+
+    const uint16_t probe = 1;
+    bool little_endian = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+    bool swap = (scale < 0) != little_endian;
+
+    image = framebuffer(width, height);
+    std::vector<float> row(size_t(width) * 3);
+    for (int j = height - 1; j >= 0; j--) {
+        if (!in.read(reinterpret_cast<char*>(row.data()), row.size() * sizeof(float))) return false;
+        for (auto& value : row) {
+            if (!swap) break;
+            auto bytes = reinterpret_cast<unsigned char*>(&value);
+            std::swap(bytes[0], bytes[3]);
+            std::swap(bytes[1], bytes[2]);
+        }
+        for (int i = 0; i < width; i++) image.at(i, j) = color(row[3 * i + 0], row[3 * i + 1], row[3 * i + 2]);
+    }
+    return true;
+}
+
+// writes finished images to disk on a background thread, so the caller can go back to
+// tracing as soon as it hands an image over
+class async_image_writer {
+    public:
+        async_image_writer() : worker([this] { run(); }) {}
+
+        ~async_image_writer() { finish(); }
+
+        void submit(framebuffer image, const std::string& path, image_format format) {
+            std::lock_guard<std::mutex> guard(lock);
+            jobs.push_back(job{std::move(image), path, format});
+            changed.notify_all();
+        }
+
+        // waits for every submitted image to be written and stops the thread.
+        // returns false if any of them failed
+        bool finish() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+                changed.notify_all();
+            }
+            if (worker.joinable()) worker.join();
+            return !failed;
+        }
+
+    private:
+        struct job {
+            framebuffer image;
+            std::string path;
+            image_format format;
+        };
+
+        std::mutex lock;
+        std::condition_variable changed;
+        std::deque<job> jobs;
+        bool stopping = false;
+        bool failed = false;
+        std::thread worker;                     // declared last so it starts after the rest
+
+        void run() {
+            while (true) {
+                job next;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    changed.wait(guard, [this] { return stopping || !jobs.empty(); });
+                    if (jobs.empty()) return;
+                    next = std::move(jobs.front());
+                    jobs.pop_front();
+                }
+
+                std::ofstream out(next.path, std::ios::binary);
+                if (out) write_image(out, next.image, next.format);
+                if (!out) {
+                    std::cerr << "Failed to write " << next.path << ".\n";
+                    failed = true;
+                }
+            }
+        }
+};
+
+#endif
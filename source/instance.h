@@ -0,0 +1,119 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "hittable.h"
+
+// affine map p -> linear * p + offset, with linear stored as rows
+class affine {
+    public:
+        vec3 rows[3] = {vec3(1, 0, 0), vec3(0, 1, 0), vec3(0, 0, 1)};
+        vec3 offset;
+
+        static affine scale(real s) {
+            affine m;
+            for (int k = 0; k < 3; k++) m.rows[k] = s * m.rows[k];
+            return m;
+        }
+
+        // turns about the y axis, as rigid_pose::rotate does
+        static affine rotate_y(double degrees) {
+            auto theta = degrees_to_radians(degrees);
+            real c = real(std::cos(theta)), s = real(std::sin(theta));
+            affine m;
+            m.rows[0] = vec3(c, 0, s);
+            m.rows[2] = vec3(-s, 0, c);
+            return m;
+        }
+
+        static affine translate(const vec3& t) {
+            affine m;
+            m.offset = t;
+            return m;
+        }
+
+        point3 apply_point(const point3& p) const { return apply_vector(p) + offset; }
+        vec3 apply_vector(const vec3& v) const { return vec3(dot(rows[0], v), dot(rows[1], v), dot(rows[2], v)); }
+
+        // transpose(linear) * v: with the inverse's linear part, carries normals the other way
+        vec3 apply_transposed(const vec3& v) const { return v[0] * rows[0] + v[1] * rows[1] + v[2] * rows[2]; }
+
+        // largest row sum of |linear|, bounding how much the map stretches an error in any coordinate
+        real stretch() const {
+            real most = 0;
+            for (const auto& row : rows) most = std::fmax(most, std::fabs(row[0]) + std::fabs(row[1]) + std::fabs(row[2]));
+            return most;
+        }
+
+        // inverse by the adjugate; the map must not be singular
+        affine inverse() const {
+            vec3 c0 = cross(rows[1], rows[2]), c1 = cross(rows[2], rows[0]), c2 = cross(rows[0], rows[1]);
+            real inv_det = 1 / dot(rows[0], c0);
+            affine m;
+            m.rows[0] = inv_det * vec3(c0[0], c1[0], c2[0]);
+            m.rows[1] = inv_det * vec3(c0[1], c1[1], c2[1]);
+            m.rows[2] = inv_det * vec3(c0[2], c1[2], c2[2]);
+            m.offset = -m.apply_vector(offset);
+            return m;
+        }
+};
+
+// a then b
+inline affine operator*(const affine& b, const affine& a) {
+    affine m;
+    for (int k = 0; k < 3; k++) m.rows[k] = b.rows[k][0] * a.rows[0] + b.rows[k][1] * a.rows[1] + b.rows[k][2] * a.rows[2];
+    m.offset = b.apply_point(a.offset);
+    return m;
+}
+
+// shared geometry placed by an affine transform. the ray goes into the geometry's own space
+// (unnormalized, so t means the same on both sides) and the geometry is traced with its own
+// hierarchy, so any number of instances cost one copy of it plus a few hundred bytes each. an
+// instance may give the geometry another material; otherwise hits keep the geometry's own
+class instance : public hittable {
+    public:
+        instance(shared_ptr<const hittable> geometry, const affine& to_world)
+            : geometry(std::move(geometry)), to_world(to_world), to_object(to_world.inverse())
+        {
+            // the geometry's box, corner by corner into world space
+            aabb box = this->geometry->bounding_box();
+            for (int corner = 0; corner < 8; corner++) {
+                point3 p((corner & 1 ? box.x.max : box.x.min), (corner & 2 ? box.y.max : box.y.min), (corner & 4 ? box.z.max : box.z.min));
+                p = to_world.apply_point(p);
+                bbox = aabb(bbox, aabb(p, p));
+            }
+        }
+
+        instance(shared_ptr<const hittable> geometry, const affine& to_world, material_id mat)
+            : instance(std::move(geometry), to_world)
+        {
+            override_mat = true;
+            this->mat = mat;
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            ray local(to_object.apply_point(r.origin()), to_object.apply_vector(r.direction()));
+            if (!geometry->hit(local, ray_t, rec)) return false;
+
+            // the geometry's error stretched by the map, plus the map's own rounding
+            rec.p_error = to_world.stretch() * (rec.p_error + rounding_error(4) * max_abs_component(rec.p))
+                          + rounding_error(4) * max_abs_component(to_world.offset);
+            rec.p = to_world.apply_point(rec.p);
+
+            // normals go by the inverse transpose, which keeps their side of the ray, so
+            // front_face carries over
+            rec.normal = unit_vector(to_object.apply_transposed(rec.normal));
+            if (override_mat) rec.mat = mat;
+            return true;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+    private:
+        shared_ptr<const hittable> geometry;
+        affine to_world, to_object;
+        aabb bbox;
+        material_id mat = 0;
+        bool override_mat = false;
+};
+
+#endif
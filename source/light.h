@@ -0,0 +1,164 @@
+#ifndef LIGHT_H
+#define LIGHT_H
+
+#include "hittable.h"
+#include "material.h"
+
+#include <algorithm>
+#include <vector>
+
+// Direct light sampling (next-event estimation). At each diffuse hit the tracers pick one
+// emissive sphere, aim a shadow ray at a point on it and add its light if nothing is in the
+// way. The bounce that follows can find the same light by chance, so both estimates are
+// weighted by the power heuristic (multiple importance sampling): light sampling wins for
+// small, bright lights, BSDF sampling for large ones, and neither is counted twice.
+
+// multiple importance sampling weight of a sample drawn with pdf a, when the same light could
+// also have been reached by a strategy with pdf b
+inline real power_heuristic(real a, real b) {
+    return a * a / (a * a + b * b);
+}
+
+// the emissive spheres of a scene
+class light_list {
+    public:
+        struct light {
+            point3 center;
+            real radius;
+            material_id mat;
+            color radiance;
+        };
+
+        // adds the sphere if its material emits; anything else is ignored
+        void add(const point3& center, real radius, material_id mat, const material_table& materials) {
+            if (!materials.emits(mat)) return;
+
+            // chosen in proportion to power, which goes with brightness times area
+            auto radiance = std::get<emissive>(materials[mat]).emission();
+            total_power += std::fmax(luminance(radiance), 1e-6) * double(radius) * radius;
+            lights.push_back(light{center, radius, mat, radiance});
+            cdf.push_back(total_power);
+        }
+
+        void clear() {
+            lights.clear();
+            cdf.clear();
+            total_power = 0;
+        }
+
+        bool empty() const { return lights.empty(); }
+        size_t size() const { return lights.size(); }
+
+        // picks a light and a direction from p toward it, uniform over the cone the sphere
+        // subtends. distance is how far along direction the sphere is, pdf the probability
+        // density of the direction (solid angle) with the choice of light included.
+        // always draws a number for the choice and a pair for the point; false if p is inside the light
+        bool sample(const point3& p, sampler& gen, vec3& direction, real& distance, real& pdf, const light*& chosen) const {
+            auto pick = random_double(gen) * total_power;
+            double u1, u2;
+            gen.next_2d(u1, u2);
+
+            size_t k = std::min(size_t(std::upper_bound(cdf.begin(), cdf.end(), pick) - cdf.begin()), lights.size() - 1);
+            chosen = &lights[k];
+
+            vec3 to_center = chosen->center - p;
+            auto dist_sq = to_center.length_squared();
+            auto radius_sq = chosen->radius * chosen->radius;
+            if (dist_sq <= radius_sq) return false;
+
+            auto dist = std::sqrt(dist_sq);
+            real cone = cone_size(radius_sq / dist_sq);
+            auto cos_theta = 1 - real(u1) * cone;
+            auto sin_theta = std::sqrt(std::fmax(real(0), 1 - cos_theta * cos_theta));
+            auto phi = 2 * pi * real(u2);
+
+            // a frame around the axis toward the center
+            vec3 w = to_center / dist;
+            vec3 a = std::fabs(w.x()) > real(0.9) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+            vec3 v = unit_vector(cross(w, a));
+            vec3 u = cross(w, v);
+            direction = sin_theta * std::cos(phi) * u + sin_theta * std::sin(phi) * v + cos_theta * w;
+
+            // the near intersection, or the tangent point when rounding misses a grazing one
+            auto b = dot(direction, to_center);
+            distance = b - std::sqrt(std::fmax(real(0), b * b - (dist_sq - radius_sq)));
+
+            pdf = select_probability(k) / (2 * pi * cone);
+            return true;
+        }
+
+        // the pdf sample() would have given the direction from origin to p, a point on a light
+        // of material mat (0 if it isn't on one)
+        real pdf(const point3& origin, const point3& p, material_id mat) const {
+            // the light whose surface p lies on; there are few, and this only runs when a
+            // bounce off a diffuse surface hits one
+            size_t best = lights.size();
+            real best_error = infinity;
+            for (size_t k = 0; k < lights.size(); k++) {
+                if (lights[k].mat != mat) continue;
+                auto error = std::fabs((p - lights[k].center).length() - lights[k].radius);
+                if (error < best_error) {
+                    best = k;
+                    best_error = error;
+                }
+            }
+            if (best == lights.size() || best_error > real(1e-3) * lights[best].radius) return 0;
+
+            const auto& l = lights[best];
+            auto dist_sq = (l.center - origin).length_squared();
+            auto radius_sq = l.radius * l.radius;
+            if (dist_sq <= radius_sq) return 0;
+            return select_probability(best) / (2 * pi * cone_size(radius_sq / dist_sq));
+        }
+
+    private:
+        std::vector<light> lights;
+        std::vector<double> cdf;                // running power, for picking a light
+        double total_power = 0;
+
+        double select_probability(size_t k) const {
+            return (cdf[k] - (k > 0 ? cdf[k - 1] : 0)) / total_power;
+        }
+
+        // 1 - cos(theta_max) of a cone whose half angle has sin^2 = sin_sq, kept accurate for
+        // small, distant lights where the subtraction would cancel
+        static real cone_size(real sin_sq) {
+            if (sin_sq < real(1e-3)) return sin_sq / 2 + sin_sq * sin_sq / 8;
+            return 1 - std::sqrt(1 - sin_sq);
+        }
+};
+
+// shadow rays stop this far short of the light, relative to its distance, so they don't hit it
+constexpr real shadow_epsilon = real(1e-3);
+
+// next-event estimation at a diffuse hit. on true, shadow is the ray toward a point on a
+// light, anything hit before shadow_t blocks it, and light is what it adds to the path's
+// radiance (times the path's throughput) if nothing does, weighted against the same light
+// being found by the next bounce
+inline bool sample_direct_light(const light_list& lights, const lambertian& surface, const hit_record& rec, sampler& gen,
+                                ray& shadow, real& shadow_t, color& light) {
+    vec3 direction;
+    real distance, light_pdf, bsdf_pdf;
+    const light_list::light* chosen;
+    if (!lights.sample(rec.p, gen, direction, distance, light_pdf, chosen)) return false;
+
+    color reflected = surface.evaluate(rec, direction, bsdf_pdf);
+    if (bsdf_pdf <= 0) return false;        // the light is behind the surface
+
+    shadow = rec.spawn_ray(direction);
+    shadow_t = distance * (1 - shadow_epsilon);
+    light = (power_heuristic(light_pdf, bsdf_pdf) / light_pdf) * reflected * chosen->radiance;
+    return true;
+}
+
+// the light a hit emits back along r, weighted against next-event estimation when the bounce
+// that found it (sampled with bsdf_pdf, 0 for camera rays and mirror-like bounces) could also
+// have been light-sampled
+inline color emitted_light(const light_list* lights, const material_table& materials, const ray& r,
+                           const hit_record& rec, real bsdf_pdf) {
+    color emitted = materials.emitted(rec.mat, rec);
+    if (bsdf_pdf > 0 && lights) emitted = power_heuristic(bsdf_pdf, lights->pdf(r.origin(), rec.p, rec.mat)) * emitted;
+    return emitted;
+}
+
+#endif
@@ -1,82 +1,589 @@
 #include "utility.h"
 
+#include "animation.h"
+#include "arena.h"
+#include "bvh.h"
 #include "camera.h"
+#include "checkpoint_file.h"
+#include "denoiser.h"
+#include "distributed.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "image_writer.h"
+#include "instance.h"
+#include "light.h"
 #include "material.h"
+#include "obj_loader.h"
+#include "render_service.h"
+#include "scene_file.h"
+#include "scenes.h"
 #include "sphere.h"
+#include "sphere_set.h"
+#include "triangle_mesh.h"
 
-#include <ctime>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
 #include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
-int main() {
-    // seeding randomness
-    std::srand(static_cast<unsigned>(std::time(nullptr)));
+// set by SIGINT / SIGTERM while a checkpointed render or a service runs, so it can save or
+// cancel before exiting
+static std::atomic<bool> interrupted(false);
 
-    // WORLD
-    hittable_list world;
-
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground_material));
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
-
-            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                } else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = color::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                } else {
-                    // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+static void request_interrupt(int) { interrupted = true; }
+
+int main(int argc, char* argv[]) {
+    // OPTIONS
+    int num_threads = 0;
+    int grid_extent = 11;                   // small spheres fill a (2 * extent)^2 grid
+    uint64_t seed = 0;                      // drives both the scene layout and the render
+    bool has_render_seed = false;
+    uint64_t render_seed = 0;               // the render's alone, so partial renders of one scene differ
+    bool use_objects = false;               // one sphere object per sphere instead of a sphere_set
+    std::string scene_path;                 // scene file to render instead of the built-in cover scene
+    std::string save_scene_path;            // write the scene here and exit, binary if it ends in .bin
+    int image_width = 0;                    // 0 = the scene's (1200 for the built-in scene)
+    int samples_per_pixel = 0;              // 0 = the scene's (500 for the built-in scene)
+    bool has_lookfrom = false, has_lookat = false;
+    point3 lookfrom, lookat;                // the view, instead of the scene's
+    double vfov = 0;                        // 0 = the scene's
+    double adaptive_threshold = 0;
+    int adaptive_min_samples = 16;
+    std::string output_path = "image.ppm";
+    std::string heatmap_path;               // sample-count heatmap, written only if set
+    bool denoise = false;                   // filter the image guided by first-hit features
+    std::string features_stem;              // write the feature buffers as STEM_albedo etc., only if set
+    bool russian_roulette = true;
+    bool light_sampling = true;             // next-event estimation toward emissive spheres
+    bool wavefront = false;
+    bool packets = false;                   // camera rays in 8x8 packets
+    sampler_type sampling = sampler_type::independent;
+    std::string stats_json_path;            // end-of-render counters as JSON, written only if set
+    image_format format = image_format::ppm_binary;
+    std::string checkpoint_path;            // accumulation buffer to resume from and save to
+    double checkpoint_interval = 60;        // seconds between checkpoints
+    std::vector<std::string> merge_paths;   // checkpoints of partial renders to combine instead of rendering
+    std::string coordinator_socket;         // hand the frame's tiles out to worker processes on this socket
+    std::string worker_socket;              // trace tiles for the coordinator on this socket
+    std::string animation_path;             // keyframes: render a sequence of frames instead of one image
+    std::string serve_socket;               // keep the scene and render jobs sent to this socket
+    std::string service_socket;             // send this render to the service on this socket instead
+    int priority = 0;                       // of the job sent to the service
+    uint64_t cancel_job = 0;                // cancel this job of the service instead
+
+    for (int k = 1; k < argc; k++) {
+        if (std::strcmp(argv[k], "--threads") == 0 && k + 1 < argc) {
+            num_threads = std::atoi(argv[++k]);
+        } else if (std::strcmp(argv[k], "--spheres") == 0 && k + 1 < argc) {
+            // roughly N small spheres instead of the demo's 22x22 grid
+            grid_extent = grid_extent_for(std::atof(argv[++k]));
+        } else if (std::strcmp(argv[k], "--seed") == 0 && k + 1 < argc) {
+            seed = std::strtoull(argv[++k], nullptr, 10);
+        } else if (std::strcmp(argv[k], "--render-seed") == 0 && k + 1 < argc) {
+            render_seed = std::strtoull(argv[++k], nullptr, 10);
+            has_render_seed = true;
+        } else if (std::strcmp(argv[k], "--scene") == 0 && k + 1 < argc) {
+            scene_path = argv[++k];
+        } else if (std::strcmp(argv[k], "--save-scene") == 0 && k + 1 < argc) {
+            save_scene_path = argv[++k];
+        } else if (std::strcmp(argv[k], "--objects") == 0) {
+            use_objects = true;
+        } else if (std::strcmp(argv[k], "--width") == 0 && k + 1 < argc) {
+            image_width = std::atoi(argv[++k]);
+        } else if (std::strcmp(argv[k], "--spp") == 0 && k + 1 < argc) {
+            samples_per_pixel = std::atoi(argv[++k]);
+        } else if (std::strcmp(argv[k], "--lookfrom") == 0 && k + 3 < argc) {
+            for (int axis = 0; axis < 3; axis++) lookfrom[axis] = real(std::atof(argv[++k]));
+            has_lookfrom = true;
+        } else if (std::strcmp(argv[k], "--lookat") == 0 && k + 3 < argc) {
+            for (int axis = 0; axis < 3; axis++) lookat[axis] = real(std::atof(argv[++k]));
+            has_lookat = true;
+        } else if (std::strcmp(argv[k], "--vfov") == 0 && k + 1 < argc) {
+            vfov = std::atof(argv[++k]);
+        } else if (std::strcmp(argv[k], "--adaptive") == 0 && k + 1 < argc) {
+            adaptive_threshold = std::atof(argv[++k]);
+        } else if (std::strcmp(argv[k], "--min-spp") == 0 && k + 1 < argc) {
+            adaptive_min_samples = std::atoi(argv[++k]);
+        } else if (std::strcmp(argv[k], "--heatmap") == 0 && k + 1 < argc) {
+            heatmap_path = argv[++k];
+        } else if (std::strcmp(argv[k], "--denoise") == 0) {
+            denoise = true;
+        } else if (std::strcmp(argv[k], "--features") == 0 && k + 1 < argc) {
+            features_stem = argv[++k];
+        } else if (std::strcmp(argv[k], "--no-roulette") == 0) {
+            russian_roulette = false;
+        } else if (std::strcmp(argv[k], "--no-light-sampling") == 0) {
+            light_sampling = false;
+        } else if (std::strcmp(argv[k], "--wavefront") == 0) {
+            wavefront = true;
+        } else if (std::strcmp(argv[k], "--packets") == 0) {
+            packets = true;
+        } else if (std::strcmp(argv[k], "--sampler") == 0 && k + 1 < argc && parse_sampler_type(argv[k + 1], sampling)) {
+            k++;
+        } else if (std::strcmp(argv[k], "--stats-json") == 0 && k + 1 < argc) {
+            stats_json_path = argv[++k];
+        } else if (std::strcmp(argv[k], "--checkpoint") == 0 && k + 1 < argc) {
+            checkpoint_path = argv[++k];
+        } else if (std::strcmp(argv[k], "--checkpoint-interval") == 0 && k + 1 < argc) {
+            checkpoint_interval = std::atof(argv[++k]);
+        } else if (std::strcmp(argv[k], "--merge") == 0 && k + 1 < argc) {
+            merge_paths.push_back(argv[++k]);
+        } else if (std::strcmp(argv[k], "--coordinator") == 0 && k + 1 < argc) {
+            coordinator_socket = argv[++k];
+        } else if (std::strcmp(argv[k], "--worker") == 0 && k + 1 < argc) {
+            worker_socket = argv[++k];
+        } else if (std::strcmp(argv[k], "--animation") == 0 && k + 1 < argc) {
+            animation_path = argv[++k];
+        } else if (std::strcmp(argv[k], "--serve") == 0 && k + 1 < argc) {
+            serve_socket = argv[++k];
+        } else if (std::strcmp(argv[k], "--service") == 0 && k + 1 < argc) {
+            service_socket = argv[++k];
+        } else if (std::strcmp(argv[k], "--priority") == 0 && k + 1 < argc) {
+            priority = std::atoi(argv[++k]);
+        } else if (std::strcmp(argv[k], "--cancel") == 0 && k + 1 < argc) {
+            cancel_job = std::strtoull(argv[++k], nullptr, 10);
+        } else if (std::strcmp(argv[k], "--output") == 0 && k + 1 < argc) {
+            output_path = argv[++k];
+        } else if (std::strcmp(argv[k], "--format") == 0 && k + 1 < argc && parse_image_format(argv[k + 1], format)) {
+            k++;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--threads N] [--scene PATH] [--save-scene PATH] [--spheres N] [--seed N] [--render-seed N] [--objects]"
+                      << " [--width N] [--spp N] [--lookfrom X Y Z] [--lookat X Y Z] [--vfov DEGREES] [--adaptive THRESHOLD] [--min-spp N] [--heatmap PATH] [--denoise] [--features STEM]"
+                      << " [--no-roulette] [--no-light-sampling] [--wavefront] [--packets] [--sampler independent|stratified|sobol|blue-noise]"
+                      << " [--stats-json PATH] [--checkpoint PATH] [--checkpoint-interval SECONDS] [--merge PATH]..."
+                      << " [--coordinator SOCKET | --worker SOCKET] [--animation PATH] [--serve SOCKET]"
+                      << " [--service SOCKET [--priority N] [--cancel JOB]] [--output PATH] [--format p3|p6|pfm]\n";
+            return 1;
+        }
+    }
+
+    // SERVICE CLIENT: the service renders the view with the scene it has loaded, so this
+    // process never loads one
+    if (!service_socket.empty()) {
+        service_request request = {};
+        request.magic = service_request::magic_value;
+        request.kind = cancel_job ? service_request::cancel : service_request::submit;
+        request.job = cancel_job;
+        request.priority = priority;
+        request.width = image_width;
+        request.samples_per_pixel = samples_per_pixel;
+        request.has_lookfrom = has_lookfrom;
+        request.has_lookat = has_lookat;
+        for (int axis = 0; axis < 3; axis++) {
+            request.lookfrom[axis] = lookfrom[axis];
+            request.lookat[axis] = lookat[axis];
+        }
+        request.vfov = vfov;
+        request.adaptive_threshold = adaptive_threshold;
+        request.has_seed = has_render_seed;
+        request.seed = render_seed;
+        request.format = int32_t(format);
+
+        if (output_path.front() != '/') {
+            char directory[4096];
+            if (getcwd(directory, sizeof(directory))) output_path = std::string(directory) + "/" + output_path;
+        }
+        if (output_path.size() >= sizeof(request.output_path)) {
+            std::cerr << output_path << ": output path too long\n";
+            return 1;
+        }
+        std::memcpy(request.output_path, output_path.c_str(), output_path.size() + 1);
+        return run_service_client(service_socket, request) ? 0 : 1;
+    }
+
+    // MERGE: sum the partial renders' samples into one image, without the scene
+    if (!merge_paths.empty()) {
+        accumulation_buffer merged;
+        std::vector<uint64_t> seeds;
+        for (const auto& path : merge_paths) {
+            accumulation_buffer part;
+            if (!load_checkpoint(path, part)) return 1;
+            if (part.pixels.empty()) {
+                std::cerr << path << ": holds no samples yet\n";
+                return 1;
+            }
+            for (auto other : seeds) {
+                if (part.seed == other) {
+                    std::cerr << path << ": has the same seed as an earlier input, so its samples would repeat; render parts with different --render-seed\n";
+                    return 1;
                 }
             }
+            seeds.push_back(part.seed);
+
+            if (merged.pixels.empty()) merged = std::move(part);
+            else if (part.sampling != merged.sampling) {
+                std::cerr << path << ": was rendered with --sampler " << sampler_name(part.sampling) << ", " << merge_paths[0]
+                          << " with " << sampler_name(merged.sampling) << "\n";
+                return 1;
+            } else if (!merged.merge(part)) {
+                std::cerr << path << ": is a render of a different image than " << merge_paths[0] << "\n";
+                return 1;
+            }
+        }
+        std::clog << "Merged " << merge_paths.size() << " renders, " << double(merged.total_samples()) / merged.pixels.size()
+                  << " samples per pixel\n";
+
+        if (!checkpoint_path.empty()) {
+            checkpoint_file file;
+            if (!file.open(checkpoint_path, merged) || !file.save(merged)) {
+                std::cerr << "Failed to write checkpoint " << checkpoint_path << ".\n";
+                return 1;
+            }
+        }
+
+        std::ofstream out(output_path, std::ios::binary);
+        if (out) write_image(out, merged.resolve(), format);
+        if (!out) {
+            std::cerr << "Failed to write " << output_path << ".\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    // WORLD
+    camera cam;
+    material_table materials;
+    std::vector<sphere> sphere_objects;     // --objects: held here until the BVH has put them in leaf order
+    object_arena arena;                     // the scene's objects, allocated side by side
+    sphere_set spheres;
+    std::vector<shared_ptr<triangle_mesh>> meshes;
+    std::unordered_map<std::string, shared_ptr<triangle_mesh>> instanced_meshes;   // one per OBJ file
+    hittable_list instances;
+    light_list lights;
+
+    // a scene being saved always goes into a sphere_set, since that is what the formats hold
+    if (!save_scene_path.empty()) use_objects = false;
+
+    auto add_light = [&](const point3& center, real radius, material_id mat) { lights.add(center, radius, mat, materials); };
+
+    auto add_sphere = [&](const point3& center, double radius, material_id mat) {
+        if (use_objects) {
+            sphere_objects.emplace_back(center, radius, mat);
+            add_light(center, radius, mat);
+        } else {
+            spheres.add(center, radius, mat);
+        }
+    };
+
+    auto add_mesh = [&](const std::string& path, material_id mat) {
+        auto mesh = make_shared<triangle_mesh>();
+        mesh->mat = mat;
+        if (!load_obj(path, *mesh)) return false;
+        meshes.push_back(mesh);
+        return true;
+    };
+
+    auto add_instance = [&](const std::string& path, material_id mat, const affine& to_world) {
+        auto& mesh = instanced_meshes[path];
+        if (!mesh) {
+            auto loaded = make_shared<triangle_mesh>();
+            if (!load_obj(path, *loaded)) {
+                instanced_meshes.erase(path);
+                return false;
+            }
+            loaded->build();
+            mesh = loaded;
         }
+        instances.add(arena.make<instance>(mesh, to_world, mat));
+        return true;
+    };
+
+    auto load_start = std::chrono::steady_clock::now();
+    bool mapped = false;                    // a binary scene brings its BVH along
+    if (scene_path.empty()) {
+        cover_camera(cam);
+        cam.image_width       = 1200;
+        cam.samples_per_pixel = 500;
+        cover_scene(materials, seed, grid_extent, sphere_mix(), add_sphere);
+    } else if (is_binary_scene(scene_path)) {
+        if (!load_scene_binary(scene_path, cam, materials, spheres)) return 1;
+        mapped = true;
+        if (use_objects) spheres.for_each_sphere(add_sphere);
+    } else {
+        std::ifstream in(scene_path);
+        if (!in) {
+            std::cerr << "Failed to open scene file " << scene_path << ".\n";
+            return 1;
+        }
+        if (!read_scene_text(in, scene_path, cam, materials, add_sphere, add_mesh, add_instance)) return 1;
+    }
+    std::chrono::duration<double, std::milli> load_time = std::chrono::steady_clock::now() - load_start;
+
+    if (!scene_path.empty()) {
+        std::clog << "Scene: " << materials.size() << " materials, loaded from " << scene_path << " in "
+                  << load_time.count() << " ms\n";
+    }
+
+    auto build_start = std::chrono::steady_clock::now();
+    shared_ptr<hittable> accel;
+    size_t node_count, memory_usage;
+    if (use_objects) {
+        std::vector<aabb> boxes;
+        for (const auto& s : sphere_objects) boxes.push_back(s.bounding_box());
+        auto bvh = make_shared<bvh_node>(std::move(boxes), [&](int k) { return arena.make<sphere>(sphere_objects[k]); });
+        sphere_objects = std::vector<sphere>();
+        node_count = bvh->node_count();
+        memory_usage = bvh->memory_usage();
+        accel = bvh;
+    } else {
+        if (!mapped) spheres.build();
+        node_count = spheres.node_count();
+        memory_usage = spheres.memory_usage();
+        accel = make_shared<sphere_set>(std::move(spheres));
     }
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+    // meshes keep their own BVHs; the few top-level objects are tested in turn
+    size_t triangles = 0;
+    for (auto& mesh : meshes) {
+        mesh->build();
+        triangles += mesh->triangle_count();
+        node_count += mesh->node_count();
+        memory_usage += mesh->memory_usage();
+    }
+    // instances, however many, go under a hierarchy of their own over the shared meshes
+    shared_ptr<bvh_node> instance_bvh;
+    size_t instanced_triangles = 0;
+    if (!instances.objects.empty()) {
+        instance_bvh = make_shared<bvh_node>(instances);
+        node_count += instance_bvh->node_count();
+        memory_usage += instance_bvh->memory_usage() + arena.memory_usage();
+        for (const auto& [path, mesh] : instanced_meshes) {
+            instanced_triangles += mesh->triangle_count();
+            node_count += mesh->node_count();
+            memory_usage += mesh->memory_usage();
+        }
+    }
+    shared_ptr<hittable> scene_root = accel;
+    if (!meshes.empty() || instance_bvh) {
+        auto top = make_shared<hittable_list>(accel);
+        for (auto& mesh : meshes) top->add(mesh);
+        if (instance_bvh) top->add(instance_bvh);
+        scene_root = top;
+    }
+    std::chrono::duration<double, std::milli> build_time = std::chrono::steady_clock::now() - build_start;
 
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+    // the lights of a sphere_set are found in it, so a mapped scene isn't read through unless it has some
+    bool any_emissive = false;
+    for (size_t id = 0; id < materials.size(); id++) any_emissive = any_emissive || materials.emits(material_id(id));
+    if (!use_objects && any_emissive) static_cast<const sphere_set&>(*accel).for_each_sphere(add_light);
 
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    if (!meshes.empty()) std::clog << "Meshes: " << meshes.size() << ", " << triangles << " triangles\n";
+    if (!instances.objects.empty()) {
+        std::clog << "Instances: " << instances.objects.size() << " of " << instanced_meshes.size() << " meshes, "
+                  << instanced_triangles << " triangles\n";
+    }
+    if (!lights.empty()) std::clog << "Lights: " << lights.size() << " emissive spheres" << (light_sampling ? "" : ", not sampled") << "\n";
+    std::clog << "BVH: " << node_count << " nodes, " << memory_usage / (1024.0 * 1024.0) << " MiB, "
+              << (mapped && !use_objects ? "mapped from the scene file" : "built in " + std::to_string(build_time.count()) + " ms")
+              << "\n";
 
     // CAMERA
-    camera cam;
+    if (image_width > 0) cam.image_width = image_width;
+    if (samples_per_pixel > 0) cam.samples_per_pixel = samples_per_pixel;
+    if (has_lookfrom) cam.lookfrom = lookfrom;
+    if (has_lookat) cam.lookat = lookat;
+    if (vfov > 0) cam.vfov = vfov;
+    cam.russian_roulette  = russian_roulette;
+
+    cam.num_threads = num_threads;
+    cam.seed        = has_render_seed ? render_seed : seed;
+    cam.sampling    = sampling;
+
+    cam.adaptive_threshold   = adaptive_threshold;
+    cam.adaptive_min_samples = adaptive_min_samples;
+    cam.wavefront            = wavefront;
+    cam.packets              = packets;
+    cam.lights               = light_sampling && !lights.empty() ? &lights : nullptr;
+
+    // ANIMATION: keyframes pose the scene loaded above, frame by frame
+    animation anim;
+    animated_scene animator;
+    if (!animation_path.empty()) {
+        if (use_objects || !save_scene_path.empty() || !checkpoint_path.empty() || !coordinator_socket.empty() || !worker_socket.empty()) {
+            std::cerr << "--animation renders frames locally from a sphere_set; it can't be combined with --objects, --save-scene,"
+                      << " --checkpoint, --coordinator or --worker.\n";
+            return 1;
+        }
+        std::ifstream in(animation_path);
+        if (!in) {
+            std::cerr << "Failed to open animation file " << animation_path << ".\n";
+            return 1;
+        }
+        if (!read_animation(in, animation_path, anim)) return 1;
+        if (!animator.bind(anim, cam, static_cast<sphere_set&>(*accel), meshes, animation_path)) return 1;
+        std::clog << "Animation: " << anim.frames << " frames, " << anim.tracks.size() << " animated targets\n";
+    }
 
-    cam.aspect_ratio      = 16.0 / 9.0;
-    cam.image_width       = 1200;
-    cam.samples_per_pixel = 500;
-    cam.max_depth         = 50;
+    if (!save_scene_path.empty()) {
+        if (!meshes.empty() || !instances.objects.empty()) {
+            std::cerr << "Scenes with meshes can't be saved; keep the text scene that references the OBJ files.\n";
+            return 1;
+        }
+        const auto& set = static_cast<const sphere_set&>(*accel);
+        bool binary = save_scene_path.size() >= 4 && save_scene_path.compare(save_scene_path.size() - 4, 4, ".bin") == 0;
+        bool saved;
+        if (binary) {
+            saved = write_scene_binary(save_scene_path, cam, materials, set);
+        } else {
+            std::ofstream out(save_scene_path);
+            write_scene_text(out, cam, materials, set);
+            saved = bool(out);
+        }
+        if (!saved) std::cerr << "Failed to write scene file " << save_scene_path << ".\n";
+        return saved ? 0 : 1;
+    }
 
-    cam.vfov     = 20;
-    cam.lookfrom = point3(13,2,3);
-    cam.lookat   = point3(0,0,0);
-    cam.vup      = vec3(0,1,0);
+    // a worker only traces tiles; the coordinator writes the image
+    if (!worker_socket.empty()) {
+        return run_worker(worker_socket, cam, *scene_root, materials, lights, render_fingerprint(cam, materials, *scene_root), num_threads) ? 0 : 1;
+    }
 
-    cam.defocus_angle = 0.6;
-    cam.focus_dist    = 10.0;
+    // a service keeps the scene and renders views of it as jobs come in, until stopped
+    if (!serve_socket.empty()) {
+        if (!checkpoint_path.empty() || !coordinator_socket.empty() || !animation_path.empty() || denoise || !features_stem.empty()) {
+            std::cerr << "--serve renders plain images; it can't be combined with --checkpoint, --coordinator, --animation,"
+                      << " --denoise or --features.\n";
+            return 1;
+        }
+        std::signal(SIGINT, request_interrupt);
+        std::signal(SIGTERM, request_interrupt);
+        return run_service(serve_socket, cam, *scene_root, materials, &interrupted) ? 0 : 1;
+    }
 
-    std::ofstream out("image.ppm");
-    if (!out) {
+    // fail before spending hours tracing, not after
+    if (!std::ofstream(animation_path.empty() ? output_path : frame_path(output_path, 0), std::ios::binary)) {
         std::cerr << "Failed to open output file.\n";
         return 1;
     }
 
-    cam.render(world, out);
+    // CHECKPOINT: resume from the file if there is one, then save into it as the render goes
+    accumulation_buffer accum;
+    checkpoint_file checkpoint;
+    if (!checkpoint_path.empty()) {
+        auto fingerprint = render_fingerprint(cam, materials, *scene_root);
+        if (std::ifstream(checkpoint_path)) {
+            if (!load_checkpoint(checkpoint_path, accum)) return 1;
+        }
+        if (!accum.pixels.empty()) {
+            if (accum.fingerprint != fingerprint) {
+                std::cerr << checkpoint_path << ": is a checkpoint of a different scene or view; remove it or pick another path\n";
+                return 1;
+            }
+            if (accum.sampling != cam.sampling) {
+                std::cerr << checkpoint_path << ": was rendered with --sampler " << sampler_name(accum.sampling)
+                          << "; resume it with that sampler\n";
+                return 1;
+            }
+            std::clog << "Checkpoint: resuming " << checkpoint_path << " at " << double(accum.total_samples()) / accum.pixels.size()
+                      << " samples per pixel";
+            if (accum.seed != cam.seed) std::clog << " (with its seed " << accum.seed << ")";
+            std::clog << "\n";
+        } else {
+            accum = accumulation_buffer(cam.image_width, cam.height(), cam.seed);
+            accum.fingerprint = fingerprint;
+            accum.sampling = cam.sampling;
+        }
+        if (!checkpoint.open(checkpoint_path, accum)) {
+            std::cerr << "Failed to open checkpoint " << checkpoint_path << ".\n";
+            return 1;
+        }
+
+        cam.checkpoint_interval = checkpoint_interval;
+        cam.on_checkpoint = [&](const accumulation_buffer& sums) {
+            if (!checkpoint.save(sums)) std::cerr << "\nFailed to save checkpoint " << checkpoint_path << ".\n";
+        };
+        cam.interrupt = &interrupted;
+        std::signal(SIGINT, request_interrupt);
+        std::signal(SIGTERM, request_interrupt);
+    }
+
+    async_image_writer writer;
+    render_stats sequence_stats;            // summed over an animation's frames
+    double refit_ms = 0;
+
+    // DENOISE: traces the feature buffers of the current view and filters image with them,
+    // then hands it to the writer
+    denoiser filter;
+    filter.num_threads = num_threads;
+    double denoise_ms = 0;
+    int frame = 0;
+    auto finish_image = [&](framebuffer image, const accumulation_buffer& sums, const std::string& path) {
+        if (denoise || !features_stem.empty()) {
+            auto denoise_start = std::chrono::steady_clock::now();
+            auto features = cam.render_features(*scene_root, materials);
+            if (denoise) image = filter.denoise(sums, features);
+            std::chrono::duration<double, std::milli> denoise_time = std::chrono::steady_clock::now() - denoise_start;
+            denoise_ms += denoise_time.count();
+            std::clog << (denoise ? "Denoised" : "Traced features") << " in " << denoise_time.count() << " ms\n";
+
+            if (!features_stem.empty()) {
+                std::string extension = format == image_format::pfm ? ".pfm" : ".ppm";
+                auto feature_path = [&](const std::string& kind) {
+                    auto stem_path = features_stem + "_" + kind + extension;
+                    return animation_path.empty() ? stem_path : frame_path(stem_path, frame);
+                };
+                writer.submit(features.albedo_image(), feature_path("albedo"), format);
+                writer.submit(features.normal_image(), feature_path("normal"), format);
+                writer.submit(features.depth_image(), feature_path("depth"), format);
+            }
+        }
+        writer.submit(std::move(image), path, format);
+    };
+
+    if (!coordinator_socket.empty()) {
+        accum.fingerprint = render_fingerprint(cam, materials, *scene_root);
+        if (!run_coordinator(coordinator_socket, cam, accum) && !interrupted) return 1;
+        finish_image(accum.resolve(), accum, output_path);
+    } else if (!animation_path.empty()) {
+        // each frame is posed from the rest state and refit, then traced while the writer
+        // thread is still writing out the frame before
+        for (frame = 0; frame < anim.frames; frame++) {
+            auto pose_start = std::chrono::steady_clock::now();
+            animator.pose(frame, cam);
+            if (cam.lights) {
+                lights.clear();
+                static_cast<const sphere_set&>(*accel).for_each_sphere(add_light);
+            }
+            std::chrono::duration<double, std::milli> pose_time = std::chrono::steady_clock::now() - pose_start;
+            std::clog << "Frame " << frame + 1 << "/" << anim.frames << ": posed and refit in " << pose_time.count() << " ms\n";
+
+            accumulation_buffer sums;
+            auto image = cam.render(*scene_root, materials, sums);
+            finish_image(std::move(image), sums, frame_path(output_path, frame));
+            sequence_stats.merge(cam.stats());
+            sequence_stats.trace_ms += cam.stats().trace_ms;
+            refit_ms += pose_time.count();
+        }
+    } else {
+        auto image = cam.render(*scene_root, materials, accum);
+        if (!heatmap_path.empty()) writer.submit(cam.sample_heatmap(), heatmap_path, format);
+        finish_image(std::move(image), accum, output_path);
+    }
+
+    auto write_start = std::chrono::steady_clock::now();
+    bool written = writer.finish();
+    std::chrono::duration<double, std::milli> write_time = std::chrono::steady_clock::now() - write_start;
+
+    // STATS
+    render_stats stats = animation_path.empty() ? cam.stats() : sequence_stats;
+    stats.build_ms = build_time.count() + refit_ms;
+    stats.write_ms = write_time.count();
+    stats.denoise_ms = denoise_ms;
+
+    // the coordinator traces nothing itself; each worker has its own counters
+    if (render_stats::enabled && coordinator_socket.empty()) stats.print(std::clog);
+    if (!stats_json_path.empty() && coordinator_socket.empty()) {
+        std::ofstream json(stats_json_path);
+        stats.write_json(json);
+    }
+
+    if (interrupted) {
+        std::clog << "Stopped early; run again with --checkpoint " << checkpoint_path << " to finish\n";
+        return 1;
+    }
+    return written ? 0 : 1;
 }
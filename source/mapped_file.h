@@ -0,0 +1,57 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <string>
+
+// a whole file mapped read-only into memory. pages are read in by the OS on first touch,
+// so opening even a very large file is close to free
+class mapped_file {
+    public:
+        mapped_file() {}
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        ~mapped_file() { close(); }
+
+        bool open(const std::string& path) {
+            close();
+
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+
+            struct stat info;
+            if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+                ::close(fd);
+                return false;
+            }
+
+            void* addr = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);                        // the mapping keeps its own reference to the file
+            if (addr == MAP_FAILED) return false;
+
+            bytes = static_cast<const unsigned char*>(addr);
+            length = size_t(info.st_size);
+            return true;
+        }
+
+        void close() {
+            if (bytes) munmap(const_cast<unsigned char*>(bytes), length);
+            bytes = nullptr;
+            length = 0;
+        }
+
+        const unsigned char* data() const { return bytes; }
+        size_t size() const { return length; }
+
+    private:
+        const unsigned char* bytes = nullptr;
+        size_t length = 0;
+};
+
+#endif
@@ -2,83 +2,121 @@
 #define MATERIAL_H
 
 #include "hittable.h"
+#include "sampler.h"
 
-class material {
-    public:
-        virtual ~material() = default;
+#include <cstdint>
+#include <cstring>
+#include <variant>
+#include <vector>
 
-        virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
-            return false;
-        }
-};
+// a material as plain data, the form scene files store it in
+struct material_record {
+    uint32_t type;                  // index of the material's type in the material variant
+    uint32_t reserved = 0;
+    double albedo[3] = {0, 0, 0};
+    double param = 0;               // metal: fuzz, dielectric: refraction index
+};                                  // (emissive keeps its radiance in albedo)
 
-class lambertian : public material {
+class lambertian {
     public:
         lambertian(const color& albedo) : albedo(albedo) {}
 
-        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
-            auto scatter_direction = rec.normal + random_unit_vector();
+        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& gen) const {
+            auto scatter_direction = rec.normal + random_unit_vector(gen);
 
             if (scatter_direction.near_zero()) {
                 scatter_direction = rec.normal;
             }
 
-            scattered = ray(rec.p, scatter_direction);
+            scattered = rec.spawn_ray(scatter_direction);
             attenuation = albedo;
             return true;
         }
 
+        // the reflected light toward direction (a unit vector) per unit of incoming light,
+        // brdf times cosine, and the pdf scatter samples direction with
+        color evaluate(const hit_record& rec, const vec3& direction, real& pdf) const {
+            pdf = scatter_pdf(rec, direction);
+            return pdf * albedo;            // albedo / pi * cosine
+        }
+
+        // scatter samples the cosine-weighted hemisphere
+        real scatter_pdf(const hit_record& rec, const vec3& direction) const {
+            auto cosine = dot(rec.normal, direction);
+            return cosine > 0 ? cosine / pi : 0;
+        }
+
+        // the surface's color without lighting, for the denoiser's albedo buffer
+        color base_color() const { return albedo; }
+
+        material_record record() const {
+            return material_record{0, 0, {albedo.x(), albedo.y(), albedo.z()}, 0};
+        }
+
     private:
         color albedo;
 };
 
-class metal : public material {
+class metal {
     public:
-        metal(const color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+        metal(const color& albedo, real fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
         
-        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
+        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& gen) const {
             vec3 reflected = reflect(r_in.direction(), rec.normal);
-            reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
-            scattered = ray(rec.p, reflected);
+            reflected = unit_vector(reflected) + (fuzz * random_unit_vector(gen));
+            scattered = rec.spawn_ray(reflected);
             attenuation = albedo;
             return (dot(scattered.direction(), rec.normal) > 0);
         }
 
+        color base_color() const { return albedo; }
+
+        material_record record() const {
+            return material_record{1, 0, {albedo.x(), albedo.y(), albedo.z()}, fuzz};
+        }
+
     private:
         color albedo;
-        double fuzz;
+        real fuzz;
 };
 
-class dielectric : public material {
+class dielectric {
     public:
-        dielectric(double refraction_index) : refraction_index(refraction_index) {}
+        dielectric(real refraction_index) : refraction_index(refraction_index) {}
 
-        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
+        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& gen) const {
             attenuation = color(1.0, 1.0, 1.0);
-            double ri = rec.front_face ? (1.0 / refraction_index) : refraction_index;
+            real ri = rec.front_face ? (1 / refraction_index) : refraction_index;
 
             vec3 unit_direction = unit_vector(r_in.direction());
-            double cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
-            double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
+            real cos_theta = std::fmin(dot(-unit_direction, rec.normal), real(1));
+            real sin_theta = std::sqrt(1 - cos_theta * cos_theta);
 
-            bool cant_refract = ri * sin_theta > 1.0;
+            bool cant_refract = ri * sin_theta > 1;
             vec3 direction;
 
-            if (cant_refract || reflectance(cos_theta, ri) > random_double()) { 
+            if (cant_refract || reflectance(cos_theta, ri) > random_double(gen)) { 
                 direction = reflect(unit_direction, rec.normal);
             } else {
                 direction = refract(unit_direction, rec.normal, ri);
             }
 
-            scattered = ray(rec.p, direction);
+            scattered = rec.spawn_ray(direction);
             return true;
         }
 
+        // glass shows what is behind it, so it has no color of its own
+        color base_color() const { return color(1, 1, 1); }
+
+        material_record record() const {
+            return material_record{2, 0, {0, 0, 0}, refraction_index};
+        }
+
     private:
         // RI in vacuum/air or ratio of meterial's index / surrounding material's index
-        double refraction_index;
+        real refraction_index;
 
-        static double reflectance(double cosine, double refraction_index) {
+        static real reflectance(real cosine, real refraction_index) {
             // Schlick's approx for reflectance
             auto r0 = (1 - refraction_index) / (1 + refraction_index);
             r0 = r0 * r0;
@@ -86,4 +124,158 @@ class dielectric : public material {
         }
 };
 
+// a light source: it emits radiance from its front side and absorbs whatever hits it
+class emissive {
+    public:
+        emissive(const color& radiance) : radiance(radiance) {}
+
+        bool scatter(const ray&, const hit_record&, color&, ray&, sampler&) const {
+            return false;
+        }
+
+        color emitted(const hit_record& rec) const {
+            return rec.front_face ? radiance : color(0, 0, 0);
+        }
+
+        const color& emission() const { return radiance; }
+
+        // the light's hue, scaled to at most 1
+        color base_color() const {
+            auto peak = std::fmax(radiance.x(), std::fmax(radiance.y(), radiance.z()));
+            return peak > 1 ? radiance / peak : radiance;
+        }
+
+        material_record record() const {
+            return material_record{3, 0, {radiance.x(), radiance.y(), radiance.z()}, 0};
+        }
+
+    private:
+        color radiance;
+};
+
+// closed set of materials: scatter is dispatched by a switch on the variant's type
+// tag instead of a virtual call
+using material = std::variant<lambertian, metal, dielectric, emissive>;
+
+static_assert(std::variant_size<material>::value == render_stats::material_types, "render_stats counts scatter calls per material type");
+
+inline material_record to_record(const material& mat) {
+    return std::visit([](const auto& m) { return m.record(); }, mat);
+}
+
+// flat array of every material in a scene. hit records carry an index into it,
+// so copying a hit record never touches a reference count
+class material_table {
+    public:
+        material_id add(const material& mat) {
+            materials.push_back(mat);
+            auto id = material_id(materials.size() - 1);
+            if (!index.empty()) {
+                if (2 * materials.size() > index.size()) rehash(4 * materials.size());
+                else insert(id);
+            }
+            return id;
+        }
+
+        // the id of a material with the same type and parameters as mat, added only if there
+        // is none yet, so scenes with many objects of a few looks store each look once
+        material_id intern(const material& mat) {
+            if (index.empty()) rehash(4 * materials.size());
+            auto rec = to_record(mat);
+            for (size_t slot = hash(rec) & (index.size() - 1);; slot = (slot + 1) & (index.size() - 1)) {
+                if (index[slot] == empty_slot) break;
+                if (same(to_record(materials[index[slot]]), rec)) return index[slot];
+            }
+            return add(mat);
+        }
+
+        // appends the material a scene file record describes; false if its type is unknown
+        bool add_record(const material_record& rec) {
+            return from_record(rec, [&](const material& mat) { add(mat); });
+        }
+
+        // as add_record, but through intern
+        bool intern_record(const material_record& rec, material_id& id) {
+            return from_record(rec, [&](const material& mat) { id = intern(mat); });
+        }
+
+        bool scatter(material_id id, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& gen) const {
+            STAT_ADD(scatter_calls[materials[id].index()], 1);
+            return std::visit([&](const auto& mat) {
+                return mat.scatter(r_in, rec, attenuation, scattered, gen);
+            }, materials[id]);
+        }
+
+        color base_color(material_id id) const {
+            return std::visit([](const auto& mat) { return mat.base_color(); }, materials[id]);
+        }
+
+        bool emits(material_id id) const { return std::holds_alternative<emissive>(materials[id]); }
+
+        // light leaving a hit toward the ray it was found with
+        color emitted(material_id id, const hit_record& rec) const {
+            auto light = std::get_if<emissive>(&materials[id]);
+            return light ? light->emitted(rec) : color(0, 0, 0);
+        }
+
+        const material& operator[](material_id id) const { return materials[id]; }
+
+        size_t size() const { return materials.size(); }
+
+        void reserve(size_t n) { materials.reserve(n); }
+
+    private:
+        static constexpr material_id empty_slot = ~material_id(0);
+
+        std::vector<material> materials;
+
+        // open-addressed hash set of ids for intern, built on its first use and kept at most
+        // half full; 4 bytes a slot rather than a node per material
+        std::vector<material_id> index;
+
+        template <typename use_fn>
+        static bool from_record(const material_record& rec, use_fn&& use) {
+            color albedo(rec.albedo[0], rec.albedo[1], rec.albedo[2]);
+            switch (rec.type) {
+                case 0: use(lambertian(albedo)); return true;
+                case 1: use(metal(albedo, rec.param)); return true;
+                case 2: use(dielectric(rec.param)); return true;
+                case 3: use(emissive(albedo)); return true;
+                default: return false;
+            }
+        }
+
+        // records compare and hash by their fields, so padding never matters
+        static bool same(const material_record& a, const material_record& b) {
+            return a.type == b.type && a.albedo[0] == b.albedo[0] && a.albedo[1] == b.albedo[1]
+                   && a.albedo[2] == b.albedo[2] && a.param == b.param;
+        }
+
+        static size_t hash(const material_record& rec) {
+            uint64_t h = rec.type;
+            for (double x : {rec.albedo[0], rec.albedo[1], rec.albedo[2], rec.param}) {
+                uint64_t bits;
+                std::memcpy(&bits, &x, sizeof(bits));
+                h = (h ^ bits) * 0x100000001b3ull;
+                h ^= h >> 29;
+            }
+            return size_t(h ^ (h >> 32));
+        }
+
+        void insert(material_id id) {
+            size_t slot = hash(to_record(materials[id])) & (index.size() - 1);
+            while (index[slot] != empty_slot) slot = (slot + 1) & (index.size() - 1);
+            index[slot] = id;
+        }
+
+        // at least min_slots, rounded up to a power of two; every material goes in, so later
+        // interns find those added before the index existed
+        void rehash(size_t min_slots) {
+            size_t slots = 64;
+            while (slots < min_slots) slots *= 2;
+            index.assign(slots, empty_slot);
+            for (size_t id = 0; id < materials.size(); id++) insert(material_id(id));
+        }
+};
+
 #endif
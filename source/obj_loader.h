@@ -0,0 +1,116 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include "mapped_file.h"
+#include "triangle_mesh.h"
+
+#include <charconv>
+#include <cstring>
+#include <string>
+
+// reads the geometry of a Wavefront OBJ file into mesh: 'v' lines append vertices and 'f' lines
+// append triangles, polygons split into fans. face corners may be v, v/vt, v//vn or v/vt/vn, and
+// negative indices count back from the latest vertex. everything else (normals, texture
+// coordinates, groups, materials) is skipped.
+// the file is mapped and parsed in place, one pass, with nothing allocated per line or face.
+// errors are reported to std::cerr as path:line and make it return false
+inline bool load_obj(const std::string& path, triangle_mesh& mesh) {
+    mapped_file file;
+    if (!file.open(path)) {
+        std::cerr << path << ": can't map file\n";
+        return false;
+    }
+
+    const char* const begin = reinterpret_cast<const char*>(file.data());
+    const char* const end = begin + file.size();
+
+    // a quick scan for line counts, so the buffers are allocated once instead of doubling
+    size_t vertex_lines = 0, face_lines = 0;
+    for (const char* p = begin; p < end;) {
+        if (p + 1 < end && p[1] == ' ') {
+            if (p[0] == 'v') vertex_lines++;
+            else if (p[0] == 'f') face_lines++;
+        }
+        auto next = static_cast<const char*>(std::memchr(p, '\n', size_t(end - p)));
+        p = next ? next + 1 : end;
+    }
+    size_t first_vertex = mesh.vertices.size();
+    mesh.vertices.reserve(first_vertex + vertex_lines);
+    mesh.indices.reserve(mesh.indices.size() + 3 * face_lines);
+
+    int line_number = 0;
+    auto fail = [&](const char* message) {
+        std::cerr << path << ':' << line_number << ": " << message << '\n';
+        return false;
+    };
+
+    const char* p = begin;
+    auto skip_space = [&](const char* line_end) {
+        while (p < line_end && (*p == ' ' || *p == '\t')) p++;
+    };
+
+    while (p < end) {
+        line_number++;
+        auto newline = static_cast<const char*>(std::memchr(p, '\n', size_t(end - p)));
+        const char* line_end = newline ? newline : end;
+        const char* next_line = newline ? newline + 1 : end;
+        if (line_end > p && line_end[-1] == '\r') line_end--;
+
+        skip_space(line_end);
+        if (line_end - p < 2 || (p[1] != ' ' && p[1] != '\t') || (p[0] != 'v' && p[0] != 'f')) {
+            p = next_line;
+            continue;
+        }
+
+        if (p[0] == 'v') {
+            p += 2;
+            point3 v;
+            for (int axis = 0; axis < 3; axis++) {
+                skip_space(line_end);
+                auto result = std::from_chars(p, line_end, v[axis]);
+                if (result.ec != std::errc()) return fail("bad vertex");
+                p = result.ptr;
+            }
+            mesh.vertices.push_back(v);         // a fourth (w) coordinate is ignored
+        } else {
+            p += 2;
+            uint32_t corner_first = 0, corner_prev = 0;
+            int corners = 0;
+            size_t vertex_count = mesh.vertices.size() - first_vertex;
+
+            while (true) {
+                skip_space(line_end);
+                if (p == line_end) break;
+
+                long long index;
+                auto result = std::from_chars(p, line_end, index);
+                if (result.ec != std::errc()) return fail("bad face index");
+                p = result.ptr;
+                while (p < line_end && *p != ' ' && *p != '\t') p++;    // texture / normal indices
+
+                // 1-based, or negative relative to the end of the vertex list so far
+                long long resolved = index > 0 ? index - 1 : (long long)(vertex_count) + index;
+                if (index == 0 || resolved < 0 || resolved >= (long long)(vertex_count)) return fail("face index out of range");
+                auto corner = uint32_t(first_vertex + size_t(resolved));
+
+                if (corners == 0) {
+                    corner_first = corner;
+                } else if (corners >= 2) {
+                    mesh.indices.push_back(corner_first);
+                    mesh.indices.push_back(corner_prev);
+                    mesh.indices.push_back(corner);
+                }
+                corner_prev = corner;
+                corners++;
+            }
+
+            if (corners < 3) return fail("face with fewer than 3 corners");
+        }
+
+        p = next_line;
+    }
+
+    return true;
+}
+
+#endif
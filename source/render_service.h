@@ -0,0 +1,350 @@
+#ifndef RENDER_SERVICE_H
+#define RENDER_SERVICE_H
+
+#include "camera.h"
+#include "distributed.h"
+#include "image_writer.h"
+#include "material.h"
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <queue>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Many renders of one scene from one process. The service loads and builds the scene once,
+// then takes jobs (a view, a resolution, a sample count and an output path) on a UNIX-domain
+// socket. Jobs wait in a priority queue, higher priority first and in order of arrival within
+// one, and run one at a time on the service's render threads against the same world, so each
+// job only costs its tracing. The connection that submitted a job is sent the job's progress
+// and how it ended; if it closes early the job is cancelled, and any connection can cancel a
+// job by its id.
+//
+// Messages are raw native-endian structs, as for distributed rendering:
+//
+//     client -> service   service_request (submit or cancel)
+//     service -> client   service_status: for a submit, queued, running with each new
+//                         percentage, then done, cancelled or failed; for a cancel, one
+//                         status saying what became of the job
+
+struct service_request {
+    static constexpr uint32_t magic_value = 0x53575452;     // "RTWS"
+    enum kinds : uint32_t { submit, cancel };
+
+    uint32_t magic;
+    uint32_t kind;
+    uint64_t job;                       // cancel: the job's id
+
+    // submit: higher runs first. zeros keep the service's settings
+    int32_t priority;
+    int32_t width, samples_per_pixel;
+    uint32_t has_lookfrom, has_lookat;
+    double lookfrom[3], lookat[3];
+    double vfov;
+    double adaptive_threshold;
+    uint32_t has_seed;
+    uint64_t seed;
+    int32_t format;                     // image_format
+    char output_path[1024];             // absolute, since the service has its own working directory
+};
+
+struct service_status {
+    enum states : int32_t { queued, running, done, cancelled, failed, unknown };
+
+    uint64_t job;
+    int32_t state;
+    int32_t percent;                    // running: tiles traced so far
+    int32_t ahead;                      // queued: jobs that run first, counting a running one
+};
+
+static_assert(std::is_trivially_copyable<service_request>::value && std::is_trivially_copyable<service_status>::value,
+              "messages are sent as raw bytes");
+
+// serves render jobs on socket_path until *stop is set, tracing world with copies of
+// scene_camera that each job's request adjusts. a running job is cancelled on stop and
+// queued ones are dropped. returns false if the socket can't be set up
+template <typename world_type>
+bool run_service(const std::string& socket_path, const camera& scene_camera, const world_type& world,
+                 const material_table& materials, const std::atomic<bool>* stop) {
+    int listener = unix_listener(socket_path);
+    if (listener < 0) return false;
+    std::clog << "Service: listening on " << socket_path << '\n';
+
+    struct job {
+        service_request request;
+        int fd;                         // the submitter's connection, -1 once it hung up
+    };
+
+    // a request is read as its bytes arrive, so a client that stalls halfway never holds up the loop
+    struct connection {
+        int fd;
+        service_request request;
+        size_t received;
+    };
+
+    std::map<uint64_t, job> jobs;       // queued and running
+    std::priority_queue<std::pair<int32_t, int64_t>> order;     // (priority, -id); cancelled ids are skipped
+    std::vector<connection> connections;        // connected, request not read yet
+    uint64_t next_id = 1;
+    size_t jobs_done = 0;
+
+    // the running job traces on a thread of its own, so the socket stays served meanwhile
+    uint64_t running = 0;
+    std::thread render_thread;
+    std::atomic<bool> cancel(false), finished(false);
+    std::atomic<int> percent(0);
+    int percent_sent = -1;
+    int32_t outcome = service_status::done;     // written before finished is set
+    std::vector<int> cancellers;        // asked to cancel the running job, told how it ended once it has
+
+    auto send_status = [](int fd, uint64_t id, int32_t state, int32_t progress, int32_t ahead) {
+        service_status status = {id, state, progress, ahead};
+        return fd >= 0 && send_all(fd, &status, sizeof(status));
+    };
+
+    // ends a job that isn't running: tells its submitter and closes the connection
+    auto end_job = [&](uint64_t id, int32_t state) {
+        auto found = jobs.find(id);
+        send_status(found->second.fd, id, state, 0, 0);
+        if (found->second.fd >= 0) close(found->second.fd);
+        jobs.erase(found);
+    };
+
+    // ends the job that was running, once its thread is done, with the outcome it had
+    auto end_running = [&]() {
+        uint64_t id = running;
+        running = 0;
+        for (int fd : cancellers) {
+            send_status(fd, id, outcome, 0, 0);
+            close(fd);
+        }
+        cancellers.clear();
+        end_job(id, outcome);
+    };
+
+    auto jobs_ahead = [&](uint64_t id) {
+        const auto& request = jobs.at(id).request;
+        int32_t ahead = running ? 1 : 0;
+        for (const auto& [other, queued] : jobs) {
+            if (other == id || other == running) continue;
+            if (queued.request.priority > request.priority || (queued.request.priority == request.priority && other < id)) ahead++;
+        }
+        return ahead;
+    };
+
+    auto start = [&](uint64_t id) {
+        const auto& request = jobs.at(id).request;
+        camera cam = scene_camera;
+        if (request.width > 0) cam.image_width = request.width;
+        if (request.samples_per_pixel > 0) cam.samples_per_pixel = request.samples_per_pixel;
+        if (request.has_lookfrom) cam.lookfrom = point3(request.lookfrom[0], request.lookfrom[1], request.lookfrom[2]);
+        if (request.has_lookat) cam.lookat = point3(request.lookat[0], request.lookat[1], request.lookat[2]);
+        if (request.vfov > 0) cam.vfov = request.vfov;
+        if (request.adaptive_threshold > 0) cam.adaptive_threshold = request.adaptive_threshold;
+        if (request.has_seed) cam.seed = request.seed;
+
+        running = id;
+        cancel = false;
+        finished = false;
+        percent = 0;
+        percent_sent = 0;
+        std::clog << "Job " << id << ": " << cam.image_width << " wide, " << cam.samples_per_pixel << " spp, to "
+                  << request.output_path << '\n';
+        send_status(jobs.at(id).fd, id, service_status::running, 0, 0);
+
+        render_thread = std::thread([&, cam, path = std::string(request.output_path), format = image_format(request.format)]() mutable {
+            cam.interrupt = &cancel;
+            cam.on_progress = [&](int p) { percent = p; };
+            auto image = cam.render(world, materials);
+
+            if (cancel) {
+                outcome = service_status::cancelled;
+            } else {
+                std::ofstream out(path, std::ios::binary);
+                if (out) write_image(out, image, format);
+                outcome = out ? service_status::done : service_status::failed;
+                if (!out) std::cerr << "Failed to write " << path << ".\n";
+            }
+            finished = true;
+        });
+    };
+
+    auto receive = [&](int fd, service_request& request) {
+        if (request.magic != service_request::magic_value) {
+            close(fd);
+            return;
+        }
+        request.output_path[sizeof(request.output_path) - 1] = '\0';
+
+        if (request.kind == service_request::cancel) {
+            // the running job may have finished already, or finish before it sees the flag; the
+            // reply waits for it to end and says how it did
+            if (running && request.job == running) {
+                cancel = true;
+                cancellers.push_back(fd);
+                return;
+            }
+            int32_t state = service_status::unknown;
+            if (jobs.count(request.job)) {
+                end_job(request.job, service_status::cancelled);
+                std::clog << "Job " << request.job << ": cancelled while queued\n";
+                state = service_status::cancelled;
+            }
+            send_status(fd, request.job, state, 0, 0);
+            close(fd);
+            return;
+        }
+
+        uint64_t id = next_id++;
+        bool valid = request.kind == service_request::submit && request.output_path[0] != '\0' && request.format >= 0
+                     && request.format <= int32_t(image_format::pfm);
+        if (!valid) {
+            send_status(fd, id, service_status::failed, 0, 0);
+            close(fd);
+            return;
+        }
+        jobs[id] = job{request, fd};
+        order.push({request.priority, -int64_t(id)});
+        send_status(fd, id, service_status::queued, 0, jobs_ahead(id));
+    };
+
+    std::vector<pollfd> polled;
+    while (!(stop && stop->load())) {
+        if (running && finished) {
+            render_thread.join();
+            auto& current = jobs.at(running);
+            if (outcome == service_status::done) jobs_done++;
+            std::clog << "Job " << running << ": " << (outcome == service_status::done ? "wrote " + std::string(current.request.output_path)
+                                                       : outcome == service_status::cancelled ? "cancelled" : "failed") << '\n';
+            end_running();
+        }
+        while (!running && !order.empty()) {
+            uint64_t id = uint64_t(-order.top().second);
+            order.pop();
+            if (jobs.count(id)) start(id);
+        }
+        if (running && percent != percent_sent) {
+            percent_sent = percent;
+            send_status(jobs.at(running).fd, running, service_status::running, percent_sent, 0);
+        }
+
+        // submitters send nothing after their request, so anything readable there is a hangup
+        std::vector<uint64_t> submitters;
+        polled.assign(1, pollfd{listener, POLLIN, 0});
+        for (const auto& conn : connections) polled.push_back(pollfd{conn.fd, POLLIN, 0});
+        for (const auto& [id, queued] : jobs) {
+            if (queued.fd < 0) continue;
+            polled.push_back(pollfd{queued.fd, POLLIN, 0});
+            submitters.push_back(id);
+        }
+        if (poll(polled.data(), polled.size(), 100) < 0 && errno != EINTR) break;
+
+        for (size_t k = 0; k < submitters.size(); k++) {
+            if (!polled[1 + connections.size() + k].revents) continue;
+            uint64_t id = submitters[k];
+            if (id == running) {
+                std::clog << "Job " << id << ": submitter went away, cancelling\n";
+                close(jobs.at(id).fd);
+                jobs.at(id).fd = -1;
+                cancel = true;
+            } else {
+                std::clog << "Job " << id << ": submitter went away, cancelled\n";
+                end_job(id, service_status::cancelled);
+            }
+        }
+        // one read per readable connection, which poll says won't block
+        std::vector<connection> complete;
+        for (size_t k = 0; k < connections.size(); k++) {
+            if (!polled[1 + k].revents) continue;
+            auto& conn = connections[k];
+            ssize_t n = recv(conn.fd, reinterpret_cast<char*>(&conn.request) + conn.received, sizeof(conn.request) - conn.received,
+                             MSG_DONTWAIT);
+            if (n > 0) {
+                conn.received += size_t(n);
+                if (conn.received == sizeof(conn.request)) complete.push_back(conn);
+            } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                close(conn.fd);
+                conn.fd = -1;
+            }
+        }
+        connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                         [](const connection& conn) { return conn.fd < 0 || conn.received == sizeof(conn.request); }),
+                          connections.end());
+        for (auto& conn : complete) receive(conn.fd, conn.request);
+
+        if (polled[0].revents & POLLIN) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0) connections.push_back(connection{fd, {}, 0});
+        }
+    }
+
+    if (running) {
+        cancel = true;
+        render_thread.join();
+        end_running();
+    }
+    while (!jobs.empty()) end_job(jobs.begin()->first, service_status::cancelled);
+    for (const auto& conn : connections) close(conn.fd);
+    close(listener);
+    unlink(socket_path.c_str());
+
+    std::clog << "Service: stopped after " << jobs_done << " jobs\n";
+    return true;
+}
+
+// sends request to the service on socket_path and reports what comes back: for a submit, the
+// job's progress until it ends, for a cancel the one reply. returns true if the job was
+// rendered or cancelled, respectively
+inline bool run_service_client(const std::string& socket_path, const service_request& request) {
+    sockaddr_un address;
+    if (!unix_address(socket_path, address)) return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        std::cerr << socket_path << ": can't connect to a render service\n";
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    if (!send_all(fd, &request, sizeof(request))) {
+        close(fd);
+        return false;
+    }
+
+    service_status status;
+    int32_t last = service_status::unknown;
+    while (recv_all(fd, &status, sizeof(status))) {
+        last = status.state;
+        if (status.state == service_status::queued) {
+            std::clog << "Job " << status.job << ": queued, " << status.ahead << " ahead\n";
+        } else if (status.state == service_status::running) {
+            std::clog << "\rJob " << status.job << ": " << status.percent << "%   " << std::flush;
+        } else {
+            bool too_late = request.kind == service_request::cancel && status.state == service_status::done;
+            if (too_late) std::clog << "Job " << status.job << ": finished before it could be cancelled\n";
+            else if (status.state == service_status::done) std::clog << "\rJob " << status.job << ": wrote " << request.output_path << '\n';
+            else if (status.state == service_status::cancelled) std::clog << "\rJob " << status.job << ": cancelled\n";
+            else if (status.state == service_status::failed) std::clog << "\rJob " << status.job << ": failed\n";
+            else std::cerr << "Job " << status.job << ": no such job queued or running\n";
+            break;
+        }
+    }
+    close(fd);
+
+    if (last == service_status::queued || last == service_status::running) {
+        std::cerr << socket_path << ": the service went away before the job was done\n";
+    }
+    return request.kind == service_request::cancel ? last == service_status::cancelled : last == service_status::done;
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef RENDER_STATS_H
+#define RENDER_STATS_H
+
+#include <cstdint>
+#include <ostream>
+
+// counters for the hot paths of a render. every thread bumps its own copy (render_stats::local()),
+// and camera merges the worker copies once tracing is done, so counting costs no synchronization.
+// building without RAY_TRACER_STATS compiles every STAT_* macro away
+struct render_stats {
+#if defined(RAY_TRACER_STATS)
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+    static constexpr int material_types = 4;
+    static constexpr const char* material_names[material_types] = {"lambertian", "metal", "dielectric", "emissive"};
+    static constexpr int max_path_length = 64;  // longer paths share the last histogram bucket
+
+    uint64_t primary_rays = 0;
+    uint64_t secondary_rays = 0;
+    uint64_t shadow_rays = 0;                   // next-event estimation toward lights
+    uint64_t bvh_nodes_visited = 0;
+    uint64_t sphere_tests = 0;                  // sphere::hit calls
+    uint64_t sphere_hits = 0;
+    uint64_t sphere_set_tests = 0;              // sphere_set slots tested, leaf padding included
+    uint64_t sphere_set_hits = 0;
+    uint64_t triangle_tests = 0;                // triangle_mesh triangles tested
+    uint64_t triangle_hits = 0;
+    uint64_t scatter_calls[material_types] = {};
+    uint64_t path_lengths[max_path_length + 1] = {};   // rays per camera sample
+
+    // wall time per phase, milliseconds
+    double build_ms = 0;
+    double trace_ms = 0;
+    double denoise_ms = 0;                      // feature rays and filter
+    double write_ms = 0;
+
+    static render_stats& local() {
+        static thread_local render_stats stats;
+        return stats;
+    }
+
+    void record_path(int length) {
+        path_lengths[length < max_path_length ? length : max_path_length]++;
+    }
+
+    void merge(const render_stats& other) {
+        primary_rays += other.primary_rays;
+        secondary_rays += other.secondary_rays;
+        shadow_rays += other.shadow_rays;
+        bvh_nodes_visited += other.bvh_nodes_visited;
+        sphere_tests += other.sphere_tests;
+        sphere_hits += other.sphere_hits;
+        sphere_set_tests += other.sphere_set_tests;
+        sphere_set_hits += other.sphere_set_hits;
+        triangle_tests += other.triangle_tests;
+        triangle_hits += other.triangle_hits;
+        for (int k = 0; k < material_types; k++) scatter_calls[k] += other.scatter_calls[k];
+        for (int k = 0; k <= max_path_length; k++) path_lengths[k] += other.path_lengths[k];
+    }
+
+    uint64_t rays() const { return primary_rays + secondary_rays + shadow_rays; }
+
+    double rays_per_sec() const { return trace_ms > 0 ? rays() / (trace_ms / 1000) : 0; }
+
+    void print(std::ostream& out) const {
+        out << "Rays: " << rays() << " (" << primary_rays << " primary, " << secondary_rays << " secondary, " << shadow_rays << " shadow), "
+            << rays_per_sec() / 1e6 << " Mrays/s\n"
+            << "Time: build " << build_ms << " ms, trace " << trace_ms << " ms, denoise " << denoise_ms << " ms, write " << write_ms << " ms\n"
+            << "Intersections: " << bvh_nodes_visited << " BVH nodes, "
+            << sphere_tests << " sphere tests (" << sphere_hits << " hits), "
+            << sphere_set_tests << " sphere_set slots (" << sphere_set_hits << " hits), "
+            << triangle_tests << " triangle tests (" << triangle_hits << " hits)\n"
+            << "Scatter:";
+        for (int k = 0; k < material_types; k++) out << ' ' << material_names[k] << ' ' << scatter_calls[k];
+
+        out << "\nPath length:";
+        uint64_t paths = 0;
+        double total_length = 0;
+        for (int k = 0; k <= max_path_length; k++) {
+            paths += path_lengths[k];
+            total_length += double(k) * path_lengths[k];
+        }
+        out << " mean " << (paths ? total_length / paths : 0);
+        for (int k = 1; k <= max_path_length; k++) {
+            if (path_lengths[k]) out << ", " << k << (k == max_path_length ? "+" : "") << ": " << path_lengths[k];
+        }
+        out << '\n';
+    }
+
+    void write_json(std::ostream& out) const {
+        out << "{\n"
+            << "  \"rays\": " << rays() << ",\n"
+            << "  \"primary_rays\": " << primary_rays << ",\n"
+            << "  \"secondary_rays\": " << secondary_rays << ",\n"
+            << "  \"shadow_rays\": " << shadow_rays << ",\n"
+            << "  \"rays_per_sec\": " << rays_per_sec() << ",\n"
+            << "  \"phase_ms\": {\"build\": " << build_ms << ", \"trace\": " << trace_ms << ", \"denoise\": " << denoise_ms << ", \"write\": " << write_ms << "},\n"
+            << "  \"bvh_nodes_visited\": " << bvh_nodes_visited << ",\n"
+            << "  \"primitives\": {\n"
+            << "    \"sphere\": {\"tests\": " << sphere_tests << ", \"hits\": " << sphere_hits << "},\n"
+            << "    \"sphere_set\": {\"tests\": " << sphere_set_tests << ", \"hits\": " << sphere_set_hits << "},\n"
+            << "    \"triangle\": {\"tests\": " << triangle_tests << ", \"hits\": " << triangle_hits << "}\n"
+            << "  },\n"
+            << "  \"scatter_calls\": {";
+        for (int k = 0; k < material_types; k++) {
+            out << (k ? ", " : "") << '"' << material_names[k] << "\": " << scatter_calls[k];
+        }
+        out << "},\n  \"path_length_histogram\": [";
+        for (int k = 0; k <= max_path_length; k++) out << (k ? ", " : "") << path_lengths[k];
+        out << "]\n}\n";
+    }
+};
+
+#if defined(RAY_TRACER_STATS)
+#define STAT_ADD(counter, n) (render_stats::local().counter += (n))
+#define STAT_PATH(length) (render_stats::local().record_path(length))
+#else
+#define STAT_ADD(counter, n) ((void)0)
+#define STAT_PATH(length) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+// PCG32 generator (pcg-random.org): 64-bit state, 32-bit output, cheap to construct.
+// every camera sample gets its own generator, keyed by seed, pixel and sample index,
+// so an image depends only on the seed and never on which thread traced which pixel
+class rng {
+    public:
+        explicit rng(uint64_t seed = 0, uint64_t stream = 0) {
+            // scramble the key so neighbouring pixels/samples start from unrelated states
+            state = 0;
+            inc = (mix(seed ^ mix(stream + 0x632be59bd9b4e019ull)) << 1) | 1;
+            next_u32();
+            state += mix(stream ^ mix(seed));
+            next_u32();
+        }
+
+        // generator for one sample of one pixel
+        static rng for_sample(uint64_t seed, uint64_t pixel, uint64_t sample) {
+            return rng(seed, mix(pixel) ^ sample);
+        }
+
+        uint32_t next_u32() {
+            uint64_t old = state;
+            state = old * 6364136223846793005ull + inc;
+            auto xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+            auto rot = uint32_t(old >> 59);
+            return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+        }
+
+        // uniform in [0, 1)
+        double next_double() {
+            return next_u32() * 0x1p-32;
+        }
+
+    private:
+        uint64_t state;
+        uint64_t inc;                           // stream selector, always odd
+
+        // splitmix64 finalizer
+        static uint64_t mix(uint64_t z) {
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            return z ^ (z >> 31);
+        }
+};
+
+#endif
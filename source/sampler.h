@@ -0,0 +1,407 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "utility.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Where the random numbers of a camera sample come from. independent draws every number from
+// the sample's own PCG stream. the others give each pixel a sequence of points that covers
+// each dimension (pixel jitter, lens, and each bounce's light choice, direction and roulette)
+// more evenly than chance would, so the same noise level takes fewer samples:
+//   stratified  each dimension's range is cut into samples_per_pixel strata (pairs of
+//               dimensions into a grid) and every sample lands in a different one
+//   sobol       the Sobol sequence, Owen scrambled per pixel (Burley 2020), with each pair
+//               of dimensions shuffled independently of the others
+//   blue_noise  one scrambled Sobol sequence for all pixels, shifted per pixel by a
+//               blue-noise mask (Georgiev & Fajardo 2016): about as little error per pixel as
+//               sobol, with what is left spread as fine noise instead of clumps
+enum class sampler_type { independent, stratified, sobol, blue_noise };
+
+inline bool parse_sampler_type(const std::string& name, sampler_type& type) {
+    if (name == "independent") type = sampler_type::independent;
+    else if (name == "stratified") type = sampler_type::stratified;
+    else if (name == "sobol") type = sampler_type::sobol;
+    else if (name == "blue-noise") type = sampler_type::blue_noise;
+    else return false;
+    return true;
+}
+
+inline const char* sampler_name(sampler_type type) {
+    switch (type) {
+        case sampler_type::independent: return "independent";
+        case sampler_type::stratified:  return "stratified";
+        case sampler_type::sobol:       return "sobol";
+        case sampler_type::blue_noise:  return "blue-noise";
+    }
+    return "";
+}
+
+// the numbers of one camera sample. dimensions are handed out in order, one per next_double
+// and two per next_2d: the pixel jitter pair, the lens pair, then a block per bounce. tracers
+// seek to a stage of the bounce's block before drawing, so each use reads the same dimension
+// in every sample of a pixel whatever the earlier bounces drew. the independent sampler
+// ignores dimensions and gives exactly the numbers of the sample's rng
+class sampler {
+    public:
+        // the draws of a bounce, as offsets into its block
+        enum stage : uint32_t {
+            light_choice = 0,               // which light next-event estimation aims at
+            light_point = 1,                // the pair for the point on it
+            scatter = 3,                    // the pair for the bounce direction
+            roulette = 5,
+            bounce_dimensions = 6
+        };
+
+        sampler() {}
+        explicit sampler(const rng& gen) : gen(gen) {}
+
+        // the sampler for one sample of pixel (i, j), pixel = j * width + i. sample_count is
+        // the pixel's sample budget, which stratified cuts each dimension into
+        static sampler for_sample(sampler_type type, uint64_t seed, uint64_t pixel, int i, int j,
+                                  uint64_t sample, int sample_count) {
+            sampler s(rng::for_sample(seed, pixel, sample));
+            s.type = type;
+            s.index = uint32_t(sample);
+            s.count = uint32_t(std::max(1, sample_count));
+            s.columns = uint32_t(std::ceil(std::sqrt(double(s.count))));
+            s.rows = (s.count + s.columns - 1) / s.columns;
+            s.seed_key = hash(uint32_t(seed), uint32_t(seed >> 32));
+            s.pixel_key = hash(s.seed_key, hash(uint32_t(pixel), uint32_t(pixel >> 32)));
+            s.x = uint16_t(i & (mask_size - 1));
+            s.y = uint16_t(j & (mask_size - 1));
+            return s;
+        }
+
+        bool independent() const { return type == sampler_type::independent; }
+
+        // the sample's PCG stream, for draws that don't map onto dimensions (rejection loops)
+        rng& stream() { return gen; }
+
+        // moves to a stage of a bounce's block of dimensions
+        void seek(int bounce, stage s) {
+            dimension = camera_dimensions + uint32_t(bounce) * bounce_dimensions + s;
+        }
+
+        // uniform in [0, 1)
+        double next_double() {
+            if (independent()) return gen.next_double();
+            double u, v;
+            point(dimension, 1, u, v);
+            dimension++;
+            return u;
+        }
+
+        // a point in [0, 1)^2, stratified jointly
+        void next_2d(double& u, double& v) {
+            if (independent()) {
+                u = gen.next_double();
+                v = gen.next_double();
+                return;
+            }
+            point(dimension, 2, u, v);
+            dimension += 2;
+        }
+
+    private:
+        static constexpr uint32_t camera_dimensions = 4;    // pixel jitter and lens pairs
+        static constexpr int mask_size = 64;                // blue-noise tile, a power of two
+
+        rng gen;
+        sampler_type type = sampler_type::independent;
+        uint32_t dimension = 0;
+        uint32_t index = 0;                 // the sample's number within its pixel
+        uint32_t count = 1;
+        uint32_t columns = 1, rows = 1;     // the stratified grid for pairs, at least count cells
+        uint32_t seed_key = 0;              // hashed render seed, the same for every pixel
+        uint32_t pixel_key = 0;             // hashed seed and pixel
+        uint16_t x = 0, y = 0;              // pixel position in the blue-noise tile
+
+        // dimensions [d, d + n) for this sample, n = 1 or 2
+        void point(uint32_t d, int n, double& u, double& v) const {
+            switch (type) {
+                case sampler_type::stratified: {
+                    // past the budget (a resumed render asking for more), another round of
+                    // strata with a fresh shuffle
+                    uint32_t round = index / count, k = index % count;
+                    uint32_t key = hash(pixel_key, hash(d, round));
+                    if (n == 1) {
+                        u = (permute(k, count, key) + to_unit(hash(key, k ^ 0x5bd1e995u))) / count;
+                        return;
+                    }
+                    uint32_t cell = permute(k, columns * rows, key);
+                    u = (cell % columns + to_unit(hash(key, k ^ 0x5bd1e995u))) / columns;
+                    v = (cell / columns + to_unit(hash(key, k ^ 0x27d4eb2fu))) / rows;
+                    return;
+                }
+                case sampler_type::sobol:
+                    scrambled_sobol(hash(pixel_key, d), n, u, v);
+                    return;
+                case sampler_type::blue_noise: {
+                    // the mask is read at an offset per dimension so dimensions don't share shifts
+                    uint32_t key = hash(seed_key, d);
+                    scrambled_sobol(key, n, u, v);
+                    u = wrap(u + mask_value(hash(key, 3)));
+                    if (n == 2) v = wrap(v + mask_value(hash(key, 4)));
+                    return;
+                }
+                case sampler_type::independent:
+                    break;
+            }
+            u = v = 0;
+        }
+
+        // the mask at this pixel, with the tile shifted by offset
+        double mask_value(uint32_t offset) const {
+            uint32_t mx = (x + offset) & (mask_size - 1);
+            uint32_t my = (y + (offset >> 16)) & (mask_size - 1);
+            return blue_noise_mask()[size_t(my) * mask_size + mx];
+        }
+
+        static double to_unit(uint32_t bits) { return bits * 0x1p-32; }
+        static double wrap(double u) { return u >= 1 ? u - 1 : u; }
+
+        // lowbias32 (Chris Wellons), and a combination of two values
+        static uint32_t hash(uint32_t x) {
+            x ^= x >> 16;
+            x *= 0x7feb352du;
+            x ^= x >> 15;
+            x *= 0x846ca68bu;
+            x ^= x >> 16;
+            return x;
+        }
+
+        static uint32_t hash(uint32_t a, uint32_t b) {
+            return hash(a ^ (b * 0x9e3779b9u + (a << 6) + (a >> 2)));
+        }
+
+        // the first two Sobol dimensions of this sample, the index shuffled and the values
+        // Owen scrambled with seeds from key. the scramble works on the bits in reverse, and
+        // the first dimension (van der Corput) is the index reversed, so it scrambles the index
+        // directly; the second comes from the tables already reversed
+        void scrambled_sobol(uint32_t key, int n, double& u, double& v) const {
+            uint32_t i = reverse_bits(laine_karras(reverse_bits(index), key));
+            u = to_unit(reverse_bits(laine_karras(i, hash(key, 1))));
+            if (n == 2) {
+                const auto& t = sobol_tables();
+                uint32_t second = t.bytes[0][i & 255] ^ t.bytes[1][(i >> 8) & 255] ^ t.bytes[2][(i >> 16) & 255] ^ t.bytes[3][i >> 24];
+                v = to_unit(reverse_bits(laine_karras(second, hash(key, 2))));
+            }
+        }
+
+        // the second Sobol dimension (direction numbers of the polynomial x + 1), bit reversed,
+        // as one table per index byte: the XOR of the directions of the byte's set bits
+        struct sobol_byte_tables {
+            uint32_t bytes[4][256];
+        };
+
+        static constexpr sobol_byte_tables make_sobol_tables() {
+            uint32_t reversed[32] = {};
+            uint32_t direction = 1u << 31;
+            for (int b = 0; b < 32; b++, direction ^= direction >> 1) reversed[b] = reverse_bits(direction);
+
+            sobol_byte_tables tables = {};
+            for (int byte = 0; byte < 4; byte++) {
+                for (uint32_t x = 0; x < 256; x++) {
+                    for (int b = 0; b < 8; b++) {
+                        if (x & (1u << b)) tables.bytes[byte][x] ^= reversed[8 * byte + b];
+                    }
+                }
+            }
+            return tables;
+        }
+
+        static constexpr uint32_t reverse_bits(uint32_t x) {
+            x = (x << 16) | (x >> 16);
+            x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+            x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+            x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+            x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+            return x;
+        }
+
+        static const sobol_byte_tables& sobol_tables() {
+            static constexpr sobol_byte_tables tables = make_sobol_tables();
+            return tables;
+        }
+
+        // Owen scrambling by hashing (Burley 2020, after Laine & Karras), on bit-reversed
+        // values: every bit is flipped by a hash of the bits below it, which are the more
+        // significant ones of the value, so strata map to strata
+        static uint32_t laine_karras(uint32_t x, uint32_t seed) {
+            x += seed;
+            x ^= x * 0x6c50b47cu;
+            x ^= x * 0xb82f1e52u;
+            x ^= x * 0xc7afe638u;
+            x ^= x * 0x8d22f6e6u;
+            return x;
+        }
+
+        // element i of a pseudorandom permutation of [0, l) chosen by p, without storing it
+        // (Kensler 2013, "Correlated Multi-Jittered Sampling")
+        static uint32_t permute(uint32_t i, uint32_t l, uint32_t p) {
+            uint32_t w = l - 1;
+            w |= w >> 1;
+            w |= w >> 2;
+            w |= w >> 4;
+            w |= w >> 8;
+            w |= w >> 16;
+            do {
+                i ^= p;
+                i *= 0xe170893du;
+                i ^= p >> 16;
+                i ^= (i & w) >> 4;
+                i ^= p >> 8;
+                i *= 0x0929eb3fu;
+                i ^= p >> 23;
+                i ^= (i & w) >> 1;
+                i *= 1 | p >> 27;
+                i *= 0x6935fa69u;
+                i ^= (i & w) >> 11;
+                i *= 0x74dcb303u;
+                i ^= (i & w) >> 2;
+                i *= 0x9e501cc3u;
+                i ^= (i & w) >> 2;
+                i *= 0xc860a3dfu;
+                i &= w;
+                i ^= i >> 5;
+            } while (i >= l);
+            return (i + p) % l;
+        }
+
+        // a mask_size^2 tile of values in [0, 1) whose neighbours differ as much as possible,
+        // made once by void and cluster (Ulichney 1993): pixels are ranked by repeatedly
+        // taking the one in the largest gap between those already ranked
+        static const std::vector<float>& blue_noise_mask() {
+            static const std::vector<float> mask = make_blue_noise_mask();
+            return mask;
+        }
+
+        static std::vector<float> make_blue_noise_mask() {
+            constexpr int n = mask_size, total = n * n;
+            const double sigma = 1.5;
+
+            // gaussian falloff by wrapped offset, so the tile repeats seamlessly
+            std::vector<double> falloff(total);
+            for (int dy = 0; dy < n; dy++) {
+                for (int dx = 0; dx < n; dx++) {
+                    int wx = std::min(dx, n - dx), wy = std::min(dy, n - dy);
+                    falloff[dy * n + dx] = std::exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+                }
+            }
+
+            std::vector<char> on(total, 0);
+            std::vector<double> energy(total, 0);
+            auto toggle = [&](int p, bool set) {
+                on[p] = set;
+                int px = p % n, py = p / n;
+                double sign = set ? 1 : -1;
+                for (int q = 0; q < total; q++) {
+                    int dx = (q % n - px) & (n - 1), dy = (q / n - py) & (n - 1);
+                    energy[q] += sign * falloff[dy * n + dx];
+                }
+            };
+            // the densest set pixel and the emptiest unset one
+            auto tightest_cluster = [&] {
+                int best = -1;
+                for (int q = 0; q < total; q++) if (on[q] && (best < 0 || energy[q] > energy[best])) best = q;
+                return best;
+            };
+            auto largest_void = [&] {
+                int best = -1;
+                for (int q = 0; q < total; q++) if (!on[q] && (best < 0 || energy[q] < energy[best])) best = q;
+                return best;
+            };
+
+            // a tenth of the pixels at random, then moved from clusters into voids until stable
+            rng gen(0x5eed);
+            int initial = total / 10;
+            for (int placed = 0; placed < initial;) {
+                int p = int(gen.next_u32() % total);
+                if (!on[p]) {
+                    toggle(p, true);
+                    placed++;
+                }
+            }
+            while (true) {
+                int cluster = tightest_cluster();
+                toggle(cluster, false);
+                int gap = largest_void();
+                if (gap == cluster) {
+                    toggle(cluster, true);
+                    break;
+                }
+                toggle(gap, true);
+            }
+
+            // ranks below the initial pattern by removing clusters, the rest by filling voids
+            std::vector<int> rank(total);
+            auto initial_on = on;
+            auto initial_energy = energy;
+            for (int r = initial - 1; r >= 0; r--) {
+                int cluster = tightest_cluster();
+                rank[cluster] = r;
+                toggle(cluster, false);
+            }
+            on = initial_on;
+            energy = initial_energy;
+            for (int r = initial; r < total; r++) {
+                int gap = largest_void();
+                rank[gap] = r;
+                toggle(gap, true);
+            }
+
+            std::vector<float> mask(total);
+            for (int q = 0; q < total; q++) mask[q] = (rank[q] + 0.5f) / total;
+            return mask;
+        }
+};
+
+// the sampler versions of the random helpers in utility.h and vec3.h. the independent sampler
+// runs the originals on its stream; the others map their points directly, since rejection
+// loops would consume a varying number of dimensions
+
+inline double random_double(sampler& gen) {
+    return gen.next_double();
+}
+
+inline double random_double(sampler& gen, double min, double max) {
+    return min + (max - min) * gen.next_double();
+}
+
+inline vec3 random_in_unit_disk(sampler& gen) {
+    if (gen.independent()) return random_in_unit_disk(gen.stream());
+
+    // concentric map (Shirley & Chiu 1997), which keeps strata compact
+    double u, v;
+    gen.next_2d(u, v);
+    auto a = 2 * u - 1, b = 2 * v - 1;
+    if (a == 0 && b == 0) return vec3(0, 0, 0);
+    double r, theta;
+    if (std::fabs(a) > std::fabs(b)) {
+        r = a;
+        theta = (pi / 4) * (b / a);
+    } else {
+        r = b;
+        theta = pi / 2 - (pi / 4) * (a / b);
+    }
+    return vec3(r * std::cos(theta), r * std::sin(theta), 0);
+}
+
+inline vec3 random_unit_vector(sampler& gen) {
+    if (gen.independent()) return random_unit_vector(gen.stream());
+
+    // uniform on the sphere: height uniform in [-1, 1], angle uniform around
+    double u, v;
+    gen.next_2d(u, v);
+    auto z = 1 - 2 * u;
+    auto r = std::sqrt(std::fmax(0.0, 1 - z * z));
+    auto phi = 2 * pi * v;
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+#endif
@@ -0,0 +1,444 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "camera.h"
+#include "instance.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "sphere_set.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// Scenes on disk come in two formats holding the same things: the camera's view and
+// sampling settings, a material table and a list of spheres.
+//
+// The text format is for writing scenes by hand. Each line is a keyword and its values,
+// and '#' starts a comment:
+//
+//     image_width 1200
+//     samples_per_pixel 500
+//     lookfrom 13 2 3
+//     material ground lambertian 0.5 0.5 0.5
+//     material chrome metal 0.7 0.6 0.5 0.0
+//     material glass dielectric 1.5
+//     material lamp emissive 8 8 7
+//     sphere 0 -1000 0 1000 ground
+//     mesh models/bunny.obj chrome
+//     instance models/tree.obj leaves scale 0.5 rotate_y 30 translate 4 0 -2
+//
+// Camera keywords are aspect_ratio, image_width, samples_per_pixel, max_depth, vfov,
+// lookfrom, lookat, vup, defocus_angle, focus_dist and sky_brightness; unset ones keep
+// their values.
+// Materials are named and must be defined before a sphere or mesh uses them. Mesh paths
+// are OBJ files, relative to the scene file's directory; only text scenes can hold meshes.
+// An instance places a mesh scaled, then turned about the y axis (degrees), then moved; unset
+// fields leave it as it is. All instances of one file share a single copy of it, so a crowd
+// of them costs little more than the file. Only plain meshes can be animated.
+//
+// The binary format is for rendering. It holds the material records, the sphere_set slot
+// arrays in BVH leaf order and the BVH nodes, each section aligned for direct use. Loading
+// maps the file and points a sphere_set at those sections, so nothing is parsed, copied or
+// built; pages are read as the first rays touch them. Files are native-endian and only
+// portable between builds with the same layout: the header records the node size and the
+// scalar type, so a float build can't map a double build's file (convert through text).
+
+// fixed-size header at the start of a binary scene. offsets are bytes from the file start
+struct scene_file_header {
+    static constexpr char magic_bytes[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', 0};
+    static constexpr uint32_t current_version = 2;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size;                 // sizeof(bvh_tree::node) when written
+
+    // camera
+    double aspect_ratio;
+    double vfov;
+    double lookfrom[3], lookat[3], vup[3];
+    double defocus_angle;
+    double focus_dist;
+    int32_t image_width;
+    int32_t samples_per_pixel;
+    int32_t max_depth;
+    int32_t scalar_size;                // sizeof(real) of the writer (0 in early files, which were all double)
+
+    uint64_t sphere_count;              // spheres, not counting padding slots
+    uint64_t material_count;
+    uint64_t slot_count;                // per slot array, a whole number of sphere_set batches
+    uint64_t node_count;                // 0 for a set that was never built
+
+    uint64_t materials_offset;
+    uint64_t cx_offset, cy_offset, cz_offset, rad_offset, mat_offset;
+    uint64_t nodes_offset;
+
+    double sky_brightness;              // from version 2; version 1 files end before it and mean 1
+};
+
+static_assert(std::is_trivially_copyable<bvh_tree::node>::value, "BVH nodes are written as raw bytes");
+static_assert(std::is_trivially_copyable<material_record>::value, "material records are written as raw bytes");
+
+// true if the file at path starts with the binary scene magic
+inline bool is_binary_scene(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[8] = {};
+    in.read(magic, sizeof(magic));
+    return in && std::memcmp(magic, scene_file_header::magic_bytes, sizeof(magic)) == 0;
+}
+
+// one line of a text scene, read field by field with from_chars (no locale, no stream state)
+class scene_fields {
+    public:
+        scene_fields(const std::string& line) : pos(line.data()), end(line.data() + line.size()) {}
+
+        bool read(std::string& field) {
+            skip_space();
+            const char* start = pos;
+            while (pos < end && !std::isspace((unsigned char)*pos)) pos++;
+            field.assign(start, pos);
+            return pos > start;
+        }
+
+        template <typename number>
+        bool read(number& x) {
+            skip_space();
+            auto result = std::from_chars(pos, end, x);
+            if (result.ec != std::errc() || (result.ptr < end && !std::isspace((unsigned char)*result.ptr))) return false;
+            pos = result.ptr;
+            return true;
+        }
+
+        bool read(vec3& v) { return read(v[0]) && read(v[1]) && read(v[2]); }
+
+        bool at_end() {
+            skip_space();
+            return pos == end;
+        }
+
+    private:
+        const char* pos;
+        const char* end;
+
+        void skip_space() {
+            while (pos < end && std::isspace((unsigned char)*pos)) pos++;
+        }
+};
+
+// reads a text scene into cam, materials, add_sphere(center, radius, mat) and
+// add_mesh(obj_path, mat) and add_instance(obj_path, mat, to_world), where obj_path has been
+// resolved against name's directory. add_mesh and add_instance return false if the mesh
+// can't be loaded.
+// errors are reported to std::cerr as name:line and make it return false
+template <typename sphere_fn, typename mesh_fn, typename instance_fn>
+bool read_scene_text(std::istream& in, const std::string& name, camera& cam, material_table& materials,
+                     sphere_fn&& add_sphere, mesh_fn&& add_mesh, instance_fn&& add_instance) {
+    std::unordered_map<std::string, material_id> material_names;
+    std::string line, keyword, mat_name, type;
+    int line_number = 0;
+
+    auto fail = [&](const std::string& message) {
+        std::cerr << name << ':' << line_number << ": " << message << '\n';
+        return false;
+    };
+
+    while (std::getline(in, line)) {
+        line_number++;
+        auto comment = line.find('#');
+        if (comment != std::string::npos) line.resize(comment);
+
+        scene_fields fields(line);
+        if (!fields.read(keyword)) continue;
+        bool ok;
+
+        if (keyword == "aspect_ratio") ok = fields.read(cam.aspect_ratio) && cam.aspect_ratio > 0;
+        else if (keyword == "image_width") ok = fields.read(cam.image_width) && cam.image_width > 0;
+        else if (keyword == "samples_per_pixel") ok = fields.read(cam.samples_per_pixel) && cam.samples_per_pixel > 0;
+        else if (keyword == "max_depth") ok = fields.read(cam.max_depth) && cam.max_depth > 0;
+        else if (keyword == "vfov") ok = fields.read(cam.vfov);
+        else if (keyword == "lookfrom") ok = fields.read(cam.lookfrom);
+        else if (keyword == "lookat") ok = fields.read(cam.lookat);
+        else if (keyword == "vup") ok = fields.read(cam.vup);
+        else if (keyword == "defocus_angle") ok = fields.read(cam.defocus_angle);
+        else if (keyword == "focus_dist") ok = fields.read(cam.focus_dist);
+        else if (keyword == "sky_brightness") ok = fields.read(cam.sky_brightness) && cam.sky_brightness >= 0;
+        else if (keyword == "material") {
+            if (!fields.read(mat_name) || !fields.read(type)) return fail("expected 'material NAME TYPE ...'");
+
+            material_record rec{};
+            if (type == "lambertian") {
+                rec.type = 0;
+                ok = fields.read(rec.albedo[0]) && fields.read(rec.albedo[1]) && fields.read(rec.albedo[2]);
+            } else if (type == "metal") {
+                rec.type = 1;
+                ok = fields.read(rec.albedo[0]) && fields.read(rec.albedo[1]) && fields.read(rec.albedo[2]) && fields.read(rec.param);
+            } else if (type == "dielectric") {
+                rec.type = 2;
+                ok = fields.read(rec.param);
+            } else if (type == "emissive") {
+                rec.type = 3;
+                ok = fields.read(rec.albedo[0]) && fields.read(rec.albedo[1]) && fields.read(rec.albedo[2]);
+            } else {
+                return fail("unknown material type '" + type + "'");
+            }
+
+            // names with the same parameters share one material
+            material_id id;
+            if (ok && materials.intern_record(rec, id) && !material_names.emplace(mat_name, id).second) {
+                return fail("material '" + mat_name + "' is already defined");
+            }
+        } else if (keyword == "sphere") {
+            point3 center;
+            real radius;
+            ok = fields.read(center) && fields.read(radius) && fields.read(mat_name);
+            if (ok) {
+                auto mat = material_names.find(mat_name);
+                if (mat == material_names.end()) return fail("undefined material '" + mat_name + "'");
+                add_sphere(center, radius, mat->second);
+            }
+        } else if (keyword == "mesh" || keyword == "instance") {
+            std::string mesh_path;
+            ok = fields.read(mesh_path) && fields.read(mat_name);
+
+            real scale = 1;
+            double rotate_y = 0;
+            vec3 translate(0, 0, 0);
+            std::string field;
+            while (ok && keyword == "instance" && fields.read(field)) {
+                if (field == "scale") ok = fields.read(scale) && scale > 0;
+                else if (field == "rotate_y") ok = fields.read(rotate_y);
+                else if (field == "translate") ok = fields.read(translate);
+                else return fail("unknown instance field '" + field + "'");
+            }
+
+            if (ok) {
+                auto mat = material_names.find(mat_name);
+                if (mat == material_names.end()) return fail("undefined material '" + mat_name + "'");
+
+                auto slash = name.find_last_of('/');
+                if (mesh_path[0] != '/' && slash != std::string::npos) mesh_path = name.substr(0, slash + 1) + mesh_path;
+                bool loaded = keyword == "mesh"
+                                  ? add_mesh(mesh_path, mat->second)
+                                  : add_instance(mesh_path, mat->second, affine::translate(translate) * affine::rotate_y(rotate_y) * affine::scale(scale));
+                if (!loaded) return fail("can't load mesh '" + mesh_path + "'");
+            }
+        } else {
+            return fail("unknown keyword '" + keyword + "'");
+        }
+
+        if (!ok) return fail("bad values for '" + keyword + "'");
+        if (!fields.at_end()) return fail("unexpected values after '" + keyword + "'");
+    }
+
+    return true;
+}
+
+// the shortest text that reads back as exactly x
+template <typename number>
+std::string exact_text(number x) {
+    char text[32];
+    return std::string(text, std::to_chars(text, text + sizeof(text), x).ptr);
+}
+
+inline std::string exact_text(const vec3& v) {
+    return exact_text(v[0]) + ' ' + exact_text(v[1]) + ' ' + exact_text(v[2]);
+}
+
+// writes cam's settings, every material and every sphere of spheres as a text scene that
+// reads back exactly. materials are named m<id>
+inline void write_scene_text(std::ostream& out, const camera& cam, const material_table& materials, const sphere_set& spheres) {
+    out << "# ray_tracer scene\n"
+        << "aspect_ratio " << exact_text(cam.aspect_ratio) << '\n'
+        << "image_width " << cam.image_width << '\n'
+        << "samples_per_pixel " << cam.samples_per_pixel << '\n'
+        << "max_depth " << cam.max_depth << '\n'
+        << "vfov " << exact_text(cam.vfov) << '\n'
+        << "lookfrom " << exact_text(cam.lookfrom) << '\n'
+        << "lookat " << exact_text(cam.lookat) << '\n'
+        << "vup " << exact_text(cam.vup) << '\n'
+        << "defocus_angle " << exact_text(cam.defocus_angle) << '\n'
+        << "focus_dist " << exact_text(cam.focus_dist) << '\n'
+        << "sky_brightness " << exact_text(cam.sky_brightness) << "\n\n";
+
+    static const char* type_names[] = {"lambertian", "metal", "dielectric", "emissive"};
+    for (size_t id = 0; id < materials.size(); id++) {
+        auto rec = to_record(materials[material_id(id)]);
+        out << "material m" << id << ' ' << type_names[rec.type];
+        if (rec.type != 2) out << ' ' << exact_text(color(rec.albedo[0], rec.albedo[1], rec.albedo[2]));
+        if (rec.type == 1 || rec.type == 2) out << ' ' << exact_text(rec.param);
+        out << '\n';
+    }
+    out << '\n';
+
+    spheres.for_each_sphere([&](const point3& center, real radius, material_id mat) {
+        out << "sphere " << exact_text(center) << ' ' << exact_text(radius) << " m" << mat << '\n';
+    });
+}
+
+// writes a binary scene. spheres should be built first, or loading it gives a flat set
+inline bool write_scene_binary(const std::string& path, const camera& cam, const material_table& materials, const sphere_set& spheres) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) return false;
+
+    const int batch = sphere_set::batch;
+    uint64_t slots = (uint64_t(spheres.slot_count()) + batch - 1) / batch * batch;
+    uint64_t sphere_count = 0;
+    spheres.for_each_sphere([&](const point3&, real, material_id) { sphere_count++; });
+
+    std::vector<material_record> records;
+    records.reserve(materials.size());
+    for (size_t id = 0; id < materials.size(); id++) records.push_back(to_record(materials[material_id(id)]));
+
+    scene_file_header header = {};
+    std::memcpy(header.magic, scene_file_header::magic_bytes, sizeof(header.magic));
+    header.version = scene_file_header::current_version;
+    header.node_size = sizeof(bvh_tree::node);
+    header.aspect_ratio = cam.aspect_ratio;
+    header.vfov = cam.vfov;
+    for (int k = 0; k < 3; k++) {
+        header.lookfrom[k] = cam.lookfrom[k];
+        header.lookat[k] = cam.lookat[k];
+        header.vup[k] = cam.vup[k];
+    }
+    header.defocus_angle = cam.defocus_angle;
+    header.focus_dist = cam.focus_dist;
+    header.image_width = cam.image_width;
+    header.samples_per_pixel = cam.samples_per_pixel;
+    header.max_depth = cam.max_depth;
+    header.scalar_size = sizeof(real);
+    header.sky_brightness = cam.sky_brightness;
+    header.sphere_count = sphere_count;
+    header.material_count = records.size();
+    header.slot_count = slots;
+    header.node_count = spheres.hierarchy().node_count();
+
+    // sections start on cache lines
+    uint64_t end = sizeof(header);
+    auto section = [&](uint64_t bytes) {
+        uint64_t offset = (end + 63) / 64 * 64;
+        end = offset + bytes;
+        return offset;
+    };
+    header.materials_offset = section(records.size() * sizeof(material_record));
+    header.cx_offset = section(slots * sizeof(real));
+    header.cy_offset = section(slots * sizeof(real));
+    header.cz_offset = section(slots * sizeof(real));
+    header.rad_offset = section(slots * sizeof(real));
+    header.mat_offset = section(slots * sizeof(material_id));
+    header.nodes_offset = section(header.node_count * sizeof(bvh_tree::node));
+
+    auto write_at = [&](uint64_t offset, const void* data, uint64_t bytes) {
+        static const char zeros[64] = {};
+        out.write(zeros, std::streamsize(offset - uint64_t(out.tellp())));
+        out.write(static_cast<const char*>(data), std::streamsize(bytes));
+    };
+
+    auto s = spheres.data();
+    write_at(0, &header, sizeof(header));
+    write_at(header.materials_offset, records.data(), records.size() * sizeof(material_record));
+    write_at(header.cx_offset, s.cx, slots * sizeof(real));
+    write_at(header.cy_offset, s.cy, slots * sizeof(real));
+    write_at(header.cz_offset, s.cz, slots * sizeof(real));
+    write_at(header.rad_offset, s.rad, slots * sizeof(real));
+    write_at(header.mat_offset, s.mat, slots * sizeof(material_id));
+    write_at(header.nodes_offset, spheres.hierarchy().node_data(), header.node_count * sizeof(bvh_tree::node));
+
+    return bool(out);
+}
+
+// maps a binary scene, sets cam's fields, appends its materials and attaches spheres to the
+// mapped arrays. errors are reported to std::cerr and make it return false
+inline bool load_scene_binary(const std::string& path, camera& cam, material_table& materials, sphere_set& spheres) {
+    auto fail = [&](const std::string& message) {
+        std::cerr << path << ": " << message << '\n';
+        return false;
+    };
+
+    // material ids in the file index the table from 0
+    if (materials.size() != 0) return fail("binary scenes need an empty material table");
+
+    auto file = make_shared<mapped_file>();
+    if (!file->open(path)) return fail("can't map file");
+    const size_t version1_size = offsetof(scene_file_header, sky_brightness);
+    if (file->size() < version1_size) return fail("too short for a scene header");
+
+    scene_file_header header;
+    std::memcpy(&header, file->data(), std::min(file->size(), sizeof(header)));
+    if (std::memcmp(header.magic, scene_file_header::magic_bytes, sizeof(header.magic)) != 0) return fail("not a binary scene");
+    if (header.version < 1 || header.version > scene_file_header::current_version) return fail("unsupported scene version " + std::to_string(header.version));
+    if (header.version == 1) header.sky_brightness = 1;
+    else if (file->size() < sizeof(header)) return fail("too short for a scene header");
+    if ((header.scalar_size ? header.scalar_size : 8) != int32_t(sizeof(real))) {
+        return fail(std::string("written by a ") + (sizeof(real) == 8 ? "float" : "double") + " build; convert it through a text scene");
+    }
+    if (header.node_size != sizeof(bvh_tree::node)) return fail("written on a machine with a different node layout");
+
+    // the ranges read_scene_text allows, except that max_depth 0 (camera rays only) is harmless.
+    // a zero aspect ratio would make the image height infinite
+    if (!(header.aspect_ratio > 0) || header.image_width <= 0 || header.samples_per_pixel <= 0 || header.max_depth < 0) {
+        return fail("bad camera settings");
+    }
+
+    const uint64_t slots = header.slot_count;
+    if (slots % sphere_set::batch != 0 || slots > uint64_t(std::numeric_limits<int>::max())) return fail("bad slot count");
+    if (header.node_count > slots * 2 + 1) return fail("bad node count");
+
+    // every section must lie inside the file, aligned for its element type
+    auto section_ok = [&](uint64_t offset, uint64_t count, uint64_t size) {
+        return offset % 8 == 0 && offset <= file->size() && count <= (file->size() - offset) / size;
+    };
+    if (!section_ok(header.materials_offset, header.material_count, sizeof(material_record))
+        || !section_ok(header.cx_offset, slots, sizeof(real)) || !section_ok(header.cy_offset, slots, sizeof(real))
+        || !section_ok(header.cz_offset, slots, sizeof(real)) || !section_ok(header.rad_offset, slots, sizeof(real))
+        || !section_ok(header.mat_offset, slots, sizeof(material_id))
+        || !section_ok(header.nodes_offset, header.node_count, sizeof(bvh_tree::node))) {
+        return fail("truncated or corrupt section table");
+    }
+
+    auto at = [&](uint64_t offset) { return file->data() + offset; };
+    sphere_set::arrays data = {
+        reinterpret_cast<const real*>(at(header.cx_offset)),
+        reinterpret_cast<const real*>(at(header.cy_offset)),
+        reinterpret_cast<const real*>(at(header.cz_offset)),
+        reinterpret_cast<const real*>(at(header.rad_offset)),
+        reinterpret_cast<const material_id*>(at(header.mat_offset)),
+    };
+    auto nodes = reinterpret_cast<const bvh_tree::node*>(at(header.nodes_offset));
+
+    // traversal trusts node links and hit records trust material ids, so check both once here
+    for (uint64_t k = 0; k < slots; k++) {
+        if (!std::isnan(data.cx[k]) && data.mat[k] >= header.material_count) return fail("sphere with an undefined material");
+    }
+    if (!bvh_tree::valid(nodes, header.node_count, slots, sphere_set::batch)) return fail("corrupt BVH");
+
+    auto records = reinterpret_cast<const material_record*>(at(header.materials_offset));
+    materials.reserve(header.material_count);
+    for (uint64_t k = 0; k < header.material_count; k++) {
+        if (!materials.add_record(records[k])) return fail("unknown material type in record " + std::to_string(k));
+    }
+
+    cam.aspect_ratio = header.aspect_ratio;
+    cam.vfov = header.vfov;
+    cam.lookfrom = point3(header.lookfrom[0], header.lookfrom[1], header.lookfrom[2]);
+    cam.lookat = point3(header.lookat[0], header.lookat[1], header.lookat[2]);
+    cam.vup = vec3(header.vup[0], header.vup[1], header.vup[2]);
+    cam.defocus_angle = header.defocus_angle;
+    cam.focus_dist = header.focus_dist;
+    cam.image_width = header.image_width;
+    cam.samples_per_pixel = header.samples_per_pixel;
+    cam.max_depth = header.max_depth;
+    cam.sky_brightness = header.sky_brightness;
+
+    spheres.attach(file, data, int(slots), nodes, header.node_count);
+    return true;
+}
+
+#endif
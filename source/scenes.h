@@ -0,0 +1,82 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "camera.h"
+#include "material.h"
+
+// material mix of the small spheres: a uniform draw below diffuse_cutoff makes a diffuse
+// sphere, below metal_cutoff a metal one, and anything above is glass
+struct sphere_mix {
+    double diffuse_cutoff = 0.8;
+    double metal_cutoff = 0.95;
+};
+
+// the cover scene of Ray Tracing in One Weekend: a ground sphere, a (2 * grid_extent)^2 grid
+// of small random spheres and three large ones. add_sphere(center, radius, mat) receives each
+// sphere, so callers choose how they are stored. materials are interned, so all the glass
+// spheres share one
+template <typename add_fn>
+void cover_scene(material_table& materials, uint64_t seed, int grid_extent, const sphere_mix& mix, add_fn&& add_sphere) {
+    rng scene_rng(seed);
+
+    auto ground_material = materials.intern(lambertian(color(0.5, 0.5, 0.5)));
+    add_sphere(point3(0,-1000,0), 1000, ground_material);
+
+    for (int a = -grid_extent; a < grid_extent; a++) {
+        for (int b = -grid_extent; b < grid_extent; b++) {
+            auto choose_mat = random_double(scene_rng);
+            point3 center(a + 0.9*random_double(scene_rng), 0.2, b + 0.9*random_double(scene_rng));
+
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                material_id sphere_material;
+
+                if (choose_mat < mix.diffuse_cutoff) {
+                    // diffuse
+                    auto albedo = color::random(scene_rng) * color::random(scene_rng);
+                    sphere_material = materials.intern(lambertian(albedo));
+                    add_sphere(center, 0.2, sphere_material);
+                } else if (choose_mat < mix.metal_cutoff) {
+                    // metal
+                    auto albedo = color::random(scene_rng, 0.5, 1);
+                    auto fuzz = random_double(scene_rng, 0, 0.5);
+                    sphere_material = materials.intern(metal(albedo, fuzz));
+                    add_sphere(center, 0.2, sphere_material);
+                } else {
+                    // glass
+                    sphere_material = materials.intern(dielectric(1.5));
+                    add_sphere(center, 0.2, sphere_material);
+                }
+            }
+        }
+    }
+
+    auto material1 = materials.intern(dielectric(1.5));
+    add_sphere(point3(0, 1, 0), 1.0, material1);
+
+    auto material2 = materials.intern(lambertian(color(0.4, 0.2, 0.1)));
+    add_sphere(point3(-4, 1, 0), 1.0, material2);
+
+    auto material3 = materials.intern(metal(color(0.7, 0.6, 0.5), 0.0));
+    add_sphere(point3(4, 1, 0), 1.0, material3);
+}
+
+// grid extent that gives roughly n small spheres
+inline int grid_extent_for(double n) {
+    return std::max(1, int(std::ceil(std::sqrt(n) / 2)));
+}
+
+// the cover scene's view, leaving image size and sampling to the caller
+inline void cover_camera(camera& cam) {
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.max_depth    = 50;
+
+    cam.vfov     = 20;
+    cam.lookfrom = point3(13,2,3);
+    cam.lookat   = point3(0,0,0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0.6;
+    cam.focus_dist    = 10.0;
+}
+
+#endif
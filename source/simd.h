@@ -0,0 +1,62 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+// the AVX2 operations the SIMD kernels use, on whole registers of real: 4 doubles, or
+// 8 floats in a RAY_TRACER_FLOAT build. kernels written against these run at either precision.
+// comparisons are ordered, so any NaN lane compares false
+struct simd {
+#if defined(RAY_TRACER_FLOAT)
+    using reg = __m256;
+    static constexpr int width = 8;
+
+    static reg load(const real* p) { return _mm256_loadu_ps(p); }
+    static void store(real* p, reg a) { _mm256_storeu_ps(p, a); }
+    static reg set1(real x) { return _mm256_set1_ps(x); }
+    static reg zero() { return _mm256_setzero_ps(); }
+
+    static reg add(reg a, reg b) { return _mm256_add_ps(a, b); }
+    static reg sub(reg a, reg b) { return _mm256_sub_ps(a, b); }
+    static reg mul(reg a, reg b) { return _mm256_mul_ps(a, b); }
+    static reg div(reg a, reg b) { return _mm256_div_ps(a, b); }
+    static reg sqrt(reg a) { return _mm256_sqrt_ps(a); }
+    static reg max(reg a, reg b) { return _mm256_max_ps(a, b); }
+
+    static reg less(reg a, reg b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static reg greater(reg a, reg b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static reg greater_equal(reg a, reg b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    static reg both(reg a, reg b) { return _mm256_and_ps(a, b); }
+
+    // lanes of b where mask is set, else lanes of a
+    static reg select(reg a, reg b, reg mask) { return _mm256_blendv_ps(a, b, mask); }
+    static int mask_bits(reg mask) { return _mm256_movemask_ps(mask); }
+#else
+    using reg = __m256d;
+    static constexpr int width = 4;
+
+    static reg load(const real* p) { return _mm256_loadu_pd(p); }
+    static void store(real* p, reg a) { _mm256_storeu_pd(p, a); }
+    static reg set1(real x) { return _mm256_set1_pd(x); }
+    static reg zero() { return _mm256_setzero_pd(); }
+
+    static reg add(reg a, reg b) { return _mm256_add_pd(a, b); }
+    static reg sub(reg a, reg b) { return _mm256_sub_pd(a, b); }
+    static reg mul(reg a, reg b) { return _mm256_mul_pd(a, b); }
+    static reg div(reg a, reg b) { return _mm256_div_pd(a, b); }
+    static reg sqrt(reg a) { return _mm256_sqrt_pd(a); }
+    static reg max(reg a, reg b) { return _mm256_max_pd(a, b); }
+
+    static reg less(reg a, reg b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+    static reg greater(reg a, reg b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+    static reg greater_equal(reg a, reg b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+    static reg both(reg a, reg b) { return _mm256_and_pd(a, b); }
+
+    static reg select(reg a, reg b, reg mask) { return _mm256_blendv_pd(a, b, mask); }
+    static int mask_bits(reg mask) { return _mm256_movemask_pd(mask); }
+#endif
+};
+#endif
+
+#endif
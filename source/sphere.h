@@ -3,47 +3,77 @@
 
 #include "hittable.h"
 
+// ray-sphere test shared by sphere and sphere_set, giving the nearest root inside ray_t.
+// the discriminant comes from the distance between the center and the ray's closest approach
+// (Ray Tracing Gems, ch. 7) rather than h^2 - ac, which loses a small sphere's radius to
+// cancellation once the sphere is far from the ray origin
+inline bool hit_sphere(const ray& r, const point3& center, real radius, const interval& ray_t, real& root) {
+    vec3 oc = center - r.origin();
+    auto a = r.direction().length_squared();
+    auto h = dot(r.direction(), oc);
+    vec3 l = oc - (h / a) * r.direction();
+
+    auto discriminant = a * ((radius * radius) - l.length_squared());
+    if (discriminant < 0) { // D > 0 two real soln, D = 0 one real soln, D < 0 no real solutions
+        return false;
+    }
+
+    auto sqrtd = std::sqrt(discriminant);
+
+    // Nearest root in acceptable range
+    root = (h - sqrtd) / a;
+    if (!ray_t.surrounds(root)) {
+        root = (h + sqrtd) / a;
+        if (!ray_t.surrounds(root)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// fills rec for a hit on a sphere at t = root
+inline void sphere_hit_record(const ray& r, const point3& center, real radius, real root, material_id mat, hit_record& rec) {
+    rec.t = root;
+
+    // r.at(root) lies off the surface by roughly the error in root; projecting it back onto the
+    // sphere leaves only the rounding of the center and radius themselves
+    vec3 outward = r.at(rec.t) - center;
+    outward *= radius / outward.length();
+    rec.p = center + outward;
+    rec.p_error = rounding_error(8) * (max_abs_component(center) + radius);
+
+    rec.set_face_normal(r, outward / radius);
+    rec.mat = mat;
+}
+
 class sphere : public hittable {
     public:
-        sphere(const point3& center, double radius, shared_ptr<material> mat) 
-            : center(center), radius(std::fmax(0,radius)), mat(mat) {}
+        sphere(const point3& center, real radius, material_id mat) 
+            : center(center), radius(std::fmax(0,radius)), mat(mat)
+        {
+            auto rvec = vec3(this->radius, this->radius, this->radius);
+            bbox = aabb(center - rvec, center + rvec);
+        }
 
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-            // say b = -2h
-            vec3 oc = center - r.origin();
-            auto a = r.direction().length_squared();
-            auto h = dot(r.direction(), oc);
-            auto c = oc.length_squared() - (radius * radius);
-
-            auto discriminant = (h * h) - (a * c);
-            if (discriminant < 0) { // D > 0 two real soln, D = 0 one real soln, D < 0 no real solutions
-                return false;
-            }
-            
-            auto sqrtd = std::sqrt(discriminant);
-
-            // Nearest root in acceptable range
-            auto root = (h - sqrtd) / a;
-            if (!ray_t.surrounds(root)) {
-                root = (h + sqrtd) / a;
-                if (!ray_t.surrounds(root)) {
-                    return false;
-                }
-            }
-
-            rec.t = root;
-            rec.p = r.at(rec.t);
-            vec3 outward_normal = (rec.p - center) / radius;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat = mat;
+            STAT_ADD(sphere_tests, 1);
+
+            real root;
+            if (!hit_sphere(r, center, radius, ray_t, root)) return false;
+
+            sphere_hit_record(r, center, radius, root, mat, rec);
+            STAT_ADD(sphere_hits, 1);
 
             return true;
         }
 
+        aabb bounding_box() const override { return bbox; }
+
     private:
         point3 center;
-        double radius;
-        shared_ptr<material> mat;
+        real radius;
+        material_id mat;
+        aabb bbox;
 };
 
 #endif
@@ -0,0 +1,452 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "bvh.h"
+#include "hittable.h"
+#include "mapped_file.h"
+#include "simd.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <vector>
+
+// many spheres stored as structure-of-arrays, tested against a ray a whole AVX register at a
+// time (4 doubles, or 8 floats). slots are grouped in batches of that size; unused slots hold
+// NaN centers, which never hit.
+// build() adds a BVH whose leaves are runs of whole batches, so the SIMD test also
+// serves as the leaf test. until then the set is tested flat.
+// a set can also be attached to arrays and a tree that already sit in memory (a mapped
+// binary scene file), in which case nothing is copied or built
+class sphere_set : public hittable {
+    public:
+        static constexpr int batch = 32 / sizeof(real);    // reals per AVX2 register
+
+        // the slot arrays, wherever they live
+        struct arrays {
+            const real* cx;
+            const real* cy;
+            const real* cz;
+            const real* rad;
+            const material_id* mat;
+        };
+
+        void add(const point3& center, real radius, material_id mat) {
+            if (mapping) return;                // attached sets are read-only
+            if (count % batch == 0) grow_batch();
+
+            cx[count] = center.x();
+            cy[count] = center.y();
+            cz[count] = center.z();
+            radius = std::fmax(real(0), radius);
+            rad[count] = radius;
+            mat_id[count] = mat;
+            slots.push_back(count);
+            count++;
+
+            auto rvec = vec3(radius, radius, radius);
+            bbox = aabb(bbox, aabb(center - rvec, center + rvec));
+        }
+
+        // reorders the spheres into BVH leaf order, padding each leaf to whole batches.
+        // call once every sphere has been added
+        void build(int max_leaf_size = 2 * batch) {
+            if (mapping) return;                // attached sets come with their tree
+            std::vector<aabb> boxes(count);
+            for (int k = 0; k < count; k++) {
+                auto rvec = vec3(rad[k], rad[k], rad[k]);
+                auto center = point3(cx[k], cy[k], cz[k]);
+                boxes[k] = aabb(center - rvec, center + rvec);
+            }
+            tree.build(boxes, max_leaf_size, batch);
+
+            sphere_set sorted;
+            for (auto& n : tree.nodes) {
+                if (n.count == 0) continue;
+
+                int first_slot = sorted.count;
+                for (int k = n.first; k < n.first + n.count; k++) {
+                    int prim = tree.prim_order[k];
+                    if (sorted.count % batch == 0) sorted.grow_batch();
+                    slots[prim] = sorted.count;
+                    sorted.cx[sorted.count] = cx[prim];
+                    sorted.cy[sorted.count] = cy[prim];
+                    sorted.cz[sorted.count] = cz[prim];
+                    sorted.rad[sorted.count] = rad[prim];
+                    sorted.mat_id[sorted.count] = mat_id[prim];
+                    sorted.count++;
+                }
+                // the next leaf starts on a fresh batch
+                sorted.count = int(sorted.cx.size());
+
+                n.first = first_slot;
+                n.count = sorted.count - first_slot;
+            }
+
+            cx = std::move(sorted.cx);
+            cy = std::move(sorted.cy);
+            cz = std::move(sorted.cz);
+            rad = std::move(sorted.rad);
+            mat_id = std::move(sorted.mat_id);
+            count = sorted.count;
+            tree.prim_order.clear();
+            tree.prim_order.shrink_to_fit();
+        }
+
+        // uses slot_count slots of data (a multiple of batch, laid out as build() leaves them)
+        // and the tree nodes in place. mapping is kept alive as long as the set
+        void attach(shared_ptr<const mapped_file> file, const arrays& data, int slot_count,
+                    const bvh_tree::node* nodes, size_t node_count) {
+            cx.clear(); cy.clear(); cz.clear(); rad.clear(); mat_id.clear(); slots.clear();
+            mapping = std::move(file);
+            mapped = data;
+            count = slot_count;
+            tree.attach(nodes, node_count);
+
+            if (node_count > 0) {
+                bbox = tree.bounding_box();
+            } else {
+                bbox = aabb();
+                for_each_sphere([&](const point3& center, real radius, material_id) {
+                    auto rvec = vec3(radius, radius, radius);
+                    bbox = aabb(bbox, aabb(center - rvec, center + rvec));
+                });
+            }
+        }
+
+        // MOTION: spheres are numbered in the order they were added (for a mapped set, slot
+        // order, once make_movable() has copied it). move() as many as needed, then refit()
+        // the hierarchy once for the frame
+
+        // copies a mapped set into memory, since only an owned set can move. nothing otherwise
+        void make_movable() {
+            if (!mapping) return;
+            auto s = mapped;
+            int slot_count = count;
+            std::vector<bvh_tree::node> nodes(tree.node_data(), tree.node_data() + tree.node_count());
+
+            cx.assign(s.cx, s.cx + slot_count);
+            cy.assign(s.cy, s.cy + slot_count);
+            cz.assign(s.cz, s.cz + slot_count);
+            rad.assign(s.rad, s.rad + slot_count);
+            mat_id.assign(s.mat, s.mat + slot_count);
+            for (int k = 0; k < slot_count; k++) {
+                if (!std::isnan(cx[k])) slots.push_back(k);
+            }
+
+            tree.attach(nullptr, 0);
+            tree.nodes = std::move(nodes);
+            mapping.reset();
+            mapped = {};
+        }
+
+        int sphere_count() const { return int(slots.size()); }
+
+        point3 center(int k) const { return point3(cx[slots[k]], cy[slots[k]], cz[slots[k]]); }
+
+        void move(int k, const point3& center) {
+            int slot = slots[k];
+            cx[slot] = center.x();
+            cy[slot] = center.y();
+            cz[slot] = center.z();
+        }
+
+        // brings the hierarchy's boxes up to date with moved spheres, keeping its shape
+        void refit() {
+            auto sphere_box = [&](int slot) {
+                auto rvec = vec3(rad[slot], rad[slot], rad[slot]);
+                auto center = point3(cx[slot], cy[slot], cz[slot]);
+                return aabb(center - rvec, center + rvec);
+            };
+
+            if (tree.node_count() == 0) {
+                bbox = aabb();
+                for (int slot : slots) bbox = aabb(bbox, sphere_box(slot));
+                return;
+            }
+
+            tree.refit([&](int first, int n) {
+                aabb box;
+                for (int slot = first; slot < first + n; slot++) {
+                    if (!std::isnan(cx[slot])) box = aabb(box, sphere_box(slot));
+                }
+                return box;
+            });
+            bbox = tree.bounding_box();
+        }
+
+        arrays data() const {
+            return mapping ? mapped : arrays{cx.data(), cy.data(), cz.data(), rad.data(), mat_id.data()};
+        }
+
+        // slots in use, leaf padding included
+        int slot_count() const { return count; }
+
+        const bvh_tree& hierarchy() const { return tree; }
+
+        // calls fn(center, radius, mat) for every sphere in slot order, skipping padding
+        template <typename sphere_fn>
+        void for_each_sphere(sphere_fn&& fn) const {
+            auto s = data();
+            for (int k = 0; k < count; k++) {
+                if (std::isnan(s.cx[k])) continue;
+                fn(point3(s.cx[k], s.cy[k], s.cz[k]), s.rad[k], s.mat[k]);
+            }
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            auto s = data();
+            int slot = -1;
+
+            if (tree.node_count() == 0) {
+                interval t = ray_t;
+                hit_slots(s, r, 0, count, t, slot);
+            } else {
+                tree.traverse(r, ray_t, [&](int first, int n, interval& t) {
+                    return hit_slots(s, r, first, n, t, slot);
+                });
+            }
+
+            if (slot < 0) return false;
+            winner_record(s, r, slot, ray_t, rec);
+            return true;
+        }
+
+        // the packet goes down the hierarchy together, and leaves test each sphere against a
+        // register of rays at a time. every ray ends with the hit hit() would give it
+        void hit_packet(ray_packet& packet) const override {
+            auto s = data();
+            packet_rays rays(packet);
+            int slot[ray_packet::max_size];
+            real t_limit[ray_packet::max_size];     // each ray's t_max going in, as hit() is given it
+            std::fill_n(slot, packet.size, -1);
+            std::copy_n(packet.t_max, packet.size, t_limit);
+
+            auto hit_leaf = [&](int first, int n, uint64_t lanes) { hit_slots_packet(s, packet, rays, first, n, lanes, slot); };
+            if (tree.node_count() == 0) {
+                hit_leaf(0, count, packet.size == 64 ? ~uint64_t(0) : (uint64_t(1) << packet.size) - 1);
+            } else {
+                tree.traverse_packet(packet, rays, hit_leaf);
+            }
+
+            for (int k = 0; k < packet.size; k++) {
+                if (slot[k] < 0) continue;
+                winner_record(s, packet.rays[k], slot[k], interval(packet.t_min, t_limit[k]), packet.recs[k]);
+                packet.hits |= uint64_t(1) << k;
+            }
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        size_t node_count() const { return tree.node_count(); }
+
+        // bytes held by the arrays and the hierarchy, mapped or owned
+        size_t memory_usage() const {
+            if (mapping) return size_t(count) * (4 * sizeof(real) + sizeof(material_id)) + tree.node_count() * sizeof(bvh_tree::node);
+            return cx.capacity() * 4 * sizeof(real) + mat_id.capacity() * sizeof(material_id) + slots.capacity() * sizeof(int)
+                   + tree.memory_usage();
+        }
+
+    private:
+        std::vector<real> cx, cy, cz, rad;
+        std::vector<material_id> mat_id;
+        std::vector<int> slots;                 // slot of each sphere, in the order added
+        int count = 0;                          // used slots, padding between leaves included
+        aabb bbox;
+        bvh_tree tree;
+        shared_ptr<const mapped_file> mapping;  // set when attached; then mapped replaces the vectors
+        arrays mapped = {};
+
+        void grow_batch() {
+            auto nan = std::numeric_limits<real>::quiet_NaN();
+            cx.resize(cx.size() + batch, nan);
+            cy.resize(cy.size() + batch, nan);
+            cz.resize(cz.size() + batch, nan);
+            rad.resize(rad.size() + batch, 0);
+            mat_id.resize(mat_id.size() + batch, 0);
+        }
+
+        // fills rec for the sphere in slot, found to be r's nearest in ray_t. t is recomputed for
+        // the winner only, so rec matches sphere::hit exactly
+        static void winner_record(const arrays& s, const ray& r, int slot, const interval& ray_t, hit_record& rec) {
+            point3 center(s.cx[slot], s.cy[slot], s.cz[slot]);
+            vec3 oc = center - r.origin();
+            auto a = r.direction().length_squared();
+            auto h = dot(r.direction(), oc);
+            vec3 l = oc - (h / a) * r.direction();
+            auto sqrtd = std::sqrt(std::fmax(real(0), a * ((s.rad[slot] * s.rad[slot]) - l.length_squared())));
+
+            auto root = (h - sqrtd) / a;
+            if (!ray_t.surrounds(root)) root = (h + sqrtd) / a;
+
+            sphere_hit_record(r, center, s.rad[slot], root, s.mat[slot], rec);
+            STAT_ADD(sphere_set_hits, 1);
+        }
+
+        // hit_slots turned around: each sphere of slots [first, first + n) against the rays in
+        // lanes, a register of rays at a time, keeping each ray's closest hit in its t_max and slot
+        bool hit_slots_packet(const arrays& s, ray_packet& packet, [[maybe_unused]] const packet_rays& rays, int first, int n,
+                              uint64_t lanes, int* slot) const {
+            STAT_ADD(sphere_set_tests, n * __builtin_popcountll(lanes));
+            bool hit_anything = false;
+
+#if defined(__AVX2__)
+            constexpr uint64_t register_lanes = (uint64_t(1) << simd::width) - 1;
+            const simd::reg tmin = simd::set1(packet.t_min);
+            const simd::reg no_hit = simd::set1(infinity);
+            const simd::reg zero = simd::zero();
+
+            for (int k = first; k < first + n; k++) {
+                if (std::isnan(s.cx[k])) continue;     // padding
+                const simd::reg cx = simd::set1(s.cx[k]), cy = simd::set1(s.cy[k]), cz = simd::set1(s.cz[k]);
+                const simd::reg rv = simd::set1(s.rad[k]);
+
+                for (int base = 0; base < packet.size; base += simd::width) {
+                    int group = int((lanes >> base) & register_lanes);
+                    if (group == 0) continue;
+
+                    // the arithmetic of hit_slots, one ray per lane
+                    simd::reg dx = simd::load(&rays.direction[0][base]);
+                    simd::reg dy = simd::load(&rays.direction[1][base]);
+                    simd::reg dz = simd::load(&rays.direction[2][base]);
+                    simd::reg av = simd::load(&rays.length_sq[base]);
+                    simd::reg ocx = simd::sub(cx, simd::load(&rays.origin[0][base]));
+                    simd::reg ocy = simd::sub(cy, simd::load(&rays.origin[1][base]));
+                    simd::reg ocz = simd::sub(cz, simd::load(&rays.origin[2][base]));
+
+                    simd::reg h = simd::add(simd::add(simd::mul(dx, ocx), simd::mul(dy, ocy)), simd::mul(dz, ocz));
+                    simd::reg along = simd::div(h, av);
+                    simd::reg lx = simd::sub(ocx, simd::mul(along, dx));
+                    simd::reg ly = simd::sub(ocy, simd::mul(along, dy));
+                    simd::reg lz = simd::sub(ocz, simd::mul(along, dz));
+                    simd::reg l2 = simd::add(simd::add(simd::mul(lx, lx), simd::mul(ly, ly)), simd::mul(lz, lz));
+                    simd::reg disc = simd::mul(av, simd::sub(simd::mul(rv, rv), l2));
+
+                    simd::reg real_roots = simd::greater_equal(disc, zero);
+                    if ((simd::mask_bits(real_roots) & group) == 0) continue;
+
+                    simd::reg sqrtd = simd::sqrt(simd::max(disc, zero));
+                    simd::reg tmax = simd::load(&packet.t_max[base]);
+
+                    simd::reg near_root = simd::div(simd::sub(h, sqrtd), av);
+                    simd::reg far_root = simd::div(simd::add(h, sqrtd), av);
+                    simd::reg near_ok = simd::both(simd::greater(near_root, tmin), simd::less(near_root, tmax));
+                    simd::reg far_ok = simd::both(simd::greater(far_root, tmin), simd::less(far_root, tmax));
+
+                    simd::reg t = simd::select(simd::select(no_hit, far_root, far_ok), near_root, near_ok);
+                    t = simd::select(no_hit, t, real_roots);
+
+                    int closer = simd::mask_bits(simd::less(t, tmax)) & group;
+                    if (closer == 0) continue;
+
+                    real ts[simd::width];
+                    simd::store(ts, t);
+                    for (; closer; closer &= closer - 1) {
+                        int lane = __builtin_ctz(closer);
+                        packet.t_max[base + lane] = ts[lane];
+                        slot[base + lane] = k;
+                    }
+                    hit_anything = true;
+                }
+            }
+#else
+            for (; lanes; lanes &= lanes - 1) {
+                int lane = lowest_lane(lanes);
+                interval t(packet.t_min, packet.t_max[lane]);
+                if (hit_slots(s, packet.rays[lane], first, n, t, slot[lane])) {
+                    packet.t_max[lane] = t.max;
+                    hit_anything = true;
+                }
+            }
+#endif
+
+            return hit_anything;
+        }
+
+        // tests slots [first, first + n) and keeps the closest hit in ray_t.max and slot.
+        // n may end mid-batch; the rest of that batch is padding
+        bool hit_slots(const arrays& s, const ray& r, int first, int n, interval& ray_t, int& slot) const {
+            STAT_ADD(sphere_set_tests, n);
+
+            bool hit_anything = false;
+            const point3& o = r.origin();
+            const vec3& d = r.direction();
+            auto a = d.length_squared();
+
+#if defined(__AVX2__)
+            // same arithmetic as hit_sphere, one sphere per lane
+            const simd::reg ox = simd::set1(o.x()), oy = simd::set1(o.y()), oz = simd::set1(o.z());
+            const simd::reg dx = simd::set1(d.x()), dy = simd::set1(d.y()), dz = simd::set1(d.z());
+            const simd::reg av = simd::set1(a);
+            const simd::reg tmin = simd::set1(ray_t.min);
+            const simd::reg no_hit = simd::set1(infinity);
+            const simd::reg zero = simd::zero();
+
+            for (int k = first; k < first + n; k += batch) {
+                simd::reg ocx = simd::sub(simd::load(&s.cx[k]), ox);
+                simd::reg ocy = simd::sub(simd::load(&s.cy[k]), oy);
+                simd::reg ocz = simd::sub(simd::load(&s.cz[k]), oz);
+                simd::reg rv = simd::load(&s.rad[k]);
+
+                simd::reg h = simd::add(simd::add(simd::mul(dx, ocx), simd::mul(dy, ocy)), simd::mul(dz, ocz));
+                simd::reg along = simd::div(h, av);
+                simd::reg lx = simd::sub(ocx, simd::mul(along, dx));
+                simd::reg ly = simd::sub(ocy, simd::mul(along, dy));
+                simd::reg lz = simd::sub(ocz, simd::mul(along, dz));
+                simd::reg l2 = simd::add(simd::add(simd::mul(lx, lx), simd::mul(ly, ly)), simd::mul(lz, lz));
+                simd::reg disc = simd::mul(av, simd::sub(simd::mul(rv, rv), l2));
+
+                // NaN padding fails this compare too
+                simd::reg real_roots = simd::greater_equal(disc, zero);
+                if (simd::mask_bits(real_roots) == 0) continue;
+
+                simd::reg sqrtd = simd::sqrt(simd::max(disc, zero));
+                simd::reg tmax = simd::set1(ray_t.max);
+
+                simd::reg near_root = simd::div(simd::sub(h, sqrtd), av);
+                simd::reg far_root = simd::div(simd::add(h, sqrtd), av);
+                simd::reg near_ok = simd::both(simd::greater(near_root, tmin), simd::less(near_root, tmax));
+                simd::reg far_ok = simd::both(simd::greater(far_root, tmin), simd::less(far_root, tmax));
+
+                simd::reg t = simd::select(simd::select(no_hit, far_root, far_ok), near_root, near_ok);
+                t = simd::select(no_hit, t, real_roots);
+
+                int lanes = simd::mask_bits(simd::less(t, tmax));
+                if (lanes == 0) continue;
+
+                real ts[batch];
+                simd::store(ts, t);
+                for (int lane = 0; lane < batch; lane++) {
+                    if ((lanes & (1 << lane)) && ts[lane] < ray_t.max) {
+                        ray_t.max = ts[lane];
+                        slot = k + lane;
+                        hit_anything = true;
+                    }
+                }
+            }
+#else
+            for (int k = first; k < first + n; k++) {
+                auto ocx = s.cx[k] - o.x(), ocy = s.cy[k] - o.y(), ocz = s.cz[k] - o.z();
+                auto h = d.x() * ocx + d.y() * ocy + d.z() * ocz;
+                auto along = h / a;
+                auto lx = ocx - along * d.x(), ly = ocy - along * d.y(), lz = ocz - along * d.z();
+                auto discriminant = a * ((s.rad[k] * s.rad[k]) - (lx * lx + ly * ly + lz * lz));
+                if (!(discriminant >= 0)) continue;
+
+                auto sqrtd = std::sqrt(discriminant);
+                auto root = (h - sqrtd) / a;
+                if (!ray_t.surrounds(root)) {
+                    root = (h + sqrtd) / a;
+                    if (!ray_t.surrounds(root)) continue;
+                }
+
+                ray_t.max = root;
+                slot = k;
+                hit_anything = true;
+            }
+#endif
+
+            return hit_anything;
+        }
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef STATIC_SCENE_H
+#define STATIC_SCENE_H
+
+#include "hittable.h"
+
+#include <tuple>
+#include <vector>
+
+// a hittable_list whose primitive types are fixed at compile time: one contiguous vector of
+// values per type, tested type by type. the calls into each primitive's hit are qualified, so
+// they are direct and inline into the loop instead of going through the vtable and a pointer
+// per object. it is still a hittable for code that takes one; templated callers such as
+// camera::render see the final type and skip the one virtual call at the top as well
+//
+//     static_scene<sphere> world;
+//     world.add(sphere(center, radius, mat));
+//     cam.render(world, materials);
+template <typename... primitives>
+class static_scene final : public hittable {
+    public:
+        template <typename T>
+        void add(T object) {
+            bbox = aabb(bbox, object.bounding_box());
+            std::get<std::vector<T>>(objects).push_back(std::move(object));
+        }
+
+        void clear() {
+            std::apply([](auto&... lists) { (lists.clear(), ...); }, objects);
+            bbox = aabb();
+        }
+
+        template <typename T>
+        const std::vector<T>& all() const { return std::get<std::vector<T>>(objects); }
+
+        size_t size() const {
+            return std::apply([](const auto&... lists) { return (size_t(0) + ... + lists.size()); }, objects);
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            bool hit_anything = false;
+            std::apply([&](const auto&... lists) { ((hit_anything |= hit_each(lists, r, ray_t, rec)), ...); }, objects);
+            return hit_anything;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+    private:
+        std::tuple<std::vector<primitives>...> objects;
+        aabb bbox;
+
+        // the nearest hit among list, narrowing ray_t to it so later lists only look closer
+        template <typename T>
+        static bool hit_each(const std::vector<T>& list, const ray& r, interval& ray_t, hit_record& rec) {
+            hit_record temp_rec;
+            bool hit_anything = false;
+            for (const auto& object : list) {
+                if (object.T::hit(r, ray_t, temp_rec)) {
+                    hit_anything = true;
+                    ray_t.max = temp_rec.t;
+                    rec = temp_rec;
+                }
+            }
+            return hit_anything;
+        }
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// rectangular block of pixels [x0, x1) x [y0, y1)
+struct tile {
+    int x0, y0, x1, y1;
+};
+
+// hands tiles out to a fixed set of workers. each worker owns a deque seeded with a
+// contiguous run of tiles and pops from the front of it; once it runs dry it steals
+// from the back of the other workers' deques, so slow (expensive) regions get shared out
+class tile_scheduler {
+    public:
+        tile_scheduler(const std::vector<tile>& tiles, int num_workers) {
+            for (int w = 0; w < num_workers; w++) {
+                queues.push_back(std::make_unique<worker_queue>());
+            }
+
+            // contiguous runs keep neighbouring tiles (and their cache lines) on one worker
+            size_t per_worker = (tiles.size() + num_workers - 1) / num_workers;
+            for (size_t k = 0; k < tiles.size(); k++) {
+                queues[k / per_worker]->tiles.push_back(tiles[k]);
+            }
+        }
+
+        // returns false once every queue is empty
+        bool next(int worker, tile& out) {
+            if (pop_front(*queues[worker], out)) return true;
+
+            int n = int(queues.size());
+            for (int k = 1; k < n; k++) {
+                if (steal_back(*queues[(worker + k) % n], out)) return true;
+            }
+            return false;
+        }
+
+    private:
+        // aligned so the per-worker locks don't share a cache line
+        struct alignas(64) worker_queue {
+            std::mutex lock;
+            std::deque<tile> tiles;
+        };
+
+        std::vector<std::unique_ptr<worker_queue>> queues;
+
+        static bool pop_front(worker_queue& q, tile& out) {
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.tiles.empty()) return false;
+            out = q.tiles.front();
+            q.tiles.pop_front();
+            return true;
+        }
+
+        static bool steal_back(worker_queue& q, tile& out) {
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.tiles.empty()) return false;
+            out = q.tiles.back();
+            q.tiles.pop_back();
+            return true;
+        }
+};
+
+#endif
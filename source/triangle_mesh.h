@@ -0,0 +1,164 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "bvh.h"
+#include "hittable.h"
+
+#include <cstdint>
+#include <vector>
+
+// indexed triangle mesh: a shared vertex buffer plus three vertex indices per triangle,
+// all with one material. build() adds a BVH over the triangles (reordering the index buffer
+// into leaf order), so hit cost grows with the log of the face count. until then the mesh
+// is tested flat
+class triangle_mesh : public hittable {
+    public:
+        std::vector<point3> vertices;
+        std::vector<uint32_t> indices;          // triangle k is vertices[indices[3k..3k+2]]
+        material_id mat = 0;
+
+        size_t triangle_count() const { return indices.size() / 3; }
+
+        // call once every triangle has been added
+        void build(int max_leaf_size = 4) {
+            size_t count = triangle_count();
+            std::vector<aabb> boxes(count);
+            for (size_t k = 0; k < count; k++) boxes[k] = triangle_box(k);
+            tree.build(boxes, max_leaf_size);
+
+            std::vector<uint32_t> sorted(indices.size());
+            for (size_t k = 0; k < count; k++) {
+                size_t prim = size_t(tree.prim_order[k]);
+                for (int corner = 0; corner < 3; corner++) sorted[3 * k + corner] = indices[3 * prim + corner];
+            }
+            indices = std::move(sorted);
+            tree.prim_order.clear();
+            tree.prim_order.shrink_to_fit();
+
+            bbox = tree.bounding_box();
+        }
+
+        // brings the hierarchy's boxes up to date after vertices moved, keeping its shape, so
+        // an animated mesh costs one pass per frame instead of a build
+        void refit() {
+            if (tree.node_count() == 0) return;
+            tree.refit([&](int first, int n) {
+                aabb box;
+                for (int k = first; k < first + n; k++) box = aabb(box, triangle_box(size_t(k)));
+                return box;
+            });
+            bbox = tree.bounding_box();
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            int winner = -1;
+
+            if (tree.node_count() == 0) {
+                interval t = ray_t;
+                hit_triangles(r, 0, int(triangle_count()), t, winner);
+            } else {
+                tree.traverse(r, ray_t, [&](int first, int n, interval& t) {
+                    return hit_triangles(r, first, n, t, winner);
+                });
+            }
+
+            if (winner < 0) return false;
+
+            // t is recomputed for the winner only, with the same arithmetic as the test
+            const point3& v0 = vertices[indices[3 * winner]];
+            vec3 edge1 = vertices[indices[3 * winner + 1]] - v0;
+            vec3 edge2 = vertices[indices[3 * winner + 2]] - v0;
+            vec3 pvec = cross(r.direction(), edge2);
+            vec3 tvec = r.origin() - v0;
+            vec3 qvec = cross(tvec, edge1);
+            auto inv_det = 1 / dot(edge1, pvec);
+
+            rec.t = dot(edge2, qvec) * inv_det;
+
+            // the point from its barycentrics is accurate to the size of the triangle's
+            // coordinates, where r.at(t) would carry the error of t along the whole ray
+            auto u = dot(tvec, pvec) * inv_det;
+            auto v = dot(r.direction(), qvec) * inv_det;
+            rec.p = v0 + u * edge1 + v * edge2;
+            rec.p_error = rounding_error(7) * (max_abs_component(v0) + max_abs_component(edge1) + max_abs_component(edge2));
+
+            rec.set_face_normal(r, unit_vector(cross(edge1, edge2)));
+            rec.mat = mat;
+            STAT_ADD(triangle_hits, 1);
+
+            return true;
+        }
+
+        aabb bounding_box() const override {
+            if (tree.node_count() > 0) return bbox;
+
+            aabb box;
+            for (size_t k = 0; k < triangle_count(); k++) box = aabb(box, triangle_box(k));
+            return box;
+        }
+
+        size_t node_count() const { return tree.node_count(); }
+
+        // bytes held by the vertex and index buffers and the hierarchy
+        size_t memory_usage() const {
+            return vertices.capacity() * sizeof(point3) + indices.capacity() * sizeof(uint32_t) + tree.memory_usage();
+        }
+
+    private:
+        bvh_tree tree;
+        aabb bbox;
+
+        aabb triangle_box(size_t k) const {
+            const point3& a = vertices[indices[3 * k]];
+            const point3& b = vertices[indices[3 * k + 1]];
+            const point3& c = vertices[indices[3 * k + 2]];
+            aabb box(aabb(a, b), aabb(c, c));
+
+            // an axis-aligned triangle has a flat box, which the slab test would never hit
+            const real delta = real(0.0001);
+            return aabb(box.x.size() < delta ? box.x.expand(delta) : box.x,
+                        box.y.size() < delta ? box.y.expand(delta) : box.y,
+                        box.z.size() < delta ? box.z.expand(delta) : box.z);
+        }
+
+        // Moller-Trumbore test of triangles [first, first + n), keeping the closest hit in
+        // ray_t.max and winner. edges are shared exactly between neighbours (u, v and u + v
+        // are compared inclusively), so rays can't slip through the seams of a closed mesh
+        bool hit_triangles(const ray& r, int first, int n, interval& ray_t, int& winner) const {
+            STAT_ADD(triangle_tests, n);
+
+            bool hit_anything = false;
+            const point3& orig = r.origin();
+            const vec3& dir = r.direction();
+
+            for (int k = first; k < first + n; k++) {
+                const point3& v0 = vertices[indices[3 * k]];
+                vec3 edge1 = vertices[indices[3 * k + 1]] - v0;
+                vec3 edge2 = vertices[indices[3 * k + 2]] - v0;
+
+                vec3 pvec = cross(dir, edge2);
+                auto det = dot(edge1, pvec);
+                if (det == 0) continue;         // ray parallel to the triangle's plane
+                auto inv_det = 1 / det;
+
+                vec3 tvec = orig - v0;
+                auto u = dot(tvec, pvec) * inv_det;
+                if (u < 0 || u > 1) continue;
+
+                vec3 qvec = cross(tvec, edge1);
+                auto v = dot(dir, qvec) * inv_det;
+                if (v < 0 || u + v > 1) continue;
+
+                auto t = dot(edge2, qvec) * inv_det;
+                if (!ray_t.surrounds(t)) continue;
+
+                ray_t.max = t;
+                winner = k;
+                hit_anything = true;
+            }
+
+            return hit_anything;
+        }
+};
+
+#endif
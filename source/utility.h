@@ -7,28 +7,46 @@
 #include <limits>
 #include <memory>
 
+#include "rng.h"
+
 // c++ std usings
 using std::make_shared;
 using std::shared_ptr;
 
+// scalar type of all geometry and shading math. double unless built with RAY_TRACER_FLOAT,
+// which halves the size of every vector, box and sphere and doubles the SIMD width
+#if defined(RAY_TRACER_FLOAT)
+using real = float;
+#else
+using real = double;
+#endif
+
 // constants
-const double infinity = std::numeric_limits<double>::infinity();
-const double pi = 3.1415926535897932385;
+const real infinity = std::numeric_limits<real>::infinity();
+const real pi = real(3.1415926535897932385);
 
 // utility functions
 inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
-inline double random_double() {
-    return std::rand() / (RAND_MAX + 1.0);
+// bound on the relative rounding error of n chained floating-point operations
+// (pbrt's gamma), used to size how far spawned rays start from a surface
+constexpr real rounding_error(int n) {
+    constexpr real unit_roundoff = std::numeric_limits<real>::epsilon() / 2;
+    return (n * unit_roundoff) / (1 - n * unit_roundoff);
+}
+
+inline double random_double(rng& gen) {
+    return gen.next_double();
 }
 
-inline double random_double(double min, double max) {
-    return min + (max - min) * random_double();
+inline double random_double(rng& gen, double min, double max) {
+    return min + (max - min) * random_double(gen);
 }
 
 // common headers
+#include "render_stats.h"
 #include "color.h"
 #include "interval.h"
 #include "ray.h"
@@ -3,22 +3,22 @@
 
 class vec3 {
     public:
-        double e[3];
+        real e[3];
 
         // default constructor
         vec3() : e{0,0,0} {}
         // parameterized constructor
-        vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+        vec3(real e0, real e1, real e2) : e{e0, e1, e2} {}
 
         // getter functions
-        double x() const { return e[0]; }
-        double y() const { return e[1]; }
-        double z() const { return e[2]; }
+        real x() const { return e[0]; }
+        real y() const { return e[1]; }
+        real z() const { return e[2]; }
 
         // operator overloading, say vec3 v --> -v, v[1] (read and modify) are now available
         vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-        double operator[](int i) const { return e[i]; }
-        double& operator[](int i) { return e[i]; }
+        real operator[](int i) const { return e[i]; }
+        real& operator[](int i) { return e[i]; }
 
         vec3& operator +=(const vec3& v) {  // vec3& says fn returns reference NOT COPY to vec3 object
             e[0] += v.e[0];
@@ -27,36 +27,36 @@ class vec3 {
             return *this;                   // this is pointer to curr obj, * dereferences it
         }
 
-        vec3& operator*=(double t) {
+        vec3& operator*=(real t) {
             e[0] *= t;
             e[1] *= t;
             e[2] *= t;
             return *this;
         }
 
-        vec3& operator/=(double t) {
+        vec3& operator/=(real t) {
             return *this *= 1/t;
         }
 
-        double length() const {
+        real length() const {
             return std::sqrt(length_squared());
         }
 
-        double length_squared() const {
+        real length_squared() const {
             return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
         }
 
         bool near_zero() const {
-            auto s = 1e-8;
+            auto s = real(1e-8);
             return (std::fabs(e[0]) < s) && (std::fabs(e[1]) < s) && (std::fabs(e[2]) < s);
         }
 
-        static vec3 random() {
-            return vec3(random_double(), random_double(), random_double());
+        static vec3 random(rng& gen) {
+            return vec3(random_double(gen), random_double(gen), random_double(gen));
         }
 
-        static vec3 random(double min, double max) {
-            return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+        static vec3 random(rng& gen, double min, double max) {
+            return vec3(random_double(gen, min, max), random_double(gen, min, max), random_double(gen, min, max));
         }
 };
 
@@ -86,19 +86,19 @@ inline vec3 operator*(const vec3& u, const vec3& v) {
     return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3& v) {
+inline vec3 operator*(real t, const vec3& v) {
     return vec3(t * v.e[0],t * v.e[1], t * v.e[2]);
 }
 
-inline vec3 operator*(const vec3& v, double t) {
+inline vec3 operator*(const vec3& v, real t) {
     return t * v;
 }
 
-inline vec3 operator/(const vec3& v, double t) {
+inline vec3 operator/(const vec3& v, real t) {
     return (1/t) * v;
 }
 
-inline double dot(const vec3& u, const vec3& v) {
+inline real dot(const vec3& u, const vec3& v) {
     return u.e[0] * v.e[0] +
            u.e[1] * v.e[1] +
            u.e[2] * v.e[2];
@@ -114,25 +114,29 @@ inline vec3 unit_vector(const vec3& v) {
     return v / v.length();
 }
 
-inline vec3 random_in_unit_disk() {
+inline real max_abs_component(const vec3& v) {
+    return std::fmax(std::fabs(v.e[0]), std::fmax(std::fabs(v.e[1]), std::fabs(v.e[2])));
+}
+
+inline vec3 random_in_unit_disk(rng& gen) {
     while (true) {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
+        auto p = vec3(random_double(gen, -1, 1), random_double(gen, -1, 1), 0);
         if (p.length_squared() < 1) return p;
     }
 }
 
-inline vec3 random_unit_vector() {
+inline vec3 random_unit_vector(rng& gen) {
     while (true) {
-        auto p = vec3::random(-1, 1);
+        auto p = vec3::random(gen, -1, 1);
         auto lensq = p.length_squared();
-        if (1e-160 < lensq && lensq <= 1)   // avoids (0, 0, 0) vector
-            return p / sqrt(lensq);
+        if (std::numeric_limits<real>::min() < lensq && lensq <= 1)   // avoids (0, 0, 0) vector
+            return p / std::sqrt(lensq);
     }
 }
 
-inline vec3 random_on_hemisphere(const vec3& normal) {
-    vec3 on_unit_sphere = random_unit_vector();
-    if (dot(on_unit_sphere, normal) > 0.0) {
+inline vec3 random_on_hemisphere(rng& gen, const vec3& normal) {
+    vec3 on_unit_sphere = random_unit_vector(gen);
+    if (dot(on_unit_sphere, normal) > 0) {
         return on_unit_sphere;
     } else {
         return -on_unit_sphere;
@@ -143,10 +147,10 @@ inline vec3 reflect(const vec3& v, const vec3& n) {
     return v - (2 * dot(v, n) * n);
 }
 
-inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
-    auto cos_theta = std::fmin(dot(-uv, n), 1.0);
+inline vec3 refract(const vec3& uv, const vec3& n, real etai_over_etat) {
+    auto cos_theta = std::fmin(dot(-uv, n), real(1));
     vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
-    vec3 r_out_parallel = -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())) * n;
+    vec3 r_out_parallel = -std::sqrt(std::fabs(1 - r_out_perp.length_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
 
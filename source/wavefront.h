@@ -0,0 +1,200 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "hittable.h"
+#include "light.h"
+#include "material.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <variant>
+#include <vector>
+
+// one Russian roulette step: the path survives with probability tied to how much it can
+// still add, and survivors are scaled up by 1/p so the expected value is unchanged
+inline bool survives_roulette(color& throughput, sampler& gen) {
+    auto p = std::fmin(std::fmax(throughput.x(), std::fmax(throughput.y(), throughput.z())), 0.95);
+    if (random_double(gen) >= p) return false;
+    throughput /= p;
+    return true;
+}
+
+// a camera sample in flight
+struct path_state {
+    ray r;
+    color throughput;
+    sampler gen;                                // the sample's own stream, as in camera::ray_color
+    real bsdf_pdf = 0;                          // pdf the last bounce chose r with, 0 if lights can't be sampled there
+};
+
+// breadth-first path tracer: instead of following one path to the end, every live path
+// advances one bounce per pass through these stages
+//   1. intersect every live ray, in packets through world.hit_packet. paths are in pixel
+//      order, so a packet's camera rays are coherent; its bounces leave from close together
+//      but spread out, and are tested ray by ray at every node (see ray_packet::coherent)
+//   2. bin the hits by material type
+//   3. scatter each bin in its own loop, with the material type known at compile time;
+//      diffuse hits also queue a shadow ray toward a light
+//   4. trace the shadow rays, in packets as well
+//   5. compact the surviving paths into the next pass
+// paths consume their random numbers in the same order as camera::ray_color, so each
+// path ends with exactly the radiance the depth-first loop would give it
+class wavefront_tracer {
+    public:
+        int max_depth = 10;
+        bool russian_roulette = true;
+        int roulette_min_bounces = 3;
+        const light_list* lights = nullptr;     // sampled at diffuse hits, as camera::lights
+
+        // traces paths to completion; radiance[k] receives path k's contribution
+        template <typename world_type, typename background_fn>
+        void trace(std::vector<path_state>& paths, std::vector<color>& radiance,
+                   const world_type& world, const material_table& materials, background_fn&& background) {
+            radiance.assign(paths.size(), color(0, 0, 0));
+            hits.resize(paths.size());
+
+            active.clear();
+            for (int k = 0; k < int(paths.size()); k++) active.push_back(k);
+
+            for (int bounce = 0; bounce < max_depth && !active.empty(); bounce++) {
+                for (auto& bin : bins) bin.clear();
+
+                // intersect; escaped paths pick up the background and retire here, and hits
+                // on lights pick up their light
+                if (bounce == 0) STAT_ADD(primary_rays, active.size());
+                else STAT_ADD(secondary_rays, active.size());
+
+                found.assign(paths.size(), 0);
+                packet.coherent = bounce == 0;
+                intersect(active, world, [&](int k, ray& r, real& t_max) { r = paths[k].r; t_max = infinity; },
+                          [&](int k, const hit_record& rec) { hits[k] = rec; found[k] = 1; });
+
+                for (int k : active) {
+                    auto& path = paths[k];
+                    if (found[k]) {
+                        if (materials.emits(hits[k].mat)) {
+                            radiance[k] += path.throughput * emitted_light(lights, materials, path.r, hits[k], path.bsdf_pdf);
+                        }
+                        bins[materials[hits[k].mat].index()].push_back(k);
+                    } else {
+                        radiance[k] += path.throughput * background(path.r);
+                        STAT_PATH(bounce + 1);
+                    }
+                }
+
+                next_active.clear();
+                shadows.clear();
+                static_assert(std::variant_size<material>::value == 4, "every material type needs a scatter_bin pass");
+                scatter_bin<lambertian>(paths, materials, bounce);
+                scatter_bin<metal>(paths, materials, bounce);
+                scatter_bin<dielectric>(paths, materials, bounce);
+                scatter_bin<emissive>(paths, materials, bounce);
+
+                // unblocked shadow rays add their light
+                STAT_ADD(shadow_rays, shadows.size());
+                traced.resize(shadows.size());
+                for (int s = 0; s < int(shadows.size()); s++) traced[s] = s;
+                blocked.assign(shadows.size(), 0);
+                packet.coherent = false;
+                intersect(traced, world, [&](int s, ray& r, real& t_max) { r = shadows[s].r; t_max = shadows[s].t_max; },
+                          [&](int s, const hit_record&) { blocked[s] = 1; });
+                for (int s = 0; s < int(shadows.size()); s++) {
+                    if (!blocked[s]) radiance[shadows[s].path] += shadows[s].light;
+                }
+
+                // restore path order so the next intersection pass walks memory front to back
+                std::sort(next_active.begin(), next_active.end());
+                std::swap(active, next_active);
+            }
+
+            // whatever is left ran out of bounces
+            for (size_t k = 0; k < active.size(); k++) STAT_PATH(max_depth);
+        }
+
+    private:
+        struct shadow_ray {
+            int path;
+            ray r;
+            real t_max;
+            color light;                        // added to the path's radiance if nothing blocks r
+        };
+
+        std::vector<hit_record> hits;           // indexed like paths
+        std::vector<int> active, next_active;   // indices of live paths
+        std::vector<int> bins[std::variant_size<material>::value];
+        std::vector<shadow_ray> shadows;
+        std::vector<int> traced;                // indices of the shadow rays
+        std::vector<uint8_t> found, blocked;    // per path: hits[k] is set; per shadow ray: it hit something
+        ray_packet packet;
+
+        // traces the rays of order through world, ray_packet::max_size at a time. ray_of(k, r, t_max)
+        // fills in ray k, which is hit in (0, t_max); on_hit(k, rec) gets its nearest hit
+        template <typename world_type, typename ray_fn, typename hit_fn>
+        void intersect(const std::vector<int>& order, const world_type& world, ray_fn&& ray_of, hit_fn&& on_hit) {
+            for (size_t first = 0; first < order.size(); first += ray_packet::max_size) {
+                packet.size = int(std::min(order.size() - first, size_t(ray_packet::max_size)));
+                packet.hits = 0;
+                for (int lane = 0; lane < packet.size; lane++) ray_of(order[first + lane], packet.rays[lane], packet.t_max[lane]);
+
+                world.hit_packet(packet);
+                for (uint64_t lanes = packet.hits; lanes; lanes &= lanes - 1) {
+                    int lane = lowest_lane(lanes);
+                    on_hit(order[first + lane], packet.recs[lane]);
+                }
+            }
+        }
+
+        template <typename T>
+        void scatter_bin(std::vector<path_state>& paths, const material_table& materials, int bounce) {
+            STAT_ADD(scatter_calls[variant_index<T>()], bins[variant_index<T>()].size());
+
+            for (int k : bins[variant_index<T>()]) {
+                auto& path = paths[k];
+                const auto& rec = hits[k];
+                const auto& mat = std::get<T>(materials[rec.mat]);
+                bool sample_lights = false;
+
+                // light sampling draws its numbers before the scatter, as in camera::ray_color
+                if constexpr (std::is_same_v<T, lambertian>) {
+                    path.gen.seek(bounce, sampler::light_choice);
+                    sample_lights = lights && !lights->empty();
+                    shadow_ray shadow;
+                    if (sample_lights && sample_direct_light(*lights, mat, rec, path.gen, shadow.r, shadow.t_max, shadow.light)) {
+                        shadow.path = k;
+                        shadow.light = path.throughput * shadow.light;
+                        shadows.push_back(shadow);
+                    }
+                }
+
+                ray scattered;
+                color attenuation;
+                path.gen.seek(bounce, sampler::scatter);
+                if (!mat.scatter(path.r, rec, attenuation, scattered, path.gen)) {
+                    STAT_PATH(bounce + 1);
+                    continue;
+                }
+                path.throughput = path.throughput * attenuation;
+                path.bsdf_pdf = 0;
+                if constexpr (std::is_same_v<T, lambertian>) {
+                    if (sample_lights) path.bsdf_pdf = mat.scatter_pdf(rec, unit_vector(scattered.direction()));
+                }
+
+                path.gen.seek(bounce, sampler::roulette);
+                if (russian_roulette && bounce + 1 >= roulette_min_bounces && !survives_roulette(path.throughput, path.gen)) {
+                    STAT_PATH(bounce + 1);
+                    continue;
+                }
+
+                path.r = scattered;
+                next_active.push_back(k);
+            }
+        }
+
+        template <typename T, size_t index = 0>
+        static constexpr size_t variant_index() {
+            if constexpr (std::is_same_v<std::variant_alternative_t<index, material>, T>) return index;
+            else return variant_index<T, index + 1>();
+        }
+};
+
+#endif